@@ -0,0 +1,175 @@
+/*
+ * Measures datagram throughput over loopback UDP, with sender and receiver on the same loop.
+ * Every loop iteration sends a burst of POLLEN_DGRAM_BATCH datagrams, and the receiver reads them:
+ *   - recvfrom: fd callback that drains the socket, one sendto/recvfrom per datagram;
+ *   - mmsg: dgram callbacks, sendmmsg/recvmmsg per batch;
+ *   - gso/gro: dgram callbacks with POLLEN_DGRAM_GSO and POLLEN_DGRAM_GRO.
+ * Datagrams dropped because the receive buffer was full are reported, not counted as received.
+ *
+ * Usage: dgram [n_datagrams] [size]
+ */
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+enum mode {
+    MODE_RECVFROM,
+    MODE_MMSG,
+    MODE_GSO_GRO,
+};
+
+static const char *const mode_names[] = {
+    [MODE_RECVFROM] = "recvfrom",
+    [MODE_MMSG] = "mmsg",
+    [MODE_GSO_GRO] = "gso/gro",
+};
+
+static struct sockaddr_in receiver_addr;
+static int sender_fd;
+static struct pollen_callback *sender;
+static enum mode mode;
+static unsigned long n_target, n_sent, n_received;
+static size_t dgram_size;
+static char payload[65536];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int make_socket(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    const int rcvbuf = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    *addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(*addr);
+    if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &len) < 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    return fd;
+}
+
+static int recvfrom_callback(struct pollen_callback *callback, int fd, uint32_t events,
+                             void *data) {
+    char buf[65536];
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    while (recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addrlen) > 0) {
+        n_received += 1;
+        addrlen = sizeof(addr);
+    }
+    return 0;
+}
+
+static int dgram_callback(struct pollen_callback *callback, struct pollen_dgram *dgrams,
+                          size_t n, void *data) {
+    for (size_t i = 0; i < n; i++) {
+        n_received += (dgrams[i].segment_size != 0)
+            ? (dgrams[i].len + dgrams[i].segment_size - 1) / dgrams[i].segment_size
+            : 1;
+    }
+    return 0;
+}
+
+static void send_burst(void) {
+    for (int i = 0; i < POLLEN_DGRAM_BATCH && n_sent < n_target; i++) {
+        if (mode == MODE_RECVFROM) {
+            if (sendto(sender_fd, payload, dgram_size, 0, (struct sockaddr *)&receiver_addr,
+                       sizeof(receiver_addr)) < 0) {
+                break;
+            }
+        } else if (!pollen_dgram_send(sender, payload, dgram_size,
+                                      (struct sockaddr *)&receiver_addr,
+                                      sizeof(receiver_addr))) {
+            break;
+        }
+        n_sent += 1;
+    }
+    if (mode != MODE_RECVFROM) {
+        pollen_dgram_flush(sender);
+    }
+}
+
+static void run(enum mode m) {
+    struct sockaddr_in sender_addr;
+    struct pollen_loop *loop = pollen_loop_create();
+    if (loop == NULL) {
+        perror("pollen_loop_create");
+        exit(1);
+    }
+
+    mode = m;
+    n_sent = n_received = 0;
+
+    const int receiver_fd = make_socket(&receiver_addr);
+    sender_fd = make_socket(&sender_addr);
+
+    struct pollen_callback *receiver;
+    if (mode == MODE_RECVFROM) {
+        receiver = pollen_loop_add_fd(loop, receiver_fd, EPOLLIN, true, recvfrom_callback, NULL);
+    } else {
+        const unsigned flags = (mode == MODE_GSO_GRO) ? POLLEN_DGRAM_GRO : 0;
+        receiver = pollen_loop_add_dgram(loop, receiver_fd, true, 65535, flags,
+                                         dgram_callback, NULL);
+        sender = pollen_loop_add_dgram(loop, sender_fd, true, 65507,
+                                       (mode == MODE_GSO_GRO) ? POLLEN_DGRAM_GSO : 0,
+                                       dgram_callback, NULL);
+        if (sender == NULL) {
+            perror("pollen_loop_add_dgram");
+            exit(1);
+        }
+    }
+    if (receiver == NULL) {
+        perror("pollen_loop_add");
+        exit(1);
+    }
+
+    const uint64_t start = now_ns();
+    while (n_sent < n_target) {
+        send_burst();
+        pollen_loop_dispatch(loop, 0);
+    }
+    /* receive whatever is still in flight */
+    while (n_received < n_sent && pollen_loop_dispatch(loop, 10000000) > 0) {}
+    const uint64_t elapsed = now_ns() - start;
+
+    printf("%10s %12.1f %12.2f %10lu\n", mode_names[mode], (double)elapsed / n_received,
+           n_received * 1e3 / elapsed, n_sent - n_received);
+
+    pollen_loop_cleanup(loop);
+    if (mode == MODE_RECVFROM) {
+        close(sender_fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    n_target = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+    dgram_size = (argc > 2) ? strtoul(argv[2], NULL, 10) : 64;
+    if (dgram_size == 0 || dgram_size > 1472) {
+        fprintf(stderr, "size must be between 1 and 1472\n");
+        return 1;
+    }
+
+    printf("datagrams: %lu, size: %zu, batch: %d\n", n_target, dgram_size, POLLEN_DGRAM_BATCH);
+    printf("%10s %12s %12s %10s\n", "mode", "ns/dgram", "Mdgrams/s", "dropped");
+    run(MODE_RECVFROM);
+    run(MODE_MMSG);
+    run(MODE_GSO_GRO);
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Measures the cost of dispatching one ready event when a lot of fds are registered.
+ * Every fd is an eventfd that never gets drained, so it stays readable forever and
+ * every epoll_wait returns a full batch. Between registrations, a connection-sized
+ * object is allocated to scatter callbacks over the heap like a real server would.
+ *
+ * Usage: dispatch [n_fds] [n_events]
+ */
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+static unsigned long events_dispatched = 0;
+static unsigned long events_target = 0;
+
+static int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    if (++events_dispatched == events_target) {
+        pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    }
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long raise_fd_limit(long wanted) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        return -1;
+    }
+    if ((rlim_t)wanted > rl.rlim_max) {
+        rl.rlim_max = wanted;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        /* not privileged enough to raise hard limit, use what we have */
+        getrlimit(RLIMIT_NOFILE, &rl);
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur;
+}
+
+int main(int argc, char **argv) {
+    long n_fds = (argc > 1) ? atol(argv[1]) : 100000;
+    events_target = (argc > 2) ? strtoul(argv[2], NULL, 10) : 10000000;
+
+    long limit = raise_fd_limit(n_fds + 64);
+    if (limit < n_fds + 64) {
+        fprintf(stderr, "RLIMIT_NOFILE is %ld, using %ld fds instead of %ld\n",
+                limit, limit - 64, n_fds);
+        n_fds = limit - 64;
+    }
+
+    struct pollen_loop *loop = pollen_loop_create();
+    if (loop == NULL) {
+        perror("pollen_loop_create");
+        return 1;
+    }
+
+    void **connections = calloc(n_fds, sizeof(*connections));
+    for (long i = 0; i < n_fds; i++) {
+        int efd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd < 0) {
+            perror("eventfd");
+            return 1;
+        }
+        if (pollen_loop_add_fd(loop, efd, EPOLLIN, true, fd_callback, NULL) == NULL) {
+            perror("pollen_loop_add_fd");
+            return 1;
+        }
+        connections[i] = malloc(200 + rand() % 300);
+    }
+
+    const uint64_t start = now_ns();
+    pollen_loop_run(loop);
+    const uint64_t elapsed = now_ns() - start;
+
+    printf("fds: %ld, events: %lu, batch: %d\n", n_fds, events_dispatched, POLLEN_EPOLL_MAX_EVENTS);
+    printf("%.1f ns/event, %.2f Mevents/s\n",
+           (double)elapsed / events_dispatched, events_dispatched * 1e3 / elapsed);
+
+    pollen_loop_cleanup(loop);
+    for (long i = 0; i < n_fds; i++) {
+        free(connections[i]);
+    }
+    free(connections);
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Measures how the loop scales with the amount of registered fds.
+ * For every loop size, each fd is one end of a socketpair, and the peer end is kept to make
+ * the fd readable. Reported per loop size:
+ *   - registration cost per fd (pollen_loop_add_fd);
+ *   - bytes allocated by pollen per callback, including the fd table;
+ *   - cost of one pollen_loop_dispatch iteration with no active fds,
+ *     and per event for each active ratio (active fds are never drained, so they stay ready);
+ *   - cleanup cost per fd (pollen_loop_cleanup).
+ *
+ * Usage: scale [max_fds] [iterations]
+ */
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static size_t allocated_bytes = 0;
+
+static void *counting_calloc(size_t n, size_t size) {
+    allocated_bytes += n * size;
+    return calloc(n, size);
+}
+
+#define POLLEN_CALLOC(n, size) counting_calloc(n, size)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+static const double active_ratios[] = { 0.001, 0.01, 0.1, 1.0 };
+#define N_RATIOS (sizeof(active_ratios) / sizeof(active_ratios[0]))
+
+static unsigned long events_dispatched = 0;
+
+static int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    events_dispatched += 1;
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long raise_fd_limit(long wanted) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        return -1;
+    }
+    if ((rlim_t)wanted > rl.rlim_max) {
+        rl.rlim_max = wanted;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        /* not privileged enough to raise hard limit, use what we have */
+        getrlimit(RLIMIT_NOFILE, &rl);
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur;
+}
+
+static void run(long n_fds, long iterations) {
+    int *local = calloc(n_fds, sizeof(*local));
+    int *peer = calloc(n_fds, sizeof(*peer));
+    for (long i = 0; i < n_fds; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        local[i] = sv[0];
+        peer[i] = sv[1];
+    }
+
+    allocated_bytes = 0;
+    struct pollen_loop *loop = pollen_loop_create();
+    if (loop == NULL) {
+        perror("pollen_loop_create");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < n_fds; i++) {
+        if (pollen_loop_add_fd(loop, local[i], EPOLLIN, true, fd_callback, NULL) == NULL) {
+            perror("pollen_loop_add_fd");
+            exit(1);
+        }
+    }
+    const double add_ns = (double)(now_ns() - start) / n_fds;
+    const double bytes_per_fd = (double)allocated_bytes / n_fds;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        pollen_loop_dispatch(loop, 0);
+    }
+    const double idle_ns = (double)(now_ns() - start) / iterations;
+
+    printf("%8ld %10.1f %10.1f %10.1f", n_fds, add_ns, bytes_per_fd, idle_ns);
+
+    for (size_t r = 0; r < N_RATIOS; r++) {
+        /* spread active fds evenly over the table */
+        long n_active = (long)(n_fds * active_ratios[r]);
+        if (n_active < 1) {
+            n_active = 1;
+        }
+        const long step = n_fds / n_active;
+        for (long i = 0; i < n_active; i++) {
+            if (write(peer[i * step], "x", 1) != 1) {
+                perror("write");
+                exit(1);
+            }
+        }
+
+        events_dispatched = 0;
+        start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            pollen_loop_dispatch(loop, 0);
+        }
+        const uint64_t elapsed = now_ns() - start;
+        printf(" %10.1f", (double)elapsed / events_dispatched);
+
+        char c;
+        for (long i = 0; i < n_active; i++) {
+            if (read(local[i * step], &c, 1) != 1) {
+                perror("read");
+                exit(1);
+            }
+        }
+    }
+
+    start = now_ns();
+    pollen_loop_cleanup(loop);
+    printf(" %10.1f\n", (double)(now_ns() - start) / n_fds);
+
+    /* local ends were closed by autoclose */
+    for (long i = 0; i < n_fds; i++) {
+        close(peer[i]);
+    }
+    free(local);
+    free(peer);
+}
+
+int main(int argc, char **argv) {
+    long max_fds = (argc > 1) ? atol(argv[1]) : 100000;
+    const long iterations = (argc > 2) ? atol(argv[2]) : 10000;
+
+    /* every fd needs a peer */
+    long limit = raise_fd_limit(max_fds * 2 + 64);
+    if (limit < max_fds * 2 + 64) {
+        fprintf(stderr, "RLIMIT_NOFILE is %ld, using %ld fds instead of %ld\n",
+                limit, (limit - 64) / 2, max_fds);
+        max_fds = (limit - 64) / 2;
+    }
+
+    printf("batch: %d, iterations: %ld\n", POLLEN_EPOLL_MAX_EVENTS, iterations);
+    printf("%8s %10s %10s %10s", "fds", "add ns/fd", "bytes/fd", "idle ns");
+    for (size_t r = 0; r < N_RATIOS; r++) {
+        char header[32];
+        snprintf(header, sizeof(header), "ns/ev %g%%", active_ratios[r] * 100);
+        printf(" %10s", header);
+    }
+    printf(" %10s\n", "free ns/fd");
+
+    for (long n_fds = 100; n_fds < max_fds; n_fds *= 10) {
+        run(n_fds, iterations);
+    }
+    run(max_fds, iterations);
+
+    return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Randomized stress test. Keeps a table of slots, each holding a pipe, a timer or an efd
+ * callback, and for the given duration randomly adds, removes, pokes and toggles them,
+ * both from an idle callback and from inside the callbacks themselves.
+ * A separate thread feeds sequence numbers into a channel at the same time.
+ *
+ * Checked invariants:
+ *   - no lost events: everything written to pipes/efds is received, armed timers fire,
+ *     channel messages arrive in order and none are missing;
+ *   - no stale dispatch: callbacks only run for live slots, pipe callbacks always have data;
+ *   - no leaks: open fd count and amount of live allocations are the same before and after.
+ *
+ * Exits with status 1 on the first violated invariant, otherwise prints throughput.
+ * Meant to be also built with -fsanitize=address or -fsanitize=thread.
+ *
+ * Usage: stress [seconds] [seed] [n_slots]
+ */
+#include <sys/resource.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+
+static atomic_long live_allocations = 0;
+
+static void *counting_calloc(size_t n, size_t size) {
+    void *ptr = calloc(n, size);
+    if (ptr != NULL) {
+        atomic_fetch_add(&live_allocations, 1);
+    }
+    return ptr;
+}
+
+static void counting_free(void *ptr) {
+    if (ptr != NULL) {
+        atomic_fetch_sub(&live_allocations, 1);
+    }
+    free(ptr);
+}
+
+#define POLLEN_CALLOC(n, size) counting_calloc(n, size)
+#define POLLEN_FREE(ptr) counting_free(ptr)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: invariant violated: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+enum slot_kind {
+    SLOT_FREE,
+    SLOT_PIPE,
+    SLOT_TIMER,
+    SLOT_EFD,
+};
+
+struct slot {
+    enum slot_kind kind;
+    struct pollen_callback *callback;
+    int read_fd, write_fd; /* pipe only */
+    bool enabled; /* pipe only, whether EPOLLIN is set */
+    bool armed; /* timer only, armed and has not fired yet */
+    uint64_t sent, received; /* bytes for pipes, increments for efds */
+};
+
+static struct pollen_loop *loop;
+static struct slot *slots;
+static long n_slots;
+static bool churn = true;
+
+static uint64_t rng_state;
+static unsigned long n_ops, n_events;
+
+static struct pollen_channel *channel;
+static atomic_bool producer_stop = false;
+static uint64_t channel_sent, channel_received;
+
+static uint64_t rng(void) {
+    /* xorshift64 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long count_open_fds(void) {
+    long n = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    CHECK(dir != NULL);
+    while (readdir(dir) != NULL) {
+        n += 1;
+    }
+    closedir(dir);
+    return n;
+}
+
+static void random_op(void);
+
+static int pipe_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    struct slot *slot = data;
+    CHECK(slot->kind == SLOT_PIPE && slot->callback == callback && slot->read_fd == fd);
+    CHECK(slot->enabled);
+
+    char buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    CHECK(n > 0);
+    slot->received += n;
+    CHECK(slot->received <= slot->sent);
+
+    n_events += 1;
+    if (churn) {
+        random_op();
+    }
+    return 0;
+}
+
+static int timer_callback(struct pollen_callback *callback, void *data) {
+    struct slot *slot = data;
+    CHECK(slot->kind == SLOT_TIMER && slot->callback == callback);
+    CHECK(slot->armed);
+    slot->armed = false;
+
+    n_events += 1;
+    if (churn) {
+        random_op();
+    }
+    return 0;
+}
+
+static int efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    struct slot *slot = data;
+    CHECK(slot->kind == SLOT_EFD && slot->callback == callback);
+    slot->received += val;
+    CHECK(slot->received <= slot->sent);
+
+    n_events += 1;
+    if (churn) {
+        random_op();
+    }
+    return 0;
+}
+
+static int channel_callback(struct pollen_callback *callback, const void *msgs, size_t n,
+                            void *data) {
+    const uint64_t *seq = msgs;
+    for (size_t i = 0; i < n; i++) {
+        CHECK(seq[i] == channel_received);
+        channel_received += 1;
+    }
+
+    n_events += n;
+    return 0;
+}
+
+static void *producer_thread(void *data) {
+    uint64_t seq = 0;
+    while (!atomic_load(&producer_stop)) {
+        if (pollen_channel_send(channel, &seq)) {
+            seq += 1;
+        } else {
+            CHECK(errno == EAGAIN);
+            sched_yield();
+        }
+    }
+
+    channel_sent = seq;
+    return NULL;
+}
+
+static void slot_add(struct slot *slot) {
+    switch (rng() % 3) {
+    case 0: {
+        int fds[2];
+        CHECK(pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0);
+        slot->callback = pollen_loop_add_fd(loop, fds[0], EPOLLIN, true, pipe_callback, slot);
+        CHECK(slot->callback != NULL);
+        slot->kind = SLOT_PIPE;
+        slot->read_fd = fds[0];
+        slot->write_fd = fds[1];
+        slot->enabled = true;
+        break;
+    }
+    case 1:
+        slot->callback = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, timer_callback, slot);
+        CHECK(slot->callback != NULL);
+        slot->kind = SLOT_TIMER;
+        break;
+    case 2:
+        slot->callback = pollen_loop_add_efd(loop, efd_callback, slot);
+        CHECK(slot->callback != NULL);
+        slot->kind = SLOT_EFD;
+        break;
+    }
+}
+
+static void slot_remove(struct slot *slot) {
+    pollen_loop_remove_callback(slot->callback);
+    if (slot->kind == SLOT_PIPE) {
+        close(slot->write_fd);
+    }
+    *slot = (struct slot){ .kind = SLOT_FREE };
+}
+
+static void slot_poke(struct slot *slot) {
+    switch (slot->kind) {
+    case SLOT_PIPE:
+        if (write(slot->write_fd, "x", 1) == 1) {
+            slot->sent += 1;
+        } else {
+            /* pipe is full because reading is disabled */
+            CHECK(errno == EAGAIN && !slot->enabled);
+        }
+        break;
+    case SLOT_TIMER:
+        CHECK(pollen_timer_arm_us(slot->callback, false, 1 + rng() % 2000, 0));
+        slot->armed = true;
+        break;
+    case SLOT_EFD:
+        CHECK(pollen_efd_trigger(slot->callback));
+        slot->sent += 1;
+        break;
+    case SLOT_FREE:
+        break;
+    }
+}
+
+static void slot_toggle(struct slot *slot) {
+    switch (slot->kind) {
+    case SLOT_PIPE:
+        slot->enabled = !slot->enabled;
+        CHECK(pollen_fd_modify_events(slot->callback, slot->enabled ? EPOLLIN : 0));
+        break;
+    case SLOT_TIMER:
+        CHECK(pollen_timer_disarm(slot->callback));
+        slot->armed = false;
+        break;
+    default:
+        break;
+    }
+}
+
+static void random_op(void) {
+    struct slot *slot = &slots[rng() % n_slots];
+    const unsigned dice = rng() % 100;
+
+    if (slot->kind == SLOT_FREE) {
+        slot_add(slot);
+    } else if (dice < 15) {
+        slot_remove(slot);
+    } else if (dice < 25) {
+        slot_toggle(slot);
+    } else {
+        slot_poke(slot);
+    }
+
+    n_ops += 1;
+}
+
+static int idle_callback(struct pollen_callback *callback, void *data) {
+    const uint64_t *deadline = data;
+
+    for (int i = 0; i < 16; i++) {
+        random_op();
+    }
+
+    if ((n_ops & 1023) < 16 && now_ns() >= *deadline) {
+        pollen_loop_quit(loop, 0);
+    }
+    return 0;
+}
+
+static bool all_delivered(void) {
+    for (long i = 0; i < n_slots; i++) {
+        const struct slot *slot = &slots[i];
+        if (slot->received != slot->sent || slot->armed) {
+            return false;
+        }
+    }
+    return channel_received == channel_sent;
+}
+
+int main(int argc, char **argv) {
+    const double seconds = (argc > 1) ? atof(argv[1]) : 10;
+    const uint64_t seed = (argc > 2) ? strtoull(argv[2], NULL, 10) : (uint64_t)time(NULL);
+    n_slots = (argc > 3) ? atol(argv[3]) : 2000;
+
+    /* every pipe slot takes 2 fds */
+    struct rlimit rl;
+    CHECK(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if ((rlim_t)n_slots * 2 + 64 > rl.rlim_cur) {
+        n_slots = (rl.rlim_cur - 64) / 2;
+        fprintf(stderr, "RLIMIT_NOFILE is %lu, using %ld slots\n", (unsigned long)rl.rlim_cur,
+                n_slots);
+    }
+
+    printf("seed %lu, %ld slots, %.1f seconds\n", (unsigned long)seed, n_slots, seconds);
+    rng_state = seed ? seed : 1;
+
+    const long fds_before = count_open_fds();
+
+    CHECK((slots = calloc(n_slots, sizeof(*slots))));
+    CHECK((loop = pollen_loop_create()));
+
+    CHECK((channel = pollen_channel_create(sizeof(uint64_t), 1024, POLLEN_CHANNEL_SPSC)));
+    struct pollen_callback *consumer;
+    CHECK((consumer = pollen_loop_add_channel_consumer(loop, channel, channel_callback, NULL)));
+    pthread_t producer;
+    CHECK(pthread_create(&producer, NULL, producer_thread, NULL) == 0);
+
+    const uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t)(seconds * 1e9);
+    struct pollen_callback *idle;
+    CHECK((idle = pollen_loop_add_idle(loop, 0, idle_callback, &deadline)));
+
+    CHECK(pollen_loop_run(loop) == 0);
+    const uint64_t elapsed = now_ns() - start;
+
+    /* stop generating new work, reenable everything and wait until all of it is delivered */
+    churn = false;
+    pollen_loop_remove_callback(idle);
+    atomic_store(&producer_stop, true);
+    CHECK(pthread_join(producer, NULL) == 0);
+    for (long i = 0; i < n_slots; i++) {
+        if (slots[i].kind == SLOT_PIPE && !slots[i].enabled) {
+            slot_toggle(&slots[i]);
+        }
+    }
+
+    const uint64_t drain_deadline = now_ns() + 5000000000;
+    while (!all_delivered() && now_ns() < drain_deadline) {
+        CHECK(pollen_loop_dispatch(loop, 10000000) >= 0);
+    }
+    for (long i = 0; i < n_slots; i++) {
+        const struct slot *slot = &slots[i];
+        if (slot->received != slot->sent || slot->armed) {
+            fprintf(stderr, "slot %ld (kind %d): sent %lu received %lu armed %d\n", i, slot->kind,
+                    (unsigned long)slot->sent, (unsigned long)slot->received, slot->armed);
+        }
+    }
+    CHECK(all_delivered());
+
+    for (long i = 0; i < n_slots; i++) {
+        if (slots[i].kind != SLOT_FREE) {
+            slot_remove(&slots[i]);
+        }
+    }
+    pollen_loop_remove_callback(consumer);
+    pollen_loop_cleanup(loop);
+    pollen_channel_destroy(channel);
+    free(slots);
+
+    CHECK(count_open_fds() == fds_before);
+    CHECK(atomic_load(&live_allocations) == 0);
+
+    const double secs = elapsed / 1e9;
+    printf("%lu ops (%.0f/s), %lu events (%.0f/s), %lu channel messages (%.0f/s)\n",
+           n_ops, n_ops / secs, n_events, n_events / secs,
+           (unsigned long)channel_received, channel_received / secs);
+
+    return 0;
+}
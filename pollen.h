@@ -11,6 +11,61 @@
  *   POLLEN_EPOLL_MAX_EVENTS - Maximum amount of events processed during one loop iteration.
  *     Default: #define POLLEN_EPOLL_MAX_EVENTS 32
  *
+ *   POLLEN_TIMEOUT_GRANULARITY_MS - Resolution of fd inactivity timeouts, in milliseconds.
+ *     Default: #define POLLEN_TIMEOUT_GRANULARITY_MS 100
+ *   POLLEN_TIMEOUT_WHEEL_SLOTS - Amount of buckets in inactivity timeout wheel. Must be a power of 2.
+ *     Default: #define POLLEN_TIMEOUT_WHEEL_SLOTS 256
+ *
+ *   POLLEN_CHANNEL_BATCH - Maximum amount of messages delivered to channel consumer at once.
+ *     Default: #define POLLEN_CHANNEL_BATCH 64
+ *
+ *   POLLEN_DGRAM_BATCH - Maximum amount of datagrams received or sent with one syscall
+ *     by datagram callbacks. Every datagram callback preallocates two batches of buffers.
+ *     Default: #define POLLEN_DGRAM_BATCH 32
+ *
+ *   POLLEN_LISTENER_BATCH - Maximum amount of connections accepted by listener callback
+ *     on one readiness event and delivered to it at once.
+ *     Default: #define POLLEN_LISTENER_BATCH 64
+ *   POLLEN_LISTENER_RETRY_MS - How long listener stops accepting after accept4(2) fails
+ *     because process ran out of fds or memory, in milliseconds.
+ *     Default: #define POLLEN_LISTENER_RETRY_MS 100
+ *
+ *   POLLEN_DEFER_CAPACITY - Amount of tasks queued with pollen_loop_defer that fit in the
+ *     ring preallocated by every loop. The ring doubles when it fills up. Must be a power of 2.
+ *     Default: #define POLLEN_DEFER_CAPACITY 64
+ *
+ *   POLLEN_GROUP_DEQUE_CAPACITY - Initial capacity of the task deque of every loop in a loop group,
+ *     see pollen_loop_spawn. The deque doubles when it fills up. Must be a power of 2.
+ *     Default: #define POLLEN_GROUP_DEQUE_CAPACITY 256
+ *   POLLEN_GROUP_TASK_BATCH - Maximum amount of group tasks run by a loop during one iteration,
+ *     so that fd events are not starved by a long backlog.
+ *     Default: #define POLLEN_GROUP_TASK_BATCH 16
+ *
+ *   POLLEN_CLOCK - Clock used for loop time (pollen_loop_now) and inactivity timeouts.
+ *     CLOCK_MONOTONIC_COARSE is cheaper to read, but only has a resolution of a few milliseconds,
+ *     so loop time may lag behind timer expirations by that much.
+ *     Default: #define POLLEN_CLOCK CLOCK_MONOTONIC
+ *
+ *   POLLEN_NO_IDLE, POLLEN_NO_SIGNALS, POLLEN_NO_TIMERS, POLLEN_NO_EFDS, POLLEN_NO_CHANNELS,
+ *   POLLEN_NO_DGRAMS, POLLEN_NO_LISTENERS -
+ *     If defined, corresponding callback type and all code supporting it is left out.
+ *     Inactivity timeouts and rate limits are built on timers and are also left out by POLLEN_NO_TIMERS.
+ *   POLLEN_NO_TRACE - If defined, event tracing (pollen_loop_trace_*) and recording
+ *     (pollen_loop_record_*, pollen_loop_replay) are left out.
+ *   POLLEN_NO_METRICS - If defined, publishing metrics (pollen_loop_metrics_*) is left out.
+ *   POLLEN_NO_GROUPS - If defined, loop groups (pollen_group_*, pollen_loop_spawn) are left out.
+ *     Loop groups are built on efds and are also left out by POLLEN_NO_EFDS.
+ *   POLLEN_NO_ASYNC_CLOSE - If defined, closing fds on a background thread
+ *     (pollen_loop_set_async_close) is left out.
+ *
+ *   POLLEN_USDT - If defined, USDT probes for bpftrace/systemtap are emitted under provider "pollen".
+ *     Probes are a single nop each and don't require sys/sdt.h. Only 64-bit targets are supported.
+ *       wakeup(n_events)
+ *       callback_start(type, fd), callback_end(type, fd, ret)
+ *       callback_add(type, fd), callback_remove(type, fd)
+ *       timer_expire(fd, expirations), efd_read(fd, value), signal(signum)
+ *     type is a value of enum pollen_callback_type, fd is -1 for idle and signal callbacks.
+ *
  *   POLLEN_CALLOC(n, size) - calloc()-like function that will be used to allocate memory.
  *     Default: #define POLLEN_CALLOC(n, size) calloc(n, size)
  *   POLLEN_FREE(ptr) - free()-like function that will be used to free memory.
@@ -36,6 +91,47 @@
     #define POLLEN_EPOLL_MAX_EVENTS 32
 #endif
 
+#if !defined(POLLEN_TIMEOUT_GRANULARITY_MS)
+    #define POLLEN_TIMEOUT_GRANULARITY_MS 100
+#endif
+#if !defined(POLLEN_TIMEOUT_WHEEL_SLOTS)
+    #define POLLEN_TIMEOUT_WHEEL_SLOTS 256
+#endif
+
+#if !defined(POLLEN_CHANNEL_BATCH)
+    #define POLLEN_CHANNEL_BATCH 64
+#endif
+
+#if !defined(POLLEN_DGRAM_BATCH)
+    #define POLLEN_DGRAM_BATCH 32
+#endif
+
+#if !defined(POLLEN_LISTENER_BATCH)
+    #define POLLEN_LISTENER_BATCH 64
+#endif
+
+#if !defined(POLLEN_LISTENER_RETRY_MS)
+    #define POLLEN_LISTENER_RETRY_MS 100
+#endif
+
+#if !defined(POLLEN_DEFER_CAPACITY)
+    #define POLLEN_DEFER_CAPACITY 64
+#endif
+
+#if !defined(POLLEN_GROUP_DEQUE_CAPACITY)
+    #define POLLEN_GROUP_DEQUE_CAPACITY 256
+#endif
+#if !defined(POLLEN_GROUP_TASK_BATCH)
+    #define POLLEN_GROUP_TASK_BATCH 16
+#endif
+#if defined(POLLEN_NO_EFDS) && !defined(POLLEN_NO_GROUPS)
+    #define POLLEN_NO_GROUPS
+#endif
+
+#if !defined(POLLEN_CLOCK)
+    #define POLLEN_CLOCK CLOCK_MONOTONIC
+#endif
+
 #if !defined(POLLEN_CALLOC) || !defined(POLLEN_FREE)
     #include <stdlib.h>
 #endif
@@ -62,12 +158,37 @@
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#if !defined(POLLEN_NO_DGRAMS)
+    #include <sys/socket.h>
+#endif
+
+/* Used by USDT probes and struct pollen_metrics. */
+enum pollen_callback_type {
+    POLLEN_CALLBACK_TYPE_FD,
+    POLLEN_CALLBACK_TYPE_IDLE,
+    POLLEN_CALLBACK_TYPE_SIGNAL,
+    POLLEN_CALLBACK_TYPE_TIMER,
+    POLLEN_CALLBACK_TYPE_EFD,
+    POLLEN_CALLBACK_TYPE_CHANNEL,
+    POLLEN_CALLBACK_TYPE_DGRAM,
+    POLLEN_CALLBACK_TYPE_LISTENER,
+};
+#define POLLEN_CALLBACK_TYPES 8
 
+struct pollen_loop;
 struct pollen_callback;
+struct pollen_rate_limit;
+struct pollen_fd_batch;
+struct pollen_dgram;
 typedef int (*pollen_fd_callback_fn)(struct pollen_callback *callback,
                                      int fd, uint32_t events, void *data);
+typedef int (*pollen_fd_timeout_fn)(struct pollen_callback *callback,
+                                   int fd, void *data);
+typedef int (*pollen_fd_iter_fn)(struct pollen_callback *callback,
+                                 int fd, void *data);
 typedef int (*pollen_idle_callback_fn)(struct pollen_callback *callback,
                                        void *data);
 typedef int (*pollen_signal_callback_fn)(struct pollen_callback *callback,
@@ -76,6 +197,25 @@ typedef int (*pollen_timer_callback_fn)(struct pollen_callback *callback,
                                         void *data);
 typedef int (*pollen_efd_callback_fn)(struct pollen_callback *callback,
                                       uint64_t val, void *data);
+typedef int (*pollen_channel_recv_fn)(struct pollen_callback *callback,
+                                      const void *msgs, size_t n, void *data);
+typedef int (*pollen_channel_writable_fn)(struct pollen_callback *callback,
+                                          void *data);
+typedef int (*pollen_dgram_recv_fn)(struct pollen_callback *callback,
+                                    struct pollen_dgram *dgrams, size_t n, void *data);
+typedef int (*pollen_listener_fn)(struct pollen_callback *callback,
+                                  const int *fds, size_t n, void *data);
+
+/* Ready fd callback passed to pollen_fd_batch_fn, along with its fd and user data. */
+struct pollen_fd_event {
+    struct pollen_callback *callback;
+    void *data;
+    int fd;
+    uint32_t events;
+};
+typedef int (*pollen_fd_batch_fn)(struct pollen_loop *loop,
+                                  const struct pollen_fd_event *events, size_t n, void *data);
+typedef int (*pollen_defer_fn)(struct pollen_loop *loop, void *data);
 
 /* Creates a new pollen_loop instance. Returns NULL and sets errno on failure. */
 struct pollen_loop *pollen_loop_create(void);
@@ -94,6 +234,43 @@ struct pollen_callback *pollen_loop_add_fd(struct pollen_loop *loop,
                                            pollen_fd_callback_fn callback_fn,
                                            void *data);
 
+/*
+ * Size and alignment of a callback, for keeping callbacks in caller-owned memory.
+ * The size fits struct pollen_callback in every configuration.
+ */
+#define POLLEN_CALLBACK_SIZE 192
+#define POLLEN_CALLBACK_ALIGN 8
+
+/* Caller-owned memory for one callback, see pollen_loop_add_fd_static. Contents are private. */
+struct pollen_callback_storage {
+    _Alignas(POLLEN_CALLBACK_ALIGN) unsigned char opaque[POLLEN_CALLBACK_SIZE];
+};
+
+/*
+ * Same as pollen_loop_add_fd, but the callback is placed in storage instead of being allocated,
+ * so it can be embedded in the object it serves, for example a connection struct.
+ * Returned callback points to storage.
+ *
+ * Storage must stay valid until the callback is removed. If it is removed while the loop
+ * is dispatching events, storage must stay valid until the current iteration ends.
+ * Together with pollen_loop_reserve_fds, this adds callbacks without allocating memory.
+ *
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_callback *pollen_loop_add_fd_static(struct pollen_loop *loop,
+                                                  struct pollen_callback_storage *storage,
+                                                  int fd, uint32_t events, bool autoclose,
+                                                  pollen_fd_callback_fn callback_fn,
+                                                  void *data);
+
+/*
+ * Grows fd table of the loop, so fds up to max_fd can be added without allocating memory.
+ * The table otherwise grows on demand when callbacks are added.
+ *
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_loop_reserve_fds(struct pollen_loop *loop, int max_fd);
+
 /*
  * Modifies fd callback by calling epoll_ctl(2) with EPOLL_CTL_MOD.
  * Argument new_events directly corresponds to epoll_event.events field.
@@ -102,6 +279,123 @@ struct pollen_callback *pollen_loop_add_fd(struct pollen_loop *loop,
  */
 bool pollen_fd_modify_events(struct pollen_callback *callback, uint32_t new_events);
 
+/* Describes one fd for pollen_loop_add_fds. Fields have the same meaning as pollen_loop_add_fd args. */
+struct pollen_fd_spec {
+    int fd;
+    uint32_t events;
+    bool autoclose;
+    pollen_fd_callback_fn callback;
+    void *data;
+};
+
+/*
+ * Adds n fds at once. This is the same as calling pollen_loop_add_fd for every spec,
+ * but memory for all callbacks is allocated in one block and the fd table grows at most once.
+ * If out is not NULL, created callbacks are stored there in the same order as specs.
+ *
+ * Either all fds are added or none are: on failure, fds that were already added are
+ * removed again without being closed, regardless of autoclose.
+ *
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_loop_add_fds(struct pollen_loop *loop, const struct pollen_fd_spec *specs, size_t n,
+                         struct pollen_callback **out);
+
+#if !defined(POLLEN_NO_TIMERS)
+/*
+ * Sets up inactivity timeout for fd callback.
+ * If no activity was recorded on the callback for timeout_ms milliseconds, timeout_fn will run.
+ * Activity is recorded every time the fd callback runs, or manually with pollen_fd_touch.
+ * After timeout_fn runs, the timeout stays armed and counts from the moment it fired.
+ * Timeouts are checked lazily by a single timer wheel shared by all fd callbacks of the loop,
+ * so timeout_fn may run up to POLLEN_TIMEOUT_GRANULARITY_MS late.
+ * Passing timeout_ms = 0 disables the timeout.
+ *
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_fd_set_timeout(struct pollen_callback *callback, unsigned long timeout_ms,
+                           pollen_fd_timeout_fn timeout_fn);
+
+/*
+ * Records activity on fd callback, postponing its inactivity timeout.
+ * This does not make any syscalls, it only updates a timestamp in the callback.
+ */
+void pollen_fd_touch(struct pollen_callback *callback);
+
+/*
+ * Token bucket that refills at rate tokens per second, up to burst tokens. Starts full.
+ * Any amount of fd callbacks can be attached to one bucket with pollen_fd_set_rate_limit,
+ * and share its tokens, which are taken with pollen_fd_consume. What a token means is up to
+ * the user: consume amount of bytes read for bytes/s, or 1 per callback run for events/s.
+ *
+ * When the bucket runs out of tokens, EPOLLIN is removed from all attached fds.
+ * It is restored by an internal timer as soon as the bucket has tokens again.
+ * Bucket can go into debt, so consuming more tokens than available is fine,
+ * and the fds stay suspended for longer to pay it back.
+ *
+ * Buckets are destroyed with the loop, or with pollen_rate_limit_destroy.
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_rate_limit *pollen_loop_add_rate_limit(struct pollen_loop *loop,
+                                                     uint64_t rate, uint64_t burst);
+
+/* Detaches all fd callbacks from the bucket, resuming them, and frees it. NULL is a no-op. */
+void pollen_rate_limit_destroy(struct pollen_rate_limit *limit);
+
+/*
+ * Attaches fd callback to the bucket, or detaches it if limit is NULL.
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_fd_set_rate_limit(struct pollen_callback *callback, struct pollen_rate_limit *limit);
+
+/*
+ * Takes tokens from the bucket of fd callback. Does nothing if the callback has no bucket.
+ * Returns false if the bucket ran out of tokens and its fds are suspended, true otherwise.
+ */
+bool pollen_fd_consume(struct pollen_callback *callback, uint64_t tokens);
+#endif /* #if !defined(POLLEN_NO_TIMERS) */
+
+/*
+ * Batch handler for a group of fd callbacks, attached with pollen_fd_set_batch.
+ * Instead of running their own callbacks one by one, ready fds of the group are collected
+ * from one epoll_wait and passed to fn in a single call, after all other fd events of the
+ * iteration are dispatched. This lets fn prefetch or otherwise process the whole batch at once.
+ * Events are filtered the same way as for ordinary fd callbacks, and callbacks removed before
+ * fn runs are left out. Callbacks removed by fn stay valid until fn returns.
+ * Returning negative value from fn stops the loop, same as for any callback.
+ *
+ * Batches are destroyed with the loop, or with pollen_fd_batch_destroy, which must not be
+ * called from fn of the same batch.
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_fd_batch *pollen_loop_add_fd_batch(struct pollen_loop *loop,
+                                                 pollen_fd_batch_fn fn, void *data);
+
+/* Detaches all fd callbacks from the batch, so they run their own callbacks again, and frees it. */
+void pollen_fd_batch_destroy(struct pollen_fd_batch *batch);
+
+/*
+ * Attaches fd callback to the batch, or detaches it if batch is NULL.
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_fd_set_batch(struct pollen_callback *callback, struct pollen_fd_batch *batch);
+
+/*
+ * Returns callback that owns fd, or NULL if fd is not registered in the loop.
+ * This covers fd, timer and efd callbacks. Runs in O(1).
+ */
+struct pollen_callback *pollen_loop_find_fd(struct pollen_loop *loop, int fd);
+
+/*
+ * Calls iter_fn for every fd, timer and efd callback in the loop, in ascending fd order.
+ * It is safe to remove any callbacks from iter_fn.
+ * If iter_fn returns negative value, iteration stops and this value is returned.
+ *
+ * Returns 0 if all callbacks were visited.
+ */
+int pollen_loop_for_each_fd(struct pollen_loop *loop, pollen_fd_iter_fn iter_fn, void *data);
+
+#if !defined(POLLEN_NO_IDLE)
 /*
  * Adds a callback that will run unconditionally on every event loop iteration,
  * after all other callback types were processed.
@@ -113,7 +407,9 @@ bool pollen_fd_modify_events(struct pollen_callback *callback, uint32_t new_even
 struct pollen_callback *pollen_loop_add_idle(struct pollen_loop *loop, int priority,
                                              pollen_idle_callback_fn callback,
                                              void *data);
+#endif /* #if !defined(POLLEN_NO_IDLE) */
 
+#if !defined(POLLEN_NO_SIGNALS)
 /*
  * Adds a callback that will run when signal is caught.
  * This function tries to preserve original sigmask if it fails.
@@ -123,7 +419,9 @@ struct pollen_callback *pollen_loop_add_idle(struct pollen_loop *loop, int prior
 struct pollen_callback *pollen_loop_add_signal(struct pollen_loop *loop, int signal,
                                                pollen_signal_callback_fn callback,
                                                void *data);
+#endif /* #if !defined(POLLEN_NO_SIGNALS) */
 
+#if !defined(POLLEN_NO_TIMERS)
 /*
  * Adds a timerfd-based timer callback.
  * Arm/disarm the timer with pollen_timer_arm/disarm functions.
@@ -135,6 +433,13 @@ struct pollen_callback *pollen_loop_add_timer(struct pollen_loop *loop, int cloc
                                               pollen_timer_callback_fn callback,
                                               void *data);
 
+/* Same as pollen_loop_add_timer, but uses caller-owned storage, see pollen_loop_add_fd_static. */
+struct pollen_callback *pollen_loop_add_timer_static(struct pollen_loop *loop,
+                                                     struct pollen_callback_storage *storage,
+                                                     int clockid,
+                                                     pollen_timer_callback_fn callback,
+                                                     void *data);
+
 /*
  * Arms the timer to expire once after initial timespec,
  * and then repeatedly every periodic timespec.
@@ -185,6 +490,18 @@ bool pollen_timer_arm_us(struct pollen_callback *callback, bool absolute,
 bool pollen_timer_arm_ns(struct pollen_callback *callback, bool absolute,
                          unsigned long initial_ns, unsigned long periodic_ns);
 
+/*
+ * Arms the timer to expire delay_ns nanoseconds after loop time (see pollen_loop_now),
+ * and then repeatedly every periodic_ns nanoseconds.
+ * Unlike relative arming, this does not depend on when exactly during the iteration
+ * the timer is armed: timers armed with the same delay in one iteration expire together.
+ * The timer must use the clock that POLLEN_CLOCK is based on (CLOCK_MONOTONIC by default).
+ *
+ * Sets errno and returns false on failre, true on success.
+ */
+bool pollen_timer_arm_after(struct pollen_callback *callback,
+                            uint64_t delay_ns, uint64_t periodic_ns);
+
 /*
  * Disarms the timer.
  *
@@ -192,11 +509,44 @@ bool pollen_timer_arm_ns(struct pollen_callback *callback, bool absolute,
  */
 bool pollen_timer_disarm(struct pollen_callback *callback);
 
+/*
+ * Switches loop time (see pollen_loop_now) and all timers of the loop to a virtual clock,
+ * which starts at current loop time and only moves when told to, so tests of timer-driven logic
+ * run instantly and fire timers in the same order every time. Timers are kept in a list
+ * instead of their timerfds, with all clocks treated as the virtual one, and absolute
+ * deadlines interpreted on it. Timers that are already armed are moved to the virtual clock.
+ * Inactivity timeouts and rate limits follow, since they are built on timers.
+ * There is no way back to real time.
+ *
+ * If auto_advance is true, whenever the loop would block waiting for events, virtual time
+ * jumps to the nearest timer deadline instead (or to the end of the wait, if it comes first).
+ * The loop still blocks for real if there are no armed timers and the wait has no timeout.
+ * Otherwise, time only moves with pollen_loop_advance_time, and pollen_loop_run_for
+ * does not return until it does.
+ *
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_loop_use_virtual_time(struct pollen_loop *loop, bool auto_advance);
+
+/*
+ * Moves virtual time of the loop forward by delta_ns.
+ * Timers that expire because of it run on the next loop iteration.
+ * Does nothing if the loop is not using virtual time.
+ */
+void pollen_loop_advance_time(struct pollen_loop *loop, uint64_t delta_ns);
+#endif /* #if !defined(POLLEN_NO_TIMERS) */
+
+#if !defined(POLLEN_NO_EFDS)
 /*
  * This is a convenience wrapper around eventfd(2).
  * Use pollen_efd_trigger() to increment the efd and cause the callback to run.
  * The efd will be automatically reset before running the callback.
  *
+ * The counter is kept in memory, and the eventfd is only written to by the trigger that
+ * makes the callback pending, and only if it comes from another thread. Triggers made by
+ * callbacks of the same loop don't make any syscalls: the callback is put on a list that
+ * the loop runs at the end of the current iteration, before waiting for events again.
+ *
  * Returns NULL and sets errno on failure.
  */
 struct pollen_callback *pollen_loop_add_efd(struct pollen_loop *loop,
@@ -218,68 +568,577 @@ bool pollen_efd_trigger(struct pollen_callback *callback);
  * Returns true on success, false on failure and sets errno.
  */
 bool pollen_efd_inc(struct pollen_callback *callback, uint64_t n);
+#endif /* #if !defined(POLLEN_NO_EFDS) */
+
+#if !defined(POLLEN_NO_GROUPS)
+struct pollen_group;
+
+/*
+ * Group of loops, each running on its own thread, that share CPU-bound work spawned with
+ * pollen_loop_spawn. Every loop keeps its own Chase-Lev deque of tasks. The owner pushes and
+ * takes tasks at one end without contention. Loops that run out of work steal from the other
+ * end of other deques before blocking in epoll_wait, so there is no central queue to fight over.
+ * When a loop has a backlog, spawning wakes one sleeping loop of the group through its efd.
+ *
+ * Loops are added with pollen_group_add_loop before any of them starts running.
+ * Up to max_loops loops can be added.
+ *
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_group *pollen_group_create(size_t max_loops);
+
+/*
+ * Adds loop to the group. Loop can be in one group only. Adds an internal efd callback to the loop.
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_group_add_loop(struct pollen_group *group, struct pollen_loop *loop);
+
+/*
+ * Frees the group, dropping tasks that didn't run. None of its loops can be running at this point.
+ * Loops stay usable on their own and can be cleaned up before or after that. NULL is a no-op.
+ */
+void pollen_group_destroy(struct pollen_group *group);
+
+/*
+ * Queues fn to run on whichever loop of the group gets to it first, loop itself or a thief.
+ * Tasks must not assume which loop runs them, the running loop is passed to fn.
+ * Each loop runs up to POLLEN_GROUP_TASK_BATCH tasks per iteration, after deferred tasks,
+ * newest first, and doesn't block in epoll_wait while it has any.
+ * Returning negative value from fn stops the loop that ran it, same as for any callback.
+ * Tasks are not recorded, see pollen_loop_record_start.
+ *
+ * This function is not thread safe, call it from the thread running the loop.
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_loop_spawn(struct pollen_loop *loop, pollen_defer_fn fn, void *data);
+#endif /* #if !defined(POLLEN_NO_GROUPS) */
+
+#if !defined(POLLEN_NO_CHANNELS)
+enum pollen_channel_mode {
+    /* only one thread at a time sends, only one consumer callback receives */
+    POLLEN_CHANNEL_SPSC,
+    /* any amount of threads send, any amount of consumer callbacks on different loops receive */
+    POLLEN_CHANNEL_MPMC,
+};
+
+/*
+ * Creates a bounded lock-free channel that passes messages of elem_size bytes between threads.
+ * Capacity is rounded up to a power of 2.
+ *
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_channel *pollen_channel_create(size_t elem_size, size_t capacity,
+                                             enum pollen_channel_mode mode);
+
+/*
+ * Frees all resources associated with the channel.
+ * All consumer and producer callbacks of the channel must be removed before calling this.
+ * Passing NULL is a harmless no-op.
+ */
+void pollen_channel_destroy(struct pollen_channel *channel);
+
+/*
+ * Copies elem_size bytes from msg into the channel. Can be called from any thread.
+ * Consumers are only woken up (with a write(2) to an eventfd) if they are not scheduled already.
+ * If the channel is full, producer callbacks of the channel will run once space frees up.
+ *
+ * Returns false and sets errno to EAGAIN if the channel is full, true on success.
+ */
+bool pollen_channel_send(struct pollen_channel *channel, const void *msg);
+
+/*
+ * Adds a callback that receives messages from the channel.
+ * Messages are delivered in batches of up to POLLEN_CHANNEL_BATCH, in one call per batch.
+ * In SPSC mode, only one consumer callback can exist for a channel.
+ *
+ * Returns NULL and sets errno on failure: EBUSY if an SPSC channel already has a consumer.
+ */
+struct pollen_callback *pollen_loop_add_channel_consumer(struct pollen_loop *loop,
+                                                         struct pollen_channel *channel,
+                                                         pollen_channel_recv_fn callback,
+                                                         void *data);
+
+/*
+ * Adds a callback that runs when pollen_channel_send failed because the channel was full,
+ * and consumers made space since then.
+ *
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_callback *pollen_loop_add_channel_producer(struct pollen_loop *loop,
+                                                         struct pollen_channel *channel,
+                                                         pollen_channel_writable_fn callback,
+                                                         void *data);
+#endif /* #if !defined(POLLEN_NO_CHANNELS) */
+
+#if !defined(POLLEN_NO_DGRAMS)
+enum pollen_dgram_flags {
+    /* receive datagrams coalesced by UDP GRO, see segment_size in struct pollen_dgram */
+    POLLEN_DGRAM_GRO = 1 << 0,
+    /* coalesce queued datagrams of the same size to the same address into one UDP GSO send */
+    POLLEN_DGRAM_GSO = 1 << 1,
+};
+
+struct pollen_dgram {
+    /* points into buffers owned by the callback, valid until the receive callback returns */
+    void *buf;
+    size_t len;
+    /* with POLLEN_DGRAM_GRO, buf may hold several datagrams of segment_size bytes each
+     * (last one can be shorter). 0 if buf holds exactly one datagram */
+    size_t segment_size;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+/*
+ * Adds datagram socket fd (for example, UDP) to epoll interest list.
+ * When the socket becomes readable, up to POLLEN_DGRAM_BATCH datagrams are read with one
+ * recvmmsg(2) call into preallocated buffers of max_size bytes each, and passed to the callback
+ * in one call. Datagrams longer than max_size are truncated.
+ * flags is a combination of enum pollen_dgram_flags. GRO and GSO are silently turned off
+ * if the kernel doesn't support them. max_size must be between 1 and 65535; with GRO,
+ * it should be 65535.
+ * If autoclose is true, the fd will be closed when pollen_loop_remove_callback is called.
+ *
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_callback *pollen_loop_add_dgram(struct pollen_loop *loop, int fd, bool autoclose,
+                                              size_t max_size, unsigned flags,
+                                              pollen_dgram_recv_fn callback, void *data);
+
+/*
+ * Copies datagram into the send queue of dgram callback. addr can be NULL for connected sockets.
+ * The queue is flushed with sendmmsg(2) after the receive callback returns, when it fills up,
+ * or by calling pollen_dgram_flush(). If the socket can't take all of it right now,
+ * the rest is sent once it becomes writable.
+ *
+ * Returns false and sets errno on failure: EMSGSIZE if len is more than max_size,
+ * EAGAIN if the queue is full and the socket can't take any more datagrams.
+ */
+bool pollen_dgram_send(struct pollen_callback *callback, const void *buf, size_t len,
+                       const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Sends queued datagrams of dgram callback with sendmmsg(2). Datagrams that the socket
+ * can't take right now stay queued and are sent once it becomes writable.
+ * Datagrams the kernel rejected are dropped.
+ *
+ * Returns false and sets errno if any of the datagrams were rejected, true otherwise.
+ */
+bool pollen_dgram_flush(struct pollen_callback *callback);
+#endif /* #if !defined(POLLEN_NO_DGRAMS) */
+
+#if !defined(POLLEN_NO_LISTENERS)
+enum pollen_listener_flags {
+    /* register with EPOLLEXCLUSIVE, so when the same listening fd is added to several loops,
+     * only one of them is woken up per incoming connection */
+    POLLEN_LISTENER_EXCLUSIVE = 1 << 0,
+};
+
+/*
+ * Adds listening socket fd to epoll interest list.
+ * When the socket becomes readable, up to POLLEN_LISTENER_BATCH connections are accepted
+ * with accept4(2) and passed to the callback in one call. Accepted fds are non-blocking and
+ * close-on-exec, and are owned by the callback. flags is a combination of enum pollen_listener_flags.
+ * If autoclose is true, the fd will be closed when pollen_loop_remove_callback is called.
+ *
+ * If accepting fails because the process is out of fds or memory, pending connections stay
+ * in the backlog and the listener is not polled for POLLEN_LISTENER_RETRY_MS, so the loop doesn't
+ * spin on them. Without timers (POLLEN_NO_TIMERS), it is retried on the next iteration instead.
+ *
+ * To spread connections over several loops, either add the same fd to all of them with
+ * POLLEN_LISTENER_EXCLUSIVE (autoclose it on one loop only), or give every loop its own
+ * SO_REUSEPORT socket bound to the same address, optionally with pollen_listener_steer_by_cpu().
+ *
+ * Returns NULL and sets errno on failure.
+ */
+struct pollen_callback *pollen_loop_add_listener(struct pollen_loop *loop, int fd, bool autoclose,
+                                                 unsigned flags, pollen_listener_fn callback,
+                                                 void *data);
+
+/*
+ * Attaches classic BPF program to SO_REUSEPORT group of fd that picks socket number
+ * (CPU that received the connection % n_sockets) in the order sockets were bound.
+ * With the i-th bound socket served by a loop pinned to CPU i, connections stay on the CPU
+ * that handled their packets. Calling it on one socket of the group is enough.
+ *
+ * Returns false and sets errno on failure, true on success.
+ */
+bool pollen_listener_steer_by_cpu(int fd, unsigned n_sockets);
+#endif /* #if !defined(POLLEN_NO_LISTENERS) */
 
 /*
  * Remove a callback from event loop.
  *
- * For fd callbacks, this function will close the fd if autoclose=true.
+ * For fd callbacks, this function will close the fd if autoclose=true,
+ * possibly on a background thread, see pollen_loop_set_async_close.
  * For signal callbacks, this function will unblock the signal.
  *
+ * It is safe to remove any callback from within any callback, including the one that is
+ * currently running. Callbacks removed this way will not run for the rest of the loop iteration,
+ * even if they have pending events, and their memory is reclaimed when the iteration ends.
+ *
  * Passing NULL is a harmless no-op.
  */
 void pollen_loop_remove_callback(struct pollen_callback *callback);
 
+#if !defined(POLLEN_NO_ASYNC_CLOSE)
+/*
+ * Hand autoclose fds of removed fd, datagram and listener callbacks over to a background
+ * thread that closes them, instead of calling close(2) right away. close(2) can take a long
+ * time on sockets with SO_LINGER or lots of unsent data, and on NFS or FUSE files, which
+ * stalls the whole loop. The fd is removed from epoll and from the loop immediately either way,
+ * and its number stays taken until the thread closes it, so it can't be reused too early.
+ *
+ * Enabling starts the thread, disabling waits until the queued fds are closed and stops it.
+ * Cleaning up the loop does the same. Queueing costs a mutex lock, the thread is only woken
+ * when it has nothing else to close. If queueing fails, fd is closed right away.
+ *
+ * Sets errno and returns false on failure, true on success.
+ */
+bool pollen_loop_set_async_close(struct pollen_loop *loop, bool enable);
+
+/*
+ * Amount of fds queued for the background thread that are not closed yet.
+ * Can be called from any thread. Also published in struct pollen_metrics.
+ */
+size_t pollen_loop_get_pending_closes(struct pollen_loop *loop);
+#endif /* #if !defined(POLLEN_NO_ASYNC_CLOSE) */
+
 /* Get pollen_loop instance associated with this pollen_callback. */
 struct pollen_loop *pollen_callback_get_loop(struct pollen_callback *callback);
 
+/*
+ * Get id of the callback. Ids are unique within the loop and assigned in the order callbacks
+ * are added, starting from 1, so the same program adding the same callbacks gets the same ids.
+ */
+uint32_t pollen_callback_get_id(struct pollen_callback *callback);
+
+/*
+ * Returns loop time: POLLEN_CLOCK timestamp in nanoseconds, taken when epoll_wait last returned.
+ * It is the same for all callbacks that run in one loop iteration, and reading it is free.
+ */
+uint64_t pollen_loop_now(struct pollen_loop *loop);
+
+/* Sets loop time to the current POLLEN_CLOCK time and returns it. */
+uint64_t pollen_loop_update_time(struct pollen_loop *loop);
+
 /*
  * Run the event loop. This function blocks until event loop exits.
  * This function returns 0 if no errors occured.
  * If any of the callbacks return negative value, the loop with be stopped and this value returned.
  */
 int pollen_loop_run(struct pollen_loop *loop);
+
+/*
+ * Run the event loop for duration_ns nanoseconds, or until it is stopped with pollen_loop_quit.
+ * Return value is the same as for pollen_loop_run.
+ */
+int pollen_loop_run_for(struct pollen_loop *loop, uint64_t duration_ns);
+
+/*
+ * Run exactly one iteration of the event loop: wait for events for at most timeout_ns
+ * nanoseconds (rounded up to milliseconds), dispatch them, then run idle callbacks.
+ * Negative timeout_ns means wait forever, 0 means don't wait at all.
+ *
+ * This is meant for embedding pollen into another event loop, see pollen_loop_get_fd.
+ *
+ * Returns amount of dispatched events, which might be 0 on timeout.
+ * If any of the callbacks return negative value, this value is returned.
+ * On epoll_wait failure, returns negative errno.
+ */
+int pollen_loop_dispatch(struct pollen_loop *loop, int64_t timeout_ns);
+
+/*
+ * Get epoll fd of the loop. It becomes readable when there are events to dispatch,
+ * so it can be added to another event loop, which calls pollen_loop_dispatch(loop, 0)
+ * every time it becomes readable. Don't read from or close the fd.
+ * Tasks left over by pollen_loop_dispatch (see pollen_loop_defer and pollen_loop_spawn) keep
+ * the fd readable too, through an internal efd. With POLLEN_NO_EFDS they don't, so keep calling
+ * pollen_loop_dispatch while there are any.
+ */
+int pollen_loop_get_fd(struct pollen_loop *loop);
+
 /*
  * Quit the event loop.
  * Argument retcode specifies the value that will be returned by pollen_loop_run.
  */
 void pollen_loop_quit(struct pollen_loop *loop, int retcode);
 
-#endif /* #ifndef POLLEN_H */
-
 /*
- * ============================================================================
- *                              IMPLEMENTATION
- * ============================================================================
+ * Run fn once, in the current loop iteration if fd events are still being dispatched,
+ * or in the next one otherwise. Queued tasks run in order after fd dispatch, before idle
+ * callbacks. Tasks queued by other tasks, idle and efd callbacks wait until the next iteration,
+ * which then doesn't block in epoll_wait. Tasks still queued when the loop is cleaned up are
+ * dropped. Returning negative value from fn stops the loop, same as for any callback.
+ *
+ * Tasks live in a ring preallocated by the loop, see POLLEN_DEFER_CAPACITY, so this does not
+ * allocate memory unless more tasks are queued at once than ever before.
+ * This function is not thread safe, call it from the thread running the loop.
+ *
+ * Sets errno and returns false on failure, true on success.
  */
-#ifdef POLLEN_IMPLEMENTATION
+bool pollen_loop_defer(struct pollen_loop *loop, pollen_defer_fn fn, void *data);
 
-#include <sys/signalfd.h>
-#include <sys/eventfd.h>
-#include <errno.h>
-#include <unistd.h>
-#include <stddef.h>
-#include <stdbool.h>
-#include <string.h>
-#include <fcntl.h>
+#if !defined(POLLEN_NO_TRACE)
+#include <stdio.h>
 
-#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L
-    #define POLLEN_TYPEOF(expr) typeof(expr)
-#else
-    #define POLLEN_TYPEOF(expr) __typeof__(expr)
-#endif
+/*
+ * Start recording loop activity: epoll_wait calls, callbacks and idle callbacks,
+ * with their start time and duration. Records are stored in a preallocated ring buffer
+ * of capacity records (rounded up to a power of 2), overwriting the oldest records when full.
+ * Recording costs one clock_gettime per callback and allocates nothing.
+ *
+ * If tracing is already started, recorded events are discarded and the buffer is resized.
+ *
+ * Returns false and sets errno on failure.
+ */
+bool pollen_loop_trace_start(struct pollen_loop *loop, size_t capacity);
 
-#define POLLEN_CONTAINER_OF(ptr, sample, member) \
-    (POLLEN_TYPEOF(sample))((char *)(ptr) - offsetof(POLLEN_TYPEOF(*sample), member))
+/* Stop recording and free the ring buffer. No-op if tracing is not started. */
+void pollen_loop_trace_stop(struct pollen_loop *loop);
 
 /*
- * Linked list.
- * In the head, next points to the first list elem, prev points to the last.
- * In the list element, next points to the next elem, prev points to the previous elem.
- * In the last element, next points to the head. In the first element, prev points to the head.
- * If the list is empty, next and prev point to the head itself.
+ * Write recorded events to out in Chrome Trace Event JSON format, which can be viewed in
+ * Perfetto or chrome://tracing. Each loop is shown as a separate thread identified by its epoll fd.
+ * Recording continues after the dump. This function is not thread safe, call it from the thread
+ * running the loop, for example from a signal callback.
+ *
+ * Returns false and sets errno on failure.
  */
-struct pollen_ll {
-    struct pollen_ll *next;
+bool pollen_loop_trace_dump(struct pollen_loop *loop, FILE *out);
+
+/*
+ * Recording format: 8 bytes of POLLEN_RECORD_MAGIC, followed by struct pollen_record entries
+ * in host byte order. Every loop iteration starts with an entry with id 0, whose value is
+ * loop time and events is amount of epoll events. It is followed by one entry per callback run:
+ *   fd callbacks - events passed to the callback;
+ *   efd callbacks - value passed to the callback;
+ *   timer callbacks - amount of expirations;
+ *   signal callbacks - signal number;
+ *   idle callbacks - nothing.
+ * Fd callbacks attached to a batch are recorded when the batch runs, see pollen_fd_set_batch.
+ * Runs of deferred tasks are recorded as one entry with id POLLEN_RECORD_DEFERRED,
+ * whose events is amount of tasks.
+ * Channel, datagram and listener callbacks receive payload which is not recorded,
+ * so they are left out.
+ */
+#define POLLEN_RECORD_MAGIC "pollenR1"
+#define POLLEN_RECORD_DEFERRED UINT32_MAX
+
+struct pollen_record {
+    uint64_t value;
+    uint32_t id; /* see pollen_callback_get_id */
+    uint32_t events;
+};
+
+/*
+ * Start recording which callbacks run in every loop iteration to out, see struct pollen_record.
+ * Recording costs one buffered fwrite per callback run. If writing fails, recording stops.
+ * out must stay open until pollen_loop_record_stop.
+ *
+ * Returns false and sets errno on failure.
+ */
+bool pollen_loop_record_start(struct pollen_loop *loop, FILE *out);
+
+/* Stop recording and flush the output. No-op if recording is not started. */
+void pollen_loop_record_stop(struct pollen_loop *loop);
+
+/*
+ * Replay recording from in: for each recorded iteration, set loop time to the recorded one
+ * and run recorded callbacks in recorded order with recorded arguments. No fds are polled,
+ * and efd triggers are ignored, since their effects are in the recording.
+ *
+ * Callbacks are looked up by id, so the program must add the same callbacks in the same order
+ * as the recorded one, before and during replay. Entries of callbacks that are gone are skipped.
+ * Fd callbacks get the recorded events, but reading from their fds is up to them.
+ *
+ * Returns when the recording ends or the loop is stopped with pollen_loop_quit.
+ * Return value is the same as for pollen_loop_run. If in is not a recording or reading fails,
+ * returns negative errno.
+ */
+int pollen_loop_replay(struct pollen_loop *loop, FILE *in);
+#endif /* #if !defined(POLLEN_NO_TRACE) */
+
+#if !defined(POLLEN_NO_METRICS)
+#define POLLEN_METRICS_MAGIC UINT64_C(0x314d6e656c6c6f70) /* "pollenM1" on little endian */
+
+/*
+ * Loop counters as laid out in the shared memory page, see pollen_loop_metrics_start.
+ * Times are CLOCK_MONOTONIC nanoseconds, and only cover time spent inside the loop.
+ */
+struct pollen_metrics {
+    uint64_t magic;
+    /* odd while the loop is updating the page */
+    uint64_t seq;
+
+    uint64_t iterations;
+    /* events returned by epoll_wait */
+    uint64_t events;
+    /* time spent waiting in epoll_wait, and running callbacks after it returned */
+    uint64_t wait_ns;
+    uint64_t busy_ns;
+    /* longest busy time of a single iteration, an upper bound on the slowest callback */
+    uint64_t max_busy_ns;
+
+    /* events returned by the last epoll_wait. POLLEN_EPOLL_MAX_EVENTS means more were ready */
+    uint64_t last_events;
+    uint64_t fds;
+    /* armed inactivity timeouts */
+    uint64_t timeouts;
+    /* callbacks currently added to the loop, including internal ones,
+     * indexed by enum pollen_callback_type */
+    uint64_t callbacks[POLLEN_CALLBACK_TYPES];
+
+    /* new fields go below, so that older readers of the same magic keep working */
+
+    /* see pollen_loop_get_pending_closes */
+    uint64_t pending_closes;
+};
+
+/*
+ * Start publishing loop counters into a memfd of one struct pollen_metrics, updated with a
+ * seqlock at the end of every loop iteration. Other processes can map it read-only from
+ * /proc/<pid>/fd/<fd> (it shows up as /memfd:pollen-metrics) and read it with
+ * pollen_metrics_read, without any syscalls or involvement of the loop. See tools/metrics.c.
+ * Publishing costs three clock_gettime calls and a copy of the page per iteration.
+ *
+ * Returns the memfd, owned by the loop, or -1 and sets errno on failure.
+ * If metrics are already published, returns the same memfd.
+ */
+int pollen_loop_metrics_start(struct pollen_loop *loop);
+
+/* Stop publishing metrics, unmap and close the memfd. No-op if metrics are not published. */
+void pollen_loop_metrics_stop(struct pollen_loop *loop);
+
+/*
+ * Take a consistent snapshot of a mapped metrics page into out. Can be called from any process.
+ * Returns false and sets errno to EINVAL if page is not a metrics page,
+ * or to EAGAIN if the page stays in the middle of an update (for example, the writer died).
+ */
+bool pollen_metrics_read(const struct pollen_metrics *page, struct pollen_metrics *out);
+#endif /* #if !defined(POLLEN_NO_METRICS) */
+
+#endif /* #ifndef POLLEN_H */
+
+/*
+ * ============================================================================
+ *                              IMPLEMENTATION
+ * ============================================================================
+ */
+#ifdef POLLEN_IMPLEMENTATION
+
+#if !defined(POLLEN_NO_SIGNALS)
+    #include <sys/signalfd.h>
+#endif
+#if !defined(POLLEN_NO_EFDS) || !defined(POLLEN_NO_CHANNELS)
+    #include <sys/eventfd.h>
+#endif
+#if !defined(POLLEN_NO_EFDS) || !defined(POLLEN_NO_CHANNELS) || !defined(POLLEN_NO_ASYNC_CLOSE)
+    #include <stdatomic.h>
+#endif
+#if !defined(POLLEN_NO_CHANNELS) || !defined(POLLEN_NO_ASYNC_CLOSE)
+    #include <pthread.h>
+#endif
+#if !defined(POLLEN_NO_DGRAMS)
+    #include <netinet/in.h>
+    #include <netinet/udp.h>
+    /* older libc headers might not have these */
+    #if !defined(SOL_UDP)
+        #define SOL_UDP 17
+    #endif
+    #if !defined(UDP_SEGMENT)
+        #define UDP_SEGMENT 103
+    #endif
+    #if !defined(UDP_GRO)
+        #define UDP_GRO 104
+    #endif
+    /* see udp(7), kernel refuses to send more segments at once */
+    #define POLLEN_UDP_MAX_SEGMENTS 64
+#endif
+#if !defined(POLLEN_NO_METRICS)
+    #include <sys/mman.h>
+#endif
+#if !defined(POLLEN_NO_METRICS) || !defined(POLLEN_NO_GROUPS)
+    #include <sched.h>
+#endif
+#if !defined(POLLEN_NO_LISTENERS)
+    #include <sys/socket.h>
+    #include <linux/filter.h>
+    #if !defined(SO_ATTACH_REUSEPORT_CBPF)
+        #define SO_ATTACH_REUSEPORT_CBPF 51
+    #endif
+#endif
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L
+    #define POLLEN_TYPEOF(expr) typeof(expr)
+#else
+    #define POLLEN_TYPEOF(expr) __typeof__(expr)
+#endif
+
+#define POLLEN_CONTAINER_OF(ptr, sample, member) \
+    (POLLEN_TYPEOF(sample))((char *)(ptr) - offsetof(POLLEN_TYPEOF(*sample), member))
+
+/*
+ * USDT probes. This emits the same .note.stapsdt ELF note as sys/sdt.h does:
+ * a nop at the probe site, and a note with its address and argument locations.
+ * All arguments are passed as signed 64-bit values.
+ */
+#if defined(POLLEN_USDT) && defined(__LP64__)
+    #define POLLEN_USDT_ASM(name, args) \
+        "990: nop\n" \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+        ".balign 4\n" \
+        ".4byte 992f-991f, 994f-993f, 3\n" \
+        "991: .asciz \"stapsdt\"\n" \
+        "992: .balign 4\n" \
+        "993: .8byte 990b\n" \
+        ".8byte _.stapsdt.base\n" \
+        ".8byte 0\n" \
+        ".asciz \"pollen\"\n" \
+        ".asciz \"" #name "\"\n" \
+        ".asciz \"" args "\"\n" \
+        "994: .balign 4\n" \
+        ".popsection\n" \
+        ".ifndef _.stapsdt.base\n" \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n" \
+        ".hidden _.stapsdt.base\n" \
+        "_.stapsdt.base: .space 1\n" \
+        ".size _.stapsdt.base, 1\n" \
+        ".popsection\n" \
+        ".endif\n"
+
+    #define POLLEN_USDT_PROBE1(name, a) \
+        __asm__ __volatile__(POLLEN_USDT_ASM(name, "-8@%0") \
+                             :: "nor"((int64_t)(a)))
+    #define POLLEN_USDT_PROBE2(name, a, b) \
+        __asm__ __volatile__(POLLEN_USDT_ASM(name, "-8@%0 -8@%1") \
+                             :: "nor"((int64_t)(a)), "nor"((int64_t)(b)))
+    #define POLLEN_USDT_PROBE3(name, a, b, c) \
+        __asm__ __volatile__(POLLEN_USDT_ASM(name, "-8@%0 -8@%1 -8@%2") \
+                             :: "nor"((int64_t)(a)), "nor"((int64_t)(b)), "nor"((int64_t)(c)))
+#else
+    #define POLLEN_USDT_PROBE1(name, a) (void)0
+    #define POLLEN_USDT_PROBE2(name, a, b) (void)0
+    #define POLLEN_USDT_PROBE3(name, a, b, c) (void)0
+#endif
+
+/*
+ * Linked list.
+ * In the head, next points to the first list elem, prev points to the last.
+ * In the list element, next points to the next elem, prev points to the previous elem.
+ * In the last element, next points to the head. In the first element, prev points to the head.
+ * If the list is empty, next and prev point to the head itself.
+ */
+struct pollen_ll {
+    struct pollen_ll *next;
     struct pollen_ll *prev;
 };
 
@@ -306,6 +1165,21 @@ static inline void pollen_ll_remove(struct pollen_ll *elem) {
     elem->next->prev = elem->prev;
 }
 
+/* Moves all elements of src to dst, leaving src empty. dst must be empty. */
+static inline void pollen_ll_move(struct pollen_ll *dst, struct pollen_ll *src) {
+    if (pollen_ll_is_empty(src)) {
+        pollen_ll_init(dst);
+        return;
+    }
+
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+
+    pollen_ll_init(src);
+}
+
 #define POLLEN_LL_FOR_EACH(var, head, member) \
     for (var = POLLEN_CONTAINER_OF((head)->next, var, member); \
          &var->member != (head); \
@@ -323,489 +1197,1156 @@ static inline void pollen_ll_remove(struct pollen_ll *elem) {
          var = tmp, \
          tmp = POLLEN_CONTAINER_OF(var->member.next, tmp, member))
 
-enum pollen_callback_type {
-    POLLEN_CALLBACK_TYPE_FD,
-    POLLEN_CALLBACK_TYPE_IDLE,
-    POLLEN_CALLBACK_TYPE_SIGNAL,
-    POLLEN_CALLBACK_TYPE_TIMER,
-    POLLEN_CALLBACK_TYPE_EFD,
-};
+struct pollen_loop;
+struct pollen_callback;
+
+/*
+ * Type-specific part of event dispatch. Reads whatever needs to be read from the fd,
+ * then calls user function. Each callback type has its own, so dispatching an event
+ * is a single indirect call without switching on the type.
+ */
+typedef int (*pollen_dispatch_fn)(struct pollen_loop *loop, struct pollen_callback *callback,
+                                  uint32_t events);
 
+/*
+ * Everything pollen_loop_run needs to dispatch an event lives in the fields before loop
+ * (the first 48 bytes with padding), and callbacks are allocated from cache line aligned chunks
+ * (see pollen_internal_callback_alloc), so dispatching one ready event only touches one cache
+ * line. Bookkeeping goes after that. The exception is batched fd dispatch, which also reads
+ * as.fd.batch. Hot fields are checked to fit in a cache line below.
+ */
 struct pollen_callback {
+    pollen_dispatch_fn dispatch;
+    union {
+        pollen_fd_callback_fn fd;
+        pollen_idle_callback_fn idle;
+        pollen_signal_callback_fn signal;
+        pollen_timer_callback_fn timer;
+        pollen_efd_callback_fn efd;
+        pollen_channel_recv_fn channel_recv;
+        pollen_channel_writable_fn channel_writable;
+        pollen_dgram_recv_fn dgram;
+        pollen_listener_fn listener;
+    } fn;
+    void *data;
+#if !defined(POLLEN_NO_TIMERS)
+    /* fd callbacks only, see pollen_fd_set_timeout */
+    uint64_t last_active_ns;
+#endif
+    /* fd, tfd or efd, -1 for idle and signal callbacks */
+    int fd;
+    /* fd and dgram callbacks only, events currently registered in epoll */
+    uint32_t events;
+    uint8_t type; /* enum pollen_callback_type */
+    /* removed during dispatch, waiting to be freed at the end of loop iteration */
+    bool dead;
+
     struct pollen_loop *loop;
+    /* see pollen_callback_get_id */
+    uint32_t id;
+    /* lives in pollen_callback_storage, never goes to the free list */
+    bool caller_owned;
 
-    enum pollen_callback_type type;
     union {
         struct {
-            int fd;
-            pollen_fd_callback_fn callback;
             bool autoclose;
+            /* see pollen_fd_set_batch */
+            struct pollen_fd_batch *batch;
+
+#if !defined(POLLEN_NO_TIMERS)
+            /* inactivity timeout, see pollen_fd_set_timeout */
+            pollen_fd_timeout_fn timeout_fn;
+            uint64_t timeout_ns;
+            struct pollen_ll timeout_link;
+
+            /* see pollen_fd_set_rate_limit. Events requested by user, which can differ from
+             * registered events (hot events field) while the bucket is empty */
+            struct pollen_rate_limit *rate_limit;
+            struct pollen_ll rate_limit_link;
+            uint32_t requested_events;
+#endif
         } fd;
+#if !defined(POLLEN_NO_IDLE)
         struct {
             int priority;
-            pollen_idle_callback_fn callback;
         } idle;
+#endif
+#if !defined(POLLEN_NO_TIMERS)
+        struct {
+            int clockid;
+            /* virtual time only, see pollen_loop_use_virtual_time. Armed timers are linked
+             * into loop virtual_timers list via link field */
+            bool virtual_armed;
+            uint64_t deadline_ns;
+            uint64_t period_ns;
+        } timer;
+#endif
+#if !defined(POLLEN_NO_SIGNALS)
         struct {
             int sig;
-            pollen_signal_callback_fn callback;
         } signal;
+#endif
+#if !defined(POLLEN_NO_EFDS)
         struct {
-            int fd;
-            pollen_timer_callback_fn callback;
-        } timer;
-        struct {
-            int efd;
-            pollen_efd_callback_fn callback;
+            /* sum of increments not yet passed to callback. Non-zero means the callback is
+             * pending, either on loop efd_pending list (queued) or via a write to the efd */
+            _Atomic uint64_t pending;
+            bool queued;
         } efd;
+#endif
+#if !defined(POLLEN_NO_CHANNELS)
+        struct {
+            struct pollen_channel *channel;
+            bool consumer;
+            /* consumer: messages are copied here before being passed to user */
+            void *batch;
+            /* producer: link in channel producers list */
+            struct pollen_ll link;
+        } channel;
+#endif
+#if !defined(POLLEN_NO_DGRAMS)
+        struct {
+            bool autoclose;
+            unsigned flags;
+            size_t max_size;
+            struct pollen_dgram_queue *rx;
+            struct pollen_dgram_queue *tx;
+        } dgram;
+#endif
+#if !defined(POLLEN_NO_LISTENERS)
+        struct {
+            bool autoclose;
+            bool exclusive;
+#if !defined(POLLEN_NO_TIMERS)
+            bool paused;
+            struct pollen_ll paused_link; /* in loop->paused_listeners */
+#endif
+        } listener;
+#endif
     } as;
 
+    /* used by idle and signal callbacks, others live in loop fd table.
+     * Efd and timer callbacks use it to link into loop efd_pending and virtual_timers lists */
+    struct pollen_ll link;
+
+    /* links callbacks in loop free list and dead list */
+    struct pollen_callback *next_free;
+};
+
+#define POLLEN_CACHE_LINE_SIZE 64
+#define POLLEN_CALLBACK_STRIDE \
+    ((sizeof(struct pollen_callback) + POLLEN_CACHE_LINE_SIZE - 1) & ~(POLLEN_CACHE_LINE_SIZE - 1))
+
+_Static_assert(offsetof(struct pollen_callback, loop) <= POLLEN_CACHE_LINE_SIZE,
+               "hot fields of struct pollen_callback must fit in one cache line");
+_Static_assert(sizeof(struct pollen_callback) <= POLLEN_CALLBACK_SIZE &&
+               _Alignof(struct pollen_callback) <= POLLEN_CALLBACK_ALIGN,
+               "struct pollen_callback must fit in struct pollen_callback_storage");
+
+/* Callbacks are carved out of chunks. Chunks are only freed by pollen_loop_cleanup. */
+struct pollen_callback_chunk {
+    struct pollen_callback_chunk *next;
+};
+
+#if !defined(POLLEN_NO_TRACE)
+enum pollen_trace_kind {
+    POLLEN_TRACE_WAIT,
+    POLLEN_TRACE_DISPATCH,
+    POLLEN_TRACE_IDLE,
+    POLLEN_TRACE_BATCH,
+    POLLEN_TRACE_DEFERRED,
+    POLLEN_TRACE_TASKS,
+};
+
+struct pollen_trace_record {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    /* amount of events for WAIT and BATCH, fd for DISPATCH, priority for IDLE,
+     * amount of tasks for DEFERRED and TASKS */
+    int32_t arg;
+    uint32_t events; /* epoll events for DISPATCH */
+    uint8_t kind; /* enum pollen_trace_kind */
+    uint8_t type; /* enum pollen_callback_type for DISPATCH */
+};
+#endif
+
+#if !defined(POLLEN_NO_TIMERS)
+struct pollen_rate_limit {
+    struct pollen_loop *loop;
+    struct pollen_ll link; /* in loop->rate_limits */
+
+    double tokens;
+    double burst;
+    double rate_per_ns;
+    uint64_t last_refill_ns;
+
+    /* less than one token left, EPOLLIN is removed from all fds until timer fires */
+    bool suspended;
+    struct pollen_callback *timer;
+    struct pollen_ll callbacks; /* fd callbacks via as.fd.rate_limit_link */
+};
+#endif
+
+struct pollen_fd_batch {
+    struct pollen_loop *loop;
+    struct pollen_ll link; /* in loop->fd_batches */
+
+    pollen_fd_batch_fn fn;
     void *data;
 
-    struct pollen_ll link;
+    /* ready fds collected during current iteration, at most one event per fd */
+    struct pollen_fd_batch *next_ready; /* in loop->ready_fd_batches */
+    size_t count;
+    struct pollen_fd_event events[POLLEN_EPOLL_MAX_EVENTS];
+};
+
+struct pollen_deferred {
+    pollen_defer_fn fn;
+    void *data;
+};
+
+#if !defined(POLLEN_NO_GROUPS)
+struct pollen_group_task {
+    _Atomic(pollen_defer_fn) fn;
+    _Atomic(void *) data;
 };
 
+/* Backing array of a task deque. Replaced arrays are kept until the group is destroyed,
+ * because thieves might still be reading from them. */
+struct pollen_group_ring {
+    struct pollen_group_ring *retired;
+    int64_t mask;
+    struct pollen_group_task tasks[];
+};
+
+/*
+ * Chase-Lev work-stealing deque, as described in "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" by Le et al. Owner pushes and takes at bottom, thieves steal at top.
+ */
+struct pollen_group_member {
+    struct pollen_group *group;
+    struct pollen_loop *loop;
+    /* efd that interrupts epoll_wait of the loop when it sleeps, NULL once the loop is gone.
+     * wakers counts other threads that are triggering it, cleanup waits for them */
+    _Atomic(struct pollen_callback *) wake;
+    atomic_int wakers;
+
+    /* owner only: task taken from another loop, runs before own tasks */
+    struct pollen_deferred stolen;
+    bool has_stolen;
+
+    char pad0[POLLEN_CACHE_LINE_SIZE];
+    _Atomic int64_t top;
+    char pad1[POLLEN_CACHE_LINE_SIZE - sizeof(int64_t)];
+    _Atomic int64_t bottom;
+    _Atomic(struct pollen_group_ring *) ring;
+    /* set by the owner right before blocking in epoll_wait */
+    atomic_bool sleeping;
+    char pad2[POLLEN_CACHE_LINE_SIZE];
+};
+
+struct pollen_group {
+    size_t count;
+    size_t capacity;
+    struct pollen_group_member *members;
+};
+#endif
+
 struct pollen_loop {
     bool should_quit;
+    bool dispatching;
     int retcode;
     int epoll_fd;
 
+    struct epoll_event events[POLLEN_EPOLL_MAX_EVENTS];
+
+#if !defined(POLLEN_NO_SIGNALS)
     /* signal(7) says there are 38 standard signals on linux.
      * TODO: this is cringe. Use a proper hashmap? */
     struct pollen_callback *signal_callbacks[38];
     int signal_fd;
     sigset_t sigset;
+    struct pollen_ll signal_callbacks_list;
+#endif
 
-    struct pollen_ll fd_callbacks_list;
+#if !defined(POLLEN_NO_IDLE)
     struct pollen_ll idle_callbacks_list;
-    struct pollen_ll signal_callbacks_list;
-    struct pollen_ll timer_callbacks_list;
-    struct pollen_ll efd_callbacks_list;
-};
+#endif
 
-/* not an actual real callback, more like a hack to hook signal handling into the loop */
-static int pollen_internal_signal_handler(struct pollen_callback *callback, int fd,
-                                          unsigned int events, void *data) {
-    struct pollen_loop *loop = data;
+#if !defined(POLLEN_NO_EFDS)
+    /* efd callbacks triggered from this loop thread, run at the end of loop iteration */
+    struct pollen_ll efd_pending;
+    /* created by pollen_loop_dispatch to make epoll fd readable when tasks are left over */
+    struct pollen_callback *dispatch_wake;
+#endif
 
-    /* TODO: figure out why does this always only read only one siginfo */
-    int ret;
-    struct signalfd_siginfo siginfo;
-    while ((ret = read(loop->signal_fd, &siginfo, sizeof(siginfo))) == sizeof(siginfo)) {
-        int signal = siginfo.ssi_signo;
-        POLLEN_LOG_DEBUG("received signal %d via signalfd", signal);
+    /* fd, timer and efd callbacks indexed by their fd. Grows on demand. */
+    struct pollen_callback **fds;
+    int fds_capacity;
+    int fds_count;
 
-        struct pollen_callback *signal_callback = loop->signal_callbacks[signal];
-        if (signal_callback != NULL) {
-            return signal_callback->as.signal.callback(signal_callback, signal,
-                                                       signal_callback->data);
-        } else {
-            POLLEN_LOG_ERR("signal %d received via signalfd has no callbacks installed", signal);
-            return -1;
-        }
-    }
+    struct pollen_ll fd_batches;
+    /* batches with events collected during current iteration, run after fd dispatch */
+    struct pollen_fd_batch *ready_fd_batches;
 
-    if (ret >= 0) {
-        POLLEN_LOG_ERR("read incorrect amount of bytes from signalfd");
-        return -1;
-    } else /* ret < 0 */ {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            /* no more signalds to handle. exit. */
-            POLLEN_LOG_DEBUG("no more signals to handle");
-            return 0;
-        } else {
-            POLLEN_LOG_ERR("failed to read siginfo from signalfd: %s", strerror(errno));
-            return -1;
-        }
-    }
-}
+    /* see pollen_loop_defer. Ring of tasks, head and tail only ever grow */
+    struct pollen_deferred *deferred;
+    uint32_t deferred_mask;
+    uint32_t deferred_head;
+    uint32_t deferred_tail;
 
-static int pollen_internal_setup_signalfd(struct pollen_loop *loop) {
-    int save_errno = 0;
-    POLLEN_LOG_DEBUG("setting up signalfd");
+#if !defined(POLLEN_NO_GROUPS)
+    struct pollen_group_member *group_member;
+#endif
 
-    sigemptyset(&loop->sigset);
-    loop->signal_fd = signalfd(-1, &loop->sigset, SFD_NONBLOCK | SFD_CLOEXEC);
-    if (loop->signal_fd < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to create signalfd: %s", strerror(errno));
-        goto err;
-    }
+#if !defined(POLLEN_NO_ASYNC_CLOSE)
+    struct pollen_closer *closer;
+#endif
 
-    if (pollen_loop_add_fd(loop, loop->signal_fd, EPOLLIN, false,
-                           pollen_internal_signal_handler, loop) == NULL) {
-        save_errno = errno;
-        goto err;
-    }
+    /* monotonic time in ns, updated every time epoll_wait returns */
+    uint64_t now_ns;
 
-    return 0;
+#if !defined(POLLEN_NO_TIMERS)
+    /* fd inactivity timeouts wheel, each bucket holds fd callbacks via as.fd.timeout_link */
+    struct pollen_ll timeout_wheel[POLLEN_TIMEOUT_WHEEL_SLOTS];
+    struct pollen_callback *timeout_timer;
+    uint64_t timeout_next_tick;
+    int timeout_count;
 
-err:
-    errno = save_errno;
-    return -1;
-}
+    struct pollen_ll rate_limits;
 
-struct pollen_loop *pollen_loop_create(void) {
-    POLLEN_LOG_INFO("creating event loop");
-    int save_errno = 0;
+#if !defined(POLLEN_NO_LISTENERS)
+    /* listeners that failed to accept, re-added to epoll when listener_retry_timer fires */
+    struct pollen_ll paused_listeners;
+    struct pollen_callback *listener_retry_timer;
+#endif
 
-    struct pollen_loop *loop = POLLEN_CALLOC(1, sizeof(*loop));
-    if (loop == NULL) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to allocate memory for event loop: %s", strerror(errno));
-        goto err;
-    }
+    /* see pollen_loop_use_virtual_time. now_ns is the virtual clock */
+    bool virtual_time;
+    bool virtual_auto_advance;
+    /* armed timers sorted by deadline, via their link field */
+    struct pollen_ll virtual_timers;
+#endif
 
-    pollen_ll_init(&loop->fd_callbacks_list);
-    pollen_ll_init(&loop->idle_callbacks_list);
-    pollen_ll_init(&loop->signal_callbacks_list);
-    pollen_ll_init(&loop->timer_callbacks_list);
-    pollen_ll_init(&loop->efd_callbacks_list);
+    /* callbacks removed while dispatching, freed at the end of loop iteration */
+    struct pollen_callback *dead_callbacks;
+
+    struct pollen_callback_chunk *callback_chunks;
+    struct pollen_callback *free_callbacks;
+    size_t free_callbacks_count;
+    int next_chunk_capacity;
+    uint32_t last_callback_id;
+
+#if !defined(POLLEN_NO_TRACE)
+    /* ring buffer, NULL if tracing is not started. trace_head counts all records ever written */
+    struct pollen_trace_record *trace_records;
+    size_t trace_mask;
+    uint64_t trace_head;
+
+    /* NULL if recording is not started */
+    FILE *record_out;
+    /* replay only, live callbacks indexed by id */
+    bool replaying;
+    struct pollen_callback **replay_callbacks;
+    uint32_t replay_capacity;
+#endif
 
-    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (loop->epoll_fd < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to create epoll: %s", strerror(errno));
-        goto err;
-    }
+#if !defined(POLLEN_NO_METRICS)
+    /* counters are kept here and copied to the shared page, NULL if it is not published */
+    struct pollen_metrics metrics;
+    struct pollen_metrics *metrics_page;
+    int metrics_fd;
+#endif
+};
 
-    /* signalfd will be set up when first signal callback is added */
-    loop->signal_fd = -1;
+/* Keeps count of callbacks by type for metrics. */
+static inline void pollen_internal_callback_count(struct pollen_loop *loop, uint8_t type,
+                                                  int delta) {
+#if !defined(POLLEN_NO_METRICS)
+    loop->metrics.callbacks[type] += delta;
+#else
+    (void)loop;
+    (void)type;
+    (void)delta;
+#endif
+}
 
-    return loop;
+/*
+ * Adds chunk of capacity callbacks to free list. Returns -1 and sets errno on failure, 0 on success.
+ * Every callback starts on a cache line boundary, and callbacks of one loop are packed densely.
+ */
+static int pollen_internal_callback_chunk_add(struct pollen_loop *loop, size_t capacity) {
+    POLLEN_LOG_DEBUG("allocating chunk of %zu callbacks", capacity);
 
-err:
-    POLLEN_FREE(loop);
-    errno = save_errno;
-    return NULL;
+    struct pollen_callback_chunk *chunk =
+        POLLEN_CALLOC(1, sizeof(*chunk) + POLLEN_CACHE_LINE_SIZE + capacity * POLLEN_CALLBACK_STRIDE);
+    if (chunk == NULL) {
+        return -1;
+    }
+    chunk->next = loop->callback_chunks;
+    loop->callback_chunks = chunk;
+
+    /* push in reverse, so that callbacks are handed out in address order */
+    uintptr_t first = (uintptr_t)(chunk + 1);
+    first = (first + POLLEN_CACHE_LINE_SIZE - 1) & ~(uintptr_t)(POLLEN_CACHE_LINE_SIZE - 1);
+    for (size_t i = capacity; i-- > 0;) {
+        struct pollen_callback *callback =
+            (struct pollen_callback *)(first + i * POLLEN_CALLBACK_STRIDE);
+        callback->next_free = loop->free_callbacks;
+        loop->free_callbacks = callback;
+    }
+    loop->free_callbacks_count += capacity;
+
+    return 0;
 }
 
-void pollen_loop_cleanup(struct pollen_loop *loop) {
-    if (loop == NULL) {
-        return;
+/* Makes sure that the next n allocations will not fail, allocating at most one chunk. */
+static int pollen_internal_callback_reserve(struct pollen_loop *loop, size_t n) {
+    if (loop->free_callbacks_count >= n) {
+        return 0;
     }
 
-    POLLEN_LOG_INFO("cleaning up event loop");
+    return pollen_internal_callback_chunk_add(loop, n - loop->free_callbacks_count);
+}
 
-    struct pollen_callback *callback, *callback_tmp;
-    POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->idle_callbacks_list, link) {
-        pollen_loop_remove_callback(callback);
+#if !defined(POLLEN_NO_TRACE)
+/* Makes callback findable by id during replay. Returns false and sets errno on failure. */
+static bool pollen_internal_replay_register(struct pollen_loop *loop,
+                                            struct pollen_callback *callback) {
+    if (callback->id >= loop->replay_capacity) {
+        uint32_t capacity = (loop->replay_capacity > 0) ? loop->replay_capacity : 64;
+        while (capacity <= callback->id) {
+            capacity *= 2;
+        }
+
+        struct pollen_callback **table = POLLEN_CALLOC(capacity, sizeof(*table));
+        if (table == NULL) {
+            POLLEN_LOG_ERR("failed to allocate replay callback table: %s", strerror(errno));
+            return false;
+        }
+        if (loop->replay_callbacks != NULL) {
+            memcpy(table, loop->replay_callbacks, loop->replay_capacity * sizeof(*table));
+        }
+        POLLEN_FREE(loop->replay_callbacks);
+        loop->replay_callbacks = table;
+        loop->replay_capacity = capacity;
     }
-    /* make sure signal are deleted before pollable bc signal handler is itself pollable */
-    POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->signal_callbacks_list, link) {
-        pollen_loop_remove_callback(callback);
+
+    loop->replay_callbacks[callback->id] = callback;
+    return true;
+}
+#endif
+
+/* Zeroes callback and assigns it to loop. Returns false and sets errno on failure. */
+static bool pollen_internal_callback_init(struct pollen_loop *loop,
+                                          struct pollen_callback *callback) {
+    memset(callback, 0, sizeof(*callback));
+    callback->loop = loop;
+    callback->fd = -1;
+    callback->id = ++loop->last_callback_id;
+
+#if !defined(POLLEN_NO_TRACE)
+    if (loop->replaying && !pollen_internal_replay_register(loop, callback)) {
+        return false;
     }
-    POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->fd_callbacks_list, link) {
-        pollen_loop_remove_callback(callback);
+#endif
+
+    return true;
+}
+
+/* Returns zeroed callback, or NULL and sets errno on failure. */
+static struct pollen_callback *pollen_internal_callback_alloc(struct pollen_loop *loop) {
+    if (loop->free_callbacks == NULL) {
+        const int capacity = (loop->next_chunk_capacity > 0) ? loop->next_chunk_capacity : 16;
+        if (pollen_internal_callback_chunk_add(loop, capacity) < 0) {
+            return NULL;
+        }
+
+        if (capacity < 1024) {
+            loop->next_chunk_capacity = capacity * 2;
+        }
     }
-    POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->timer_callbacks_list, link) {
-        pollen_loop_remove_callback(callback);
+
+    struct pollen_callback *callback = loop->free_callbacks;
+    loop->free_callbacks = callback->next_free;
+    loop->free_callbacks_count -= 1;
+
+    if (!pollen_internal_callback_init(loop, callback)) {
+        callback->next_free = loop->free_callbacks;
+        loop->free_callbacks = callback;
+        loop->free_callbacks_count += 1;
+        return NULL;
     }
-    POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->efd_callbacks_list, link) {
-        pollen_loop_remove_callback(callback);
+
+    return callback;
+}
+
+/* Uses storage for the callback if it is not NULL, allocates it otherwise. */
+static struct pollen_callback *pollen_internal_callback_get(struct pollen_loop *loop,
+                                                            struct pollen_callback_storage *storage) {
+    if (storage == NULL) {
+        return pollen_internal_callback_alloc(loop);
     }
 
-    if (loop->signal_fd > 0) {
-        close(loop->signal_fd);
+    struct pollen_callback *callback = (struct pollen_callback *)storage;
+    if (!pollen_internal_callback_init(loop, callback)) {
+        return NULL;
     }
-    close(loop->epoll_fd);
+    callback->caller_owned = true;
 
-    POLLEN_FREE(loop);
+    return callback;
 }
 
-struct pollen_callback *pollen_loop_add_fd(struct pollen_loop *loop,
-                                           int fd, uint32_t events, bool autoclose,
-                                           pollen_fd_callback_fn callback,
-                                           void *data) {
-    struct pollen_callback *new_callback = NULL;
-    int save_errno = 0;
-
-    POLLEN_LOG_INFO("adding pollable callback to event loop, fd %d, events %X", fd, events);
+/* Passing NULL is a harmless no-op. */
+static void pollen_internal_callback_free(struct pollen_loop *loop,
+                                          struct pollen_callback *callback) {
+    if (callback == NULL) {
+        return;
+    }
 
-    new_callback = POLLEN_CALLOC(1, sizeof(*new_callback));
-    if (new_callback == NULL) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
-        goto err;
+#if !defined(POLLEN_NO_TRACE)
+    if (loop->replaying && callback->id < loop->replay_capacity) {
+        loop->replay_callbacks[callback->id] = NULL;
     }
-    new_callback->loop = loop;
-    new_callback->type = POLLEN_CALLBACK_TYPE_FD;
-    new_callback->as.fd.fd = fd;
-    new_callback->as.fd.callback = callback;
-    new_callback->as.fd.autoclose = autoclose;
-    new_callback->data = data;
+#endif
 
-    struct epoll_event epoll_event;
-    epoll_event.events = events;
-    epoll_event.data.ptr = new_callback;
-    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event) < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to add fd %d to epoll: %s", fd, strerror(errno));
-        goto err;
+    if (callback->caller_owned) {
+        return;
     }
 
-    pollen_ll_insert(&loop->fd_callbacks_list, &new_callback->link);
+    callback->next_free = loop->free_callbacks;
+    loop->free_callbacks = callback;
+    loop->free_callbacks_count += 1;
+}
 
-    return new_callback;
+static void pollen_internal_reclaim_dead(struct pollen_loop *loop) {
+    struct pollen_callback *callback = loop->dead_callbacks;
+    while (callback != NULL) {
+        struct pollen_callback *next = callback->next_free;
+        pollen_internal_callback_free(loop, callback);
+        callback = next;
+    }
+    loop->dead_callbacks = NULL;
 
-err:
-    POLLEN_FREE(new_callback);
-    errno = save_errno;
-    return NULL;
+    /* batches that didn't get to run because a callback failed, their callbacks might be gone */
+    while (loop->ready_fd_batches != NULL) {
+        loop->ready_fd_batches->count = 0;
+        loop->ready_fd_batches = loop->ready_fd_batches->next_ready;
+    }
 }
 
-bool pollen_fd_modify_events(struct pollen_callback *callback, uint32_t new_events) {
-    int save_errno;
+#if !defined(POLLEN_NO_TIMERS)
+/* Clock for timers that are armed relative to loop time. */
+static int pollen_internal_timer_clockid(void) {
+    /* timerfd doesn't support coarse clocks, but they share time base with precise ones */
+    switch (POLLEN_CLOCK) {
+    case CLOCK_MONOTONIC_COARSE: return CLOCK_MONOTONIC;
+    case CLOCK_REALTIME_COARSE: return CLOCK_REALTIME;
+    default: return POLLEN_CLOCK;
+    }
+}
+#endif
 
-    if (callback->type != POLLEN_CALLBACK_TYPE_FD) {
-        POLLEN_LOG_ERR("passed non-fd type callback to pollen_fd_modify_events");
-        save_errno = EINVAL;
-        goto err;
+static void pollen_internal_update_time(struct pollen_loop *loop) {
+#if !defined(POLLEN_NO_TIMERS)
+    if (loop->virtual_time) {
+        return;
     }
+#endif
+#if !defined(POLLEN_NO_TRACE)
+    /* loop time comes from the recording */
+    if (loop->replaying) {
+        return;
+    }
+#endif
 
-    POLLEN_LOG_DEBUG("modifying events for fd %d, new_events: %d",
-                     callback->as.fd.fd, new_events);
+    struct timespec ts;
+    clock_gettime(POLLEN_CLOCK, &ts);
+    loop->now_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    struct epoll_event ev;
-    ev.data.ptr = callback;
-    ev.events = new_events;
+#if !defined(POLLEN_NO_TRACE) || !defined(POLLEN_NO_METRICS)
+/* precise time for tracing and metrics, regardless of POLLEN_CLOCK */
+static uint64_t pollen_internal_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
 
-    if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_MOD, callback->as.fd.fd, &ev) < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to modify events for fd %d: %s",
-                       callback->as.fd.fd, strerror(errno));
-        goto err;
+#if !defined(POLLEN_NO_TRACE)
+
+static inline void pollen_internal_trace(struct pollen_loop *loop, uint8_t kind, uint8_t type,
+                                         int32_t arg, uint32_t events,
+                                         uint64_t start_ns, uint64_t end_ns) {
+    struct pollen_trace_record *record =
+        &loop->trace_records[loop->trace_head++ & loop->trace_mask];
+
+    record->start_ns = start_ns;
+    record->duration_ns = (end_ns > start_ns) ? end_ns - start_ns : 0;
+    record->arg = arg;
+    record->events = events;
+    record->kind = kind;
+    record->type = type;
+}
+
+static void pollen_internal_record_write(struct pollen_loop *loop, uint32_t id,
+                                         uint32_t events, uint64_t value) {
+    const struct pollen_record record = {
+        .value = value,
+        .id = id,
+        .events = events,
+    };
+    if (fwrite(&record, sizeof(record), 1, loop->record_out) != 1) {
+        POLLEN_LOG_ERR("failed to write recording, stopping: %s", strerror(errno));
+        loop->record_out = NULL;
     }
+}
 
-    return true;
+/* Records a run of callback, see struct pollen_record. */
+static inline void pollen_internal_record(struct pollen_loop *loop,
+                                          struct pollen_callback *callback,
+                                          uint32_t events, uint64_t value) {
+    if (loop->record_out != NULL) {
+        pollen_internal_record_write(loop, callback->id, events, value);
+    }
+}
+#else
+static inline void pollen_internal_record(struct pollen_loop *loop,
+                                          struct pollen_callback *callback,
+                                          uint32_t events, uint64_t value) {
+    (void)loop;
+    (void)callback;
+    (void)events;
+    (void)value;
+}
+#endif
 
-err:
-    errno = save_errno;
-    return false;
+#if !defined(POLLEN_NO_SIGNALS)
+/* not an actual real callback, more like a hack to hook signal handling into the loop */
+static int pollen_internal_signal_handler(struct pollen_callback *callback, int fd,
+                                          unsigned int events, void *data) {
+    struct pollen_loop *loop = data;
+
+    /* TODO: figure out why does this always only read only one siginfo */
+    int ret;
+    struct signalfd_siginfo siginfo;
+    while ((ret = read(loop->signal_fd, &siginfo, sizeof(siginfo))) == sizeof(siginfo)) {
+        int signal = siginfo.ssi_signo;
+        POLLEN_LOG_DEBUG("received signal %d via signalfd", signal);
+        POLLEN_USDT_PROBE1(signal, signal);
+
+        struct pollen_callback *signal_callback = loop->signal_callbacks[signal];
+        if (signal_callback != NULL) {
+            pollen_internal_record(loop, signal_callback, 0, signal);
+            return signal_callback->fn.signal(signal_callback, signal,
+                                              signal_callback->data);
+        } else {
+            POLLEN_LOG_ERR("signal %d received via signalfd has no callbacks installed", signal);
+            return -1;
+        }
+    }
+
+    if (ret >= 0) {
+        POLLEN_LOG_ERR("read incorrect amount of bytes from signalfd");
+        return -1;
+    } else /* ret < 0 */ {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* no more signalds to handle. exit. */
+            POLLEN_LOG_DEBUG("no more signals to handle");
+            return 0;
+        } else {
+            POLLEN_LOG_ERR("failed to read siginfo from signalfd: %s", strerror(errno));
+            return -1;
+        }
+    }
 }
 
-struct pollen_callback *pollen_loop_add_idle(struct pollen_loop *loop, int priority,
-                                             pollen_idle_callback_fn callback,
-                                             void *data) {
-    struct pollen_callback *new_callback = NULL;
+static int pollen_internal_setup_signalfd(struct pollen_loop *loop) {
     int save_errno = 0;
+    POLLEN_LOG_DEBUG("setting up signalfd");
 
-    POLLEN_LOG_INFO("adding unconditional callback with prio %d to event loop", priority);
-
-    new_callback = POLLEN_CALLOC(1, sizeof(*new_callback));
-    if (new_callback == NULL) {
+    sigemptyset(&loop->sigset);
+    loop->signal_fd = signalfd(-1, &loop->sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop->signal_fd < 0) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        POLLEN_LOG_ERR("failed to create signalfd: %s", strerror(errno));
         goto err;
     }
-    new_callback->loop = loop;
-    new_callback->type = POLLEN_CALLBACK_TYPE_IDLE;
-    new_callback->as.idle.priority = priority;
-    new_callback->as.idle.callback = callback;
-    new_callback->data = data;
 
-    if (pollen_ll_is_empty(&loop->idle_callbacks_list)) {
-        pollen_ll_insert(&loop->idle_callbacks_list, &new_callback->link);
-    } else {
-        struct pollen_callback *elem;
-        bool found = false;
-        POLLEN_LL_FOR_EACH_REVERSE(elem, &loop->idle_callbacks_list, link) {
-            /*         |6|
-             * |9|  |8|\/|4|  |2|
-             * <-----------------
-             * iterate from the end and find the first callback with higher prio
-             */
-            if (elem->as.idle.priority > priority) {
-                found = true;
-                pollen_ll_insert(&elem->link, &new_callback->link);
-                break;
-            }
-        }
-        if (!found) {
-            pollen_ll_insert(&loop->idle_callbacks_list, &new_callback->link);
-        }
+    if (pollen_loop_add_fd(loop, loop->signal_fd, EPOLLIN, false,
+                           pollen_internal_signal_handler, loop) == NULL) {
+        save_errno = errno;
+        goto err;
     }
 
-    return new_callback;
+    return 0;
 
 err:
-    POLLEN_FREE(new_callback);
     errno = save_errno;
-    return NULL;
+    return -1;
 }
+#endif /* #if !defined(POLLEN_NO_SIGNALS) */
 
-struct pollen_callback *pollen_loop_add_signal(struct pollen_loop *loop, int signal,
-                                               pollen_signal_callback_fn callback,
-                                               void *data) {
-    struct pollen_callback *new_callback = NULL;
-    int save_errno = 0;
-    bool sigset_saved = false;
-    sigset_t save_global_sigset;
-    sigset_t save_loop_sigset = loop->sigset;
-    bool need_reset_handler = false;
+/* Grows fd table so that it can hold fd. */
+static int pollen_internal_fds_grow(struct pollen_loop *loop, int fd) {
+    if (fd < loop->fds_capacity) {
+        return 0;
+    }
 
-    POLLEN_LOG_INFO("adding signal callback for signal %d", signal);
+    int new_capacity = (loop->fds_capacity > 0) ? loop->fds_capacity : 64;
+    while (new_capacity <= fd) {
+        new_capacity *= 2;
+    }
 
-    if (loop->signal_fd < 0 && pollen_internal_setup_signalfd(loop) < 0) {
-        goto err;
+    POLLEN_LOG_DEBUG("growing fd table from %d to %d", loop->fds_capacity, new_capacity);
+
+    struct pollen_callback **new_fds = POLLEN_CALLOC(new_capacity, sizeof(*new_fds));
+    if (new_fds == NULL) {
+        POLLEN_LOG_ERR("failed to allocate memory for fd table: %s", strerror(errno));
+        return -1;
+    }
+    if (loop->fds != NULL) {
+        memcpy(new_fds, loop->fds, loop->fds_capacity * sizeof(*new_fds));
+        POLLEN_FREE(loop->fds);
     }
 
-    if (sigprocmask(SIG_BLOCK /* ignored */, NULL, &save_global_sigset) < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to save original sigmask: %s", strerror(errno));
-        goto err;
+    loop->fds = new_fds;
+    loop->fds_capacity = new_capacity;
+
+    return 0;
+}
+
+/* Checks that fd is valid and not registered yet, and grows fd table if needed. */
+static int pollen_internal_fds_reserve(struct pollen_loop *loop, int fd) {
+    if (fd < 0) {
+        POLLEN_LOG_ERR("invalid fd %d", fd);
+        errno = EBADF;
+        return -1;
     }
-    sigset_saved = true;
 
-    new_callback = POLLEN_CALLOC(1, sizeof(*new_callback));
-    if (new_callback == NULL) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
-        goto err;
+    if (fd < loop->fds_capacity && loop->fds[fd] != NULL) {
+        POLLEN_LOG_ERR("fd %d is already registered in event loop", fd);
+        errno = EEXIST;
+        return -1;
     }
-    new_callback->loop = loop;
-    new_callback->type = POLLEN_CALLBACK_TYPE_SIGNAL;
-    new_callback->as.signal.sig = signal;
-    new_callback->as.signal.callback = callback;
-    new_callback->data = data;
 
-    /* first, create empty sigset and add our desired signal there. */
-    sigset_t set;
-    sigemptyset(&set);
-    if (sigaddset(&set, signal) < 0) {
+    return pollen_internal_fds_grow(loop, fd);
+}
+
+static void pollen_internal_fds_set(struct pollen_loop *loop, int fd,
+                                    struct pollen_callback *callback) {
+    loop->fds[fd] = callback;
+    loop->fds_count += (callback != NULL) ? 1 : -1;
+}
+
+struct pollen_loop *pollen_loop_create(void) {
+    POLLEN_LOG_INFO("creating event loop");
+    int save_errno = 0;
+
+    struct pollen_loop *loop = POLLEN_CALLOC(1, sizeof(*loop));
+    if (loop == NULL) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to add signal %d to sigset: %s", signal, strerror(errno));
+        POLLEN_LOG_ERR("failed to allocate memory for event loop: %s", strerror(errno));
         goto err;
     }
 
-    /* block the desired signal globally. */
-    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0) {
+    pollen_ll_init(&loop->fd_batches);
+#if !defined(POLLEN_NO_IDLE)
+    pollen_ll_init(&loop->idle_callbacks_list);
+#endif
+#if !defined(POLLEN_NO_SIGNALS)
+    pollen_ll_init(&loop->signal_callbacks_list);
+#endif
+#if !defined(POLLEN_NO_EFDS)
+    pollen_ll_init(&loop->efd_pending);
+#endif
+
+#if !defined(POLLEN_NO_TIMERS)
+    for (int i = 0; i < POLLEN_TIMEOUT_WHEEL_SLOTS; i++) {
+        pollen_ll_init(&loop->timeout_wheel[i]);
+    }
+    pollen_ll_init(&loop->rate_limits);
+#if !defined(POLLEN_NO_LISTENERS)
+    pollen_ll_init(&loop->paused_listeners);
+#endif
+    pollen_ll_init(&loop->virtual_timers);
+#endif
+    pollen_internal_update_time(loop);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to block signal %d: %s", signal, strerror(errno));
+        POLLEN_LOG_ERR("failed to create epoll: %s", strerror(errno));
         goto err;
     }
 
-    /* on success, add the same signal to loop's sigset. */
-    if (sigaddset(&loop->sigset, signal) < 0) {
+    loop->deferred = POLLEN_CALLOC(POLLEN_DEFER_CAPACITY, sizeof(*loop->deferred));
+    if (loop->deferred == NULL) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to add signal %d to loop sigset: %s", signal, strerror(errno));
+        POLLEN_LOG_ERR("failed to allocate memory for deferred tasks: %s", strerror(errno));
+        close(loop->epoll_fd);
         goto err;
     }
+    loop->deferred_mask = POLLEN_DEFER_CAPACITY - 1;
 
-    /* check if handler for this signal already exists */
-    if (loop->signal_callbacks[signal] != NULL) {
-        POLLEN_LOG_ERR("callback for signal %d already exists", signal);
-        save_errno = EEXIST;
-        goto err;
-    }
-    loop->signal_callbacks[signal] = new_callback;
-    need_reset_handler = true;
+#if !defined(POLLEN_NO_SIGNALS)
+    /* signalfd will be set up when first signal callback is added */
+    loop->signal_fd = -1;
+#endif
 
-    /* change signalfd mask to report newly added signal */
-    int ret = signalfd(loop->signal_fd, &loop->sigset, 0);
-    if (ret < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to change signalfd sigmask: %s", strerror(errno));
-        goto err;
+    return loop;
+
+err:
+    POLLEN_FREE(loop);
+    errno = save_errno;
+    return NULL;
+}
+
+void pollen_loop_cleanup(struct pollen_loop *loop) {
+    if (loop == NULL) {
+        return;
     }
 
-    pollen_ll_insert(&loop->signal_callbacks_list, &new_callback->link);
+    POLLEN_LOG_INFO("cleaning up event loop");
 
-    return new_callback;
+#if !defined(POLLEN_NO_GROUPS)
+    /* its efd goes away with the rest of fd callbacks, so wait out whoever is triggering it */
+    if (loop->group_member != NULL) {
+        struct pollen_group_member *member = loop->group_member;
+        member->loop = NULL;
+        atomic_store_explicit(&member->sleeping, false, memory_order_relaxed);
+        atomic_store_explicit(&member->wake, NULL, memory_order_seq_cst);
+        while (atomic_load_explicit(&member->wakers, memory_order_seq_cst) != 0) {
+            sched_yield();
+        }
+    }
+#endif
 
-err:
-    /* restore original sigmask on failure. important! */
-    if (sigset_saved) {
-        if (sigprocmask(SIG_SETMASK, &save_global_sigset, NULL) < 0) {
-            POLLEN_LOG_WARN("failed to restore original signal mask! %s", strerror(errno));
+    struct pollen_callback *callback;
+#if !defined(POLLEN_NO_IDLE)
+    struct pollen_callback *idle_tmp;
+    POLLEN_LL_FOR_EACH_SAFE(callback, idle_tmp, &loop->idle_callbacks_list, link) {
+        pollen_loop_remove_callback(callback);
+    }
+#endif
+#if !defined(POLLEN_NO_SIGNALS)
+    /* make sure signal are deleted before pollable bc signal handler is itself pollable */
+    struct pollen_callback *signal_tmp;
+    POLLEN_LL_FOR_EACH_SAFE(callback, signal_tmp, &loop->signal_callbacks_list, link) {
+        pollen_loop_remove_callback(callback);
+    }
+#endif
+    /* fd callbacks can still reference internal timers, so they go first */
+    for (int fd = 0; fd < loop->fds_capacity; fd++) {
+        callback = loop->fds[fd];
+        if (callback != NULL && callback->type == POLLEN_CALLBACK_TYPE_FD) {
+            pollen_loop_remove_callback(callback);
         }
     }
-    loop->sigset = save_loop_sigset;
+    for (int fd = 0; fd < loop->fds_capacity; fd++) {
+        pollen_loop_remove_callback(loop->fds[fd]);
+    }
+    while (!pollen_ll_is_empty(&loop->fd_batches)) {
+        struct pollen_ll *link = loop->fd_batches.next;
+        pollen_ll_remove(link);
+        POLLEN_FREE((char *)link - offsetof(struct pollen_fd_batch, link));
+    }
+#if !defined(POLLEN_NO_TIMERS)
+    /* their fds are detached and timers are removed by now */
+    while (!pollen_ll_is_empty(&loop->rate_limits)) {
+        struct pollen_ll *link = loop->rate_limits.next;
+        pollen_ll_remove(link);
+        POLLEN_FREE((char *)link - offsetof(struct pollen_rate_limit, link));
+    }
+#endif
+#if !defined(POLLEN_NO_ASYNC_CLOSE)
+    /* waits for fds of the callbacks removed above */
+    pollen_loop_set_async_close(loop, false);
+#endif
 
-    if (need_reset_handler) {
-        loop->signal_callbacks[signal] = NULL;
+#if !defined(POLLEN_NO_SIGNALS)
+    if (loop->signal_fd > 0) {
+        close(loop->signal_fd);
     }
+#endif
+    close(loop->epoll_fd);
 
-    POLLEN_FREE(new_callback);
-    errno = save_errno;
-    return NULL;
+    pollen_internal_reclaim_dead(loop);
+    POLLEN_FREE(loop->fds);
+    POLLEN_FREE(loop->deferred);
+#if !defined(POLLEN_NO_TRACE)
+    POLLEN_FREE(loop->trace_records);
+    pollen_loop_record_stop(loop);
+#endif
+#if !defined(POLLEN_NO_METRICS)
+    pollen_loop_metrics_stop(loop);
+#endif
+
+    struct pollen_callback_chunk *chunk = loop->callback_chunks;
+    while (chunk != NULL) {
+        struct pollen_callback_chunk *next = chunk->next;
+        POLLEN_FREE(chunk);
+        chunk = next;
+    }
+
+    POLLEN_FREE(loop);
 }
 
-struct pollen_callback *pollen_loop_add_timer(struct pollen_loop *loop, int clockid,
-                                              pollen_timer_callback_fn callback,
-                                              void *data) {
+static int pollen_internal_dispatch_fd(struct pollen_loop *loop,
+                                       struct pollen_callback *callback, uint32_t events) {
+    /* events might have been changed by another callback after epoll_wait returned */
+    events &= callback->events | EPOLLERR | EPOLLHUP;
+    if (events == 0) {
+        POLLEN_LOG_DEBUG("no registered events left for fd %d, skipping", callback->fd);
+        return 0;
+    }
+
+    POLLEN_LOG_DEBUG("running callback for fd %d", callback->fd);
+
+#if !defined(POLLEN_NO_TIMERS)
+    callback->last_active_ns = loop->now_ns;
+#endif
+    pollen_internal_record(loop, callback, events, 0);
+    return callback->fn.fd(callback, callback->fd, events, callback->data);
+}
+
+static void pollen_internal_fd_batch_push(struct pollen_loop *loop,
+                                          struct pollen_callback *callback, uint32_t events) {
+    struct pollen_fd_batch *batch = callback->as.fd.batch;
+    if (batch->count == 0) {
+        batch->next_ready = loop->ready_fd_batches;
+        loop->ready_fd_batches = batch;
+    }
+    struct pollen_fd_event *event = &batch->events[batch->count++];
+    event->callback = callback;
+    event->data = callback->data;
+    event->fd = callback->fd;
+    event->events = events;
+}
+
+/* Same as pollen_internal_dispatch_fd, but leaves running to the batch of the callback. */
+static int pollen_internal_dispatch_fd_batched(struct pollen_loop *loop,
+                                               struct pollen_callback *callback, uint32_t events) {
+    events &= callback->events | EPOLLERR | EPOLLHUP;
+    if (events == 0) {
+        POLLEN_LOG_DEBUG("no registered events left for fd %d, skipping", callback->fd);
+        return 0;
+    }
+
+#if !defined(POLLEN_NO_TIMERS)
+    callback->last_active_ns = loop->now_ns;
+#endif
+    /* recorded when the batch runs, see pollen_internal_fd_batches_run */
+    pollen_internal_fd_batch_push(loop, callback, events);
+    return 0;
+}
+
+static struct pollen_callback *pollen_internal_add_fd(struct pollen_loop *loop,
+                                                      struct pollen_callback_storage *storage,
+                                                      int fd, uint32_t events, bool autoclose,
+                                                      pollen_fd_callback_fn callback,
+                                                      void *data) {
     struct pollen_callback *new_callback = NULL;
     int save_errno = 0;
-    int tfd = -1;
 
-    POLLEN_LOG_INFO("adding timer callback to event loop, clockid %d", clockid);
+    POLLEN_LOG_INFO("adding pollable callback to event loop, fd %d, events %X", fd, events);
 
-    tfd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
-    if (tfd < 0) {
+    new_callback = pollen_internal_callback_get(loop, storage);
+    if (new_callback == NULL) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to create timerfd: %s", strerror(errno));
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
         goto err;
     }
+    new_callback->type = POLLEN_CALLBACK_TYPE_FD;
+    new_callback->dispatch = pollen_internal_dispatch_fd;
+    new_callback->fd = fd;
+    new_callback->events = events;
+#if !defined(POLLEN_NO_TIMERS)
+    new_callback->as.fd.requested_events = events;
+#endif
+    new_callback->fn.fd = callback;
+    new_callback->as.fd.autoclose = autoclose;
+    new_callback->data = data;
 
-    new_callback = POLLEN_CALLOC(1, sizeof(*new_callback));
-    if (new_callback == NULL) {
+    if (pollen_internal_fds_reserve(loop, fd) < 0) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
         goto err;
     }
-    new_callback->loop = loop;
-    new_callback->type = POLLEN_CALLBACK_TYPE_TIMER;
-    new_callback->as.timer.fd = tfd;
-    new_callback->as.timer.callback = callback;
-    new_callback->data = data;
 
     struct epoll_event epoll_event;
-    epoll_event.events = EPOLLIN;
+    epoll_event.events = events;
     epoll_event.data.ptr = new_callback;
-    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, tfd, &epoll_event) < 0) {
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event) < 0) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to add fd %d to epoll: %s", tfd, strerror(errno));
+        POLLEN_LOG_ERR("failed to add fd %d to epoll: %s", fd, strerror(errno));
         goto err;
     }
 
-    pollen_ll_insert(&loop->timer_callbacks_list, &new_callback->link);
+    pollen_internal_fds_set(loop, fd, new_callback);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
 
     return new_callback;
 
 err:
-    if (tfd > 0) {
-        close(tfd);
-    }
-    POLLEN_FREE(new_callback);
+    pollen_internal_callback_free(loop, new_callback);
     errno = save_errno;
     return NULL;
 }
 
-bool pollen_timer_arm(struct pollen_callback *callback, bool absolute,
-                      struct timespec initial, struct timespec periodic) {
+struct pollen_callback *pollen_loop_add_fd(struct pollen_loop *loop,
+                                           int fd, uint32_t events, bool autoclose,
+                                           pollen_fd_callback_fn callback,
+                                           void *data) {
+    return pollen_internal_add_fd(loop, NULL, fd, events, autoclose, callback, data);
+}
+
+struct pollen_callback *pollen_loop_add_fd_static(struct pollen_loop *loop,
+                                                  struct pollen_callback_storage *storage,
+                                                  int fd, uint32_t events, bool autoclose,
+                                                  pollen_fd_callback_fn callback,
+                                                  void *data) {
+    return pollen_internal_add_fd(loop, storage, fd, events, autoclose, callback, data);
+}
+
+bool pollen_loop_reserve_fds(struct pollen_loop *loop, int max_fd) {
+    POLLEN_LOG_DEBUG("reserving fd table for fds up to %d", max_fd);
+
+    return pollen_internal_fds_grow(loop, max_fd) == 0;
+}
+
+bool pollen_loop_add_fds(struct pollen_loop *loop, const struct pollen_fd_spec *specs, size_t n,
+                         struct pollen_callback **out) {
     int save_errno = 0;
+    size_t added = 0;
 
-    if (callback->type != POLLEN_CALLBACK_TYPE_TIMER) {
-        POLLEN_LOG_ERR("passed non-timer type callback to pollen_timer_arm");
+    POLLEN_LOG_INFO("adding %zu pollable callbacks to event loop", n);
+
+    int max_fd = -1;
+    for (size_t i = 0; i < n; i++) {
+        if (specs[i].fd > max_fd) {
+            max_fd = specs[i].fd;
+        }
+    }
+
+    if (max_fd >= 0 && pollen_internal_fds_grow(loop, max_fd) < 0) {
+        save_errno = errno;
+        goto err;
+    }
+
+    if (pollen_internal_callback_reserve(loop, n) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for %zu callbacks: %s", n, strerror(errno));
+        goto err;
+    }
+
+    for (; added < n; added++) {
+        const struct pollen_fd_spec *spec = &specs[added];
+
+        if (pollen_internal_fds_reserve(loop, spec->fd) < 0) {
+            save_errno = errno;
+            goto err;
+        }
+
+        /* memory was reserved above, but registering for replay can still fail */
+        struct pollen_callback *new_callback = pollen_internal_callback_alloc(loop);
+        if (new_callback == NULL) {
+            save_errno = errno;
+            POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+            goto err;
+        }
+        new_callback->type = POLLEN_CALLBACK_TYPE_FD;
+        new_callback->dispatch = pollen_internal_dispatch_fd;
+        new_callback->fd = spec->fd;
+        new_callback->events = spec->events;
+#if !defined(POLLEN_NO_TIMERS)
+        new_callback->as.fd.requested_events = spec->events;
+#endif
+        new_callback->fn.fd = spec->callback;
+        new_callback->as.fd.autoclose = spec->autoclose;
+        new_callback->data = spec->data;
+
+        struct epoll_event epoll_event;
+        epoll_event.events = spec->events;
+        epoll_event.data.ptr = new_callback;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, spec->fd, &epoll_event) < 0) {
+            save_errno = errno;
+            POLLEN_LOG_ERR("failed to add fd %d to epoll: %s", spec->fd, strerror(errno));
+            pollen_internal_callback_free(loop, new_callback);
+            goto err;
+        }
+
+        pollen_internal_fds_set(loop, spec->fd, new_callback);
+        if (out != NULL) {
+            out[added] = new_callback;
+        }
+
+        POLLEN_USDT_PROBE2(callback_add, POLLEN_CALLBACK_TYPE_FD, spec->fd);
+        pollen_internal_callback_count(loop, POLLEN_CALLBACK_TYPE_FD, 1);
+    }
+
+    return true;
+
+err:
+    POLLEN_LOG_ERR("rolling back %zu added fds", added);
+    while (added-- > 0) {
+        const int fd = specs[added].fd;
+        struct pollen_callback *callback = loop->fds[fd];
+
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to remove fd %d from epoll: %s", fd, strerror(errno));
+        }
+        pollen_internal_fds_set(loop, fd, NULL);
+        POLLEN_USDT_PROBE2(callback_remove, POLLEN_CALLBACK_TYPE_FD, fd);
+        pollen_internal_callback_count(loop, POLLEN_CALLBACK_TYPE_FD, -1);
+        pollen_internal_callback_free(loop, callback);
+
+        if (out != NULL) {
+            out[added] = NULL;
+        }
+    }
+
+    errno = save_errno;
+    return false;
+}
+
+bool pollen_fd_modify_events(struct pollen_callback *callback, uint32_t new_events) {
+    int save_errno;
+
+    if (callback->type != POLLEN_CALLBACK_TYPE_FD) {
+        POLLEN_LOG_ERR("passed non-fd type callback to pollen_fd_modify_events");
         save_errno = EINVAL;
         goto err;
     }
 
-    POLLEN_LOG_DEBUG("arming timerfd %d for (%li s %li ns) initial, (%li s %li ns) periodic",
-                     callback->as.timer.fd,
-                     initial.tv_sec, initial.tv_nsec,
-                     periodic.tv_sec, periodic.tv_nsec);
+    POLLEN_LOG_DEBUG("modifying events for fd %d, new_events: %d",
+                     callback->fd, new_events);
 
-    const struct itimerspec itimerspec = {
-        .it_value = initial,
-        .it_interval = periodic,
-    };
-    const int flags = absolute ? TFD_TIMER_ABSTIME : 0;
-    if (timerfd_settime(callback->as.timer.fd, flags, &itimerspec, NULL) < 0) {
+    uint32_t registered_events = new_events;
+#if !defined(POLLEN_NO_TIMERS)
+    if (callback->as.fd.rate_limit != NULL && callback->as.fd.rate_limit->suspended) {
+        registered_events &= ~EPOLLIN;
+    }
+#endif
+
+    struct epoll_event ev;
+    ev.data.ptr = callback;
+    ev.events = registered_events;
+
+    if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_MOD, callback->fd, &ev) < 0) {
         save_errno = errno;
-        POLLEN_LOG_ERR("failed to arm timer: %s", strerror(errno));
+        POLLEN_LOG_ERR("failed to modify events for fd %d: %s",
+                       callback->fd, strerror(errno));
         goto err;
     }
 
+    callback->events = registered_events;
+#if !defined(POLLEN_NO_TIMERS)
+    callback->as.fd.requested_events = new_events;
+#endif
+
     return true;
 
 err:
@@ -813,355 +2354,3882 @@ err:
     return false;
 }
 
-bool pollen_timer_arm_s(struct pollen_callback *callback, bool absolute,
-                        unsigned long initial_s, unsigned long periodic_s) {
-    const struct timespec initial = {
-        .tv_sec = initial_s
-    };
-    const struct timespec periodic = {
-        .tv_sec = periodic_s
-    };
-    return pollen_timer_arm(callback, absolute, initial, periodic);
-}
+#if !defined(POLLEN_NO_TIMERS)
+#define POLLEN_TIMEOUT_GRANULARITY_NS ((uint64_t)POLLEN_TIMEOUT_GRANULARITY_MS * 1000000)
 
-bool pollen_timer_arm_ms(struct pollen_callback *callback, bool absolute,
-                         unsigned long initial_ms, unsigned long periodic_ms) {
-    const struct timespec initial = {
-        .tv_sec = initial_ms / 1000,
-        .tv_nsec = (initial_ms % 1000) * 1000000,
-    };
-    const struct timespec periodic = {
-        .tv_sec = periodic_ms / 1000,
-        .tv_nsec = (periodic_ms % 1000) * 1000000,
-    };
-    return pollen_timer_arm(callback, absolute, initial, periodic);
-}
+/* Puts callback into the wheel bucket that will be checked right after its deadline. */
+static void pollen_internal_timeout_schedule(struct pollen_loop *loop,
+                                             struct pollen_callback *callback) {
+    const uint64_t deadline = callback->last_active_ns + callback->as.fd.timeout_ns;
 
-bool pollen_timer_arm_us(struct pollen_callback *callback, bool absolute,
-                         unsigned long initial_us, unsigned long periodic_us) {
-    const struct timespec initial = {
-        .tv_sec = initial_us / 1000000,
-        .tv_nsec = (initial_us % 1000000) * 1000,
-    };
-    const struct timespec periodic = {
-        .tv_sec = periodic_us / 1000000,
-        .tv_nsec = (periodic_us % 1000000) * 1000,
-    };
-    return pollen_timer_arm(callback, absolute, initial, periodic);
+    uint64_t tick = (deadline + POLLEN_TIMEOUT_GRANULARITY_NS - 1) / POLLEN_TIMEOUT_GRANULARITY_NS;
+    if (tick < loop->timeout_next_tick) {
+        tick = loop->timeout_next_tick;
+    }
+
+    pollen_ll_insert(&loop->timeout_wheel[tick % POLLEN_TIMEOUT_WHEEL_SLOTS],
+                     &callback->as.fd.timeout_link);
 }
 
-bool pollen_timer_arm_ns(struct pollen_callback *callback, bool absolute,
-                         unsigned long initial_ns, unsigned long periodic_ns) {
-    const struct timespec initial = {
-        .tv_sec = initial_ns / 1000000000,
-        .tv_nsec = initial_ns % 1000000000,
-    };
-    const struct timespec periodic = {
-        .tv_sec = periodic_ns / 1000000000,
-        .tv_nsec = periodic_ns % 1000000000,
-    };
-    return pollen_timer_arm(callback, absolute, initial, periodic);
+static void pollen_internal_timeout_unlink(struct pollen_callback *callback) {
+    struct pollen_loop *loop = callback->loop;
+
+    pollen_ll_remove(&callback->as.fd.timeout_link);
+    callback->as.fd.timeout_ns = 0;
+
+    loop->timeout_count -= 1;
+    if (loop->timeout_count == 0) {
+        POLLEN_LOG_DEBUG("no more inactivity timeouts, disarming timeout wheel");
+        pollen_timer_disarm(loop->timeout_timer);
+    }
 }
 
-bool pollen_timer_disarm(struct pollen_callback *callback) {
-    int save_errno = 0;
+/*
+ * Timer callback that advances the timeout wheel.
+ * Buckets are not sorted, and activity does not move callbacks between buckets,
+ * so every callback found in expired bucket has its timestamp checked again.
+ * Callbacks that were active since they were scheduled get rescheduled.
+ */
+static int pollen_internal_timeout_sweep(struct pollen_callback *timer, void *data) {
+    struct pollen_loop *loop = data;
+    const uint64_t now = loop->now_ns;
+    const uint64_t now_tick = now / POLLEN_TIMEOUT_GRANULARITY_NS;
 
-    if (callback->type != POLLEN_CALLBACK_TYPE_TIMER) {
-        POLLEN_LOG_ERR("passed non-timer type callback to pollen_timer_disarm");
-        save_errno = EINVAL;
-        goto err;
+    /* visit every bucket at most once, no matter how long we did not run */
+    if (now_tick >= loop->timeout_next_tick + POLLEN_TIMEOUT_WHEEL_SLOTS) {
+        loop->timeout_next_tick = now_tick - POLLEN_TIMEOUT_WHEEL_SLOTS + 1;
     }
 
-    POLLEN_LOG_DEBUG("disarming timerfd %d", callback->as.timer.fd);
+    while (loop->timeout_next_tick <= now_tick) {
+        struct pollen_ll *bucket =
+            &loop->timeout_wheel[loop->timeout_next_tick % POLLEN_TIMEOUT_WHEEL_SLOTS];
+        loop->timeout_next_tick += 1;
 
-    struct itimerspec itimerspec;
-    itimerspec.it_value.tv_sec = 0;
-    itimerspec.it_value.tv_nsec = 0;
-    itimerspec.it_interval.tv_sec = 0;
-    itimerspec.it_interval.tv_nsec = 0;
+        /* timeout_fn can reschedule or remove arbitrary callbacks, so work on a private list */
+        struct pollen_ll expired;
+        pollen_ll_move(&expired, bucket);
 
-    if (timerfd_settime(callback->as.timer.fd, 0, &itimerspec, NULL) < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to disarm timer: %s", strerror(errno));
-        goto err;
-    }
+        while (!pollen_ll_is_empty(&expired)) {
+            struct pollen_callback *callback =
+                POLLEN_CONTAINER_OF(expired.next, callback, as.fd.timeout_link);
+            pollen_ll_remove(&callback->as.fd.timeout_link);
+
+            if (callback->last_active_ns + callback->as.fd.timeout_ns > now) {
+                pollen_internal_timeout_schedule(loop, callback);
+                continue;
+            }
+
+            callback->last_active_ns = now;
+            pollen_internal_timeout_schedule(loop, callback);
+
+            POLLEN_LOG_DEBUG("running inactivity timeout callback for fd %d",
+                             callback->fd);
+            int ret = callback->as.fd.timeout_fn(callback, callback->fd, callback->data);
+            if (ret < 0) {
+                /* put the rest back so they don't get lost */
+                while (!pollen_ll_is_empty(&expired)) {
+                    callback = POLLEN_CONTAINER_OF(expired.next, callback, as.fd.timeout_link);
+                    pollen_ll_remove(&callback->as.fd.timeout_link);
+                    pollen_internal_timeout_schedule(loop, callback);
+                }
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+bool pollen_fd_set_timeout(struct pollen_callback *callback, unsigned long timeout_ms,
+                           pollen_fd_timeout_fn timeout_fn) {
+    int save_errno = 0;
+    struct pollen_loop *loop = callback->loop;
+
+    if (callback->type != POLLEN_CALLBACK_TYPE_FD) {
+        POLLEN_LOG_ERR("passed non-fd type callback to pollen_fd_set_timeout");
+        save_errno = EINVAL;
+        goto err;
+    }
+
+    POLLEN_LOG_DEBUG("setting inactivity timeout for fd %d to %lu ms",
+                     callback->fd, timeout_ms);
+
+    if (timeout_ms == 0) {
+        if (callback->as.fd.timeout_ns != 0) {
+            pollen_internal_timeout_unlink(callback);
+        }
+        return true;
+    }
+
+    if (loop->timeout_timer == NULL) {
+        loop->timeout_timer = pollen_loop_add_timer(loop, CLOCK_MONOTONIC,
+                                                    pollen_internal_timeout_sweep, loop);
+        if (loop->timeout_timer == NULL) {
+            save_errno = errno;
+            goto err;
+        }
+    }
+
+    pollen_internal_update_time(loop);
+
+    if (loop->timeout_count == 0) {
+        POLLEN_LOG_DEBUG("arming timeout wheel");
+        loop->timeout_next_tick = loop->now_ns / POLLEN_TIMEOUT_GRANULARITY_NS;
+        if (!pollen_timer_arm_ms(loop->timeout_timer, false,
+                                 POLLEN_TIMEOUT_GRANULARITY_MS, POLLEN_TIMEOUT_GRANULARITY_MS)) {
+            save_errno = errno;
+            goto err;
+        }
+    }
+
+    if (callback->as.fd.timeout_ns != 0) {
+        pollen_ll_remove(&callback->as.fd.timeout_link);
+    } else {
+        loop->timeout_count += 1;
+    }
+
+    callback->as.fd.timeout_fn = timeout_fn;
+    callback->as.fd.timeout_ns = (uint64_t)timeout_ms * 1000000;
+    callback->last_active_ns = loop->now_ns;
+    pollen_internal_timeout_schedule(loop, callback);
+
+    return true;
+
+err:
+    errno = save_errno;
+    return false;
+}
+
+void pollen_fd_touch(struct pollen_callback *callback) {
+    callback->last_active_ns = callback->loop->now_ns;
+}
+
+static void pollen_internal_rate_limit_refill(struct pollen_rate_limit *limit) {
+    const uint64_t now = limit->loop->now_ns;
+
+    if (now > limit->last_refill_ns) {
+        limit->tokens += (now - limit->last_refill_ns) * limit->rate_per_ns;
+        if (limit->tokens > limit->burst) {
+            limit->tokens = limit->burst;
+        }
+    }
+    limit->last_refill_ns = now;
+}
+
+/* Registers requested events of fd callback, minus EPOLLIN if its bucket is suspended. */
+static void pollen_internal_rate_limit_apply(struct pollen_callback *callback) {
+    uint32_t events = callback->as.fd.requested_events;
+    if (callback->as.fd.rate_limit != NULL && callback->as.fd.rate_limit->suspended) {
+        events &= ~EPOLLIN;
+    }
+
+    if (events == callback->events) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.data.ptr = callback;
+    ev.events = events;
+    if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_MOD, callback->fd, &ev) < 0) {
+        POLLEN_LOG_WARN("failed to modify events for fd %d: %s", callback->fd, strerror(errno));
+        return;
+    }
+
+    callback->events = events;
+}
+
+static void pollen_internal_rate_limit_set_suspended(struct pollen_rate_limit *limit,
+                                                     bool suspended) {
+    limit->suspended = suspended;
+
+    struct pollen_callback *callback;
+    POLLEN_LL_FOR_EACH(callback, &limit->callbacks, as.fd.rate_limit_link) {
+        pollen_internal_rate_limit_apply(callback);
+    }
+}
+
+/* Arms the timer to fire when the bucket has one whole token again. */
+static bool pollen_internal_rate_limit_arm(struct pollen_rate_limit *limit) {
+    const uint64_t wait_ns = (uint64_t)((1 - limit->tokens) / limit->rate_per_ns) + 1;
+    return pollen_timer_arm_after(limit->timer, wait_ns, 0);
+}
+
+static int pollen_internal_rate_limit_resume(struct pollen_callback *timer, void *data) {
+    struct pollen_rate_limit *limit = data;
+
+    pollen_internal_rate_limit_refill(limit);
+    if (limit->tokens < 1) {
+        /* can happen with coarse loop time */
+        POLLEN_LOG_DEBUG("rate limit timer fired early, rearming");
+        if (!pollen_internal_rate_limit_arm(limit)) {
+            POLLEN_LOG_ERR("failed to arm rate limit timer: %s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    POLLEN_LOG_DEBUG("rate limit has %f tokens, resuming fds", limit->tokens);
+    pollen_internal_rate_limit_set_suspended(limit, false);
+
+    return 0;
+}
+
+struct pollen_rate_limit *pollen_loop_add_rate_limit(struct pollen_loop *loop,
+                                                     uint64_t rate, uint64_t burst) {
+    struct pollen_rate_limit *limit = NULL;
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("adding rate limit of %lu/s, burst %lu", rate, burst);
+
+    if (rate == 0 || burst == 0) {
+        POLLEN_LOG_ERR("rate and burst must not be 0");
+        save_errno = EINVAL;
+        goto err;
+    }
+
+    limit = POLLEN_CALLOC(1, sizeof(*limit));
+    if (limit == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for rate limit: %s", strerror(errno));
+        goto err;
+    }
+
+    limit->timer = pollen_loop_add_timer(loop, pollen_internal_timer_clockid(),
+                                         pollen_internal_rate_limit_resume, limit);
+    if (limit->timer == NULL) {
+        save_errno = errno;
+        goto err;
+    }
+
+    limit->loop = loop;
+    limit->tokens = burst;
+    limit->burst = burst;
+    limit->rate_per_ns = rate / 1e9;
+    limit->last_refill_ns = loop->now_ns;
+    pollen_ll_init(&limit->callbacks);
+    pollen_ll_insert(&loop->rate_limits, &limit->link);
+
+    return limit;
+
+err:
+    POLLEN_FREE(limit);
+    errno = save_errno;
+    return NULL;
+}
+
+void pollen_rate_limit_destroy(struct pollen_rate_limit *limit) {
+    if (limit == NULL) {
+        return;
+    }
+
+    POLLEN_LOG_INFO("destroying rate limit");
+
+    while (!pollen_ll_is_empty(&limit->callbacks)) {
+        struct pollen_callback *callback =
+            POLLEN_CONTAINER_OF(limit->callbacks.next, callback, as.fd.rate_limit_link);
+        pollen_fd_set_rate_limit(callback, NULL);
+    }
+
+    pollen_loop_remove_callback(limit->timer);
+    pollen_ll_remove(&limit->link);
+    POLLEN_FREE(limit);
+}
+
+bool pollen_fd_set_rate_limit(struct pollen_callback *callback, struct pollen_rate_limit *limit) {
+    if (callback->type != POLLEN_CALLBACK_TYPE_FD ||
+        (limit != NULL && limit->loop != callback->loop)) {
+        POLLEN_LOG_ERR("rate limit can only be set on fd callback of the same loop");
+        errno = EINVAL;
+        return false;
+    }
+
+    POLLEN_LOG_DEBUG("setting rate limit %p for fd %d", (void *)limit, callback->fd);
+
+    if (callback->as.fd.rate_limit != NULL) {
+        pollen_ll_remove(&callback->as.fd.rate_limit_link);
+    }
+    callback->as.fd.rate_limit = limit;
+    if (limit != NULL) {
+        pollen_ll_insert(&limit->callbacks, &callback->as.fd.rate_limit_link);
+    }
+
+    pollen_internal_rate_limit_apply(callback);
+
+    return true;
+}
+
+bool pollen_fd_consume(struct pollen_callback *callback, uint64_t tokens) {
+    if (callback->type != POLLEN_CALLBACK_TYPE_FD || callback->as.fd.rate_limit == NULL) {
+        return true;
+    }
+
+    struct pollen_rate_limit *limit = callback->as.fd.rate_limit;
+
+    pollen_internal_rate_limit_refill(limit);
+    limit->tokens -= (double)tokens;
+
+    if (limit->suspended) {
+        return false;
+    } else if (limit->tokens >= 1) {
+        return true;
+    }
+
+    if (!pollen_internal_rate_limit_arm(limit)) {
+        /* better to let traffic through than to suspend fds forever */
+        POLLEN_LOG_ERR("failed to arm rate limit timer: %s", strerror(errno));
+        return true;
+    }
+
+    POLLEN_LOG_DEBUG("rate limit ran out of tokens, suspending fds");
+    pollen_internal_rate_limit_set_suspended(limit, true);
+
+    return false;
+}
+#endif /* #if !defined(POLLEN_NO_TIMERS) */
+
+/*
+ * Runs batches that collected events during this iteration.
+ * Returns negative value returned by a batch handler, or 0.
+ */
+static int pollen_internal_fd_batches_run(struct pollen_loop *loop) {
+    while (loop->ready_fd_batches != NULL) {
+        struct pollen_fd_batch *batch = loop->ready_fd_batches;
+        loop->ready_fd_batches = batch->next_ready;
+
+        /* callbacks removed or detached since their events were collected */
+        size_t n = 0;
+        for (size_t i = 0; i < batch->count; i++) {
+            struct pollen_callback *callback = batch->events[i].callback;
+            if (!callback->dead && callback->as.fd.batch == batch) {
+                pollen_internal_record(loop, callback, batch->events[i].events, 0);
+                batch->events[n++] = batch->events[i];
+            }
+        }
+        batch->count = 0;
+        if (n == 0) {
+            continue;
+        }
+
+        POLLEN_LOG_DEBUG("running fd batch of %zu events", n);
+
+        POLLEN_USDT_PROBE2(callback_start, POLLEN_CALLBACK_TYPE_FD, -1);
+        const int ret = batch->fn(loop, batch->events, n, batch->data);
+        POLLEN_USDT_PROBE3(callback_end, POLLEN_CALLBACK_TYPE_FD, -1, ret);
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+struct pollen_fd_batch *pollen_loop_add_fd_batch(struct pollen_loop *loop,
+                                                 pollen_fd_batch_fn fn, void *data) {
+    POLLEN_LOG_INFO("adding fd batch");
+
+    struct pollen_fd_batch *batch = POLLEN_CALLOC(1, sizeof(*batch));
+    if (batch == NULL) {
+        POLLEN_LOG_ERR("failed to allocate memory for fd batch: %s", strerror(errno));
+        return NULL;
+    }
+
+    batch->loop = loop;
+    batch->fn = fn;
+    batch->data = data;
+    pollen_ll_insert(&loop->fd_batches, &batch->link);
+
+    return batch;
+}
+
+void pollen_fd_batch_destroy(struct pollen_fd_batch *batch) {
+    if (batch == NULL) {
+        return;
+    }
+
+    POLLEN_LOG_INFO("destroying fd batch");
+
+    struct pollen_loop *loop = batch->loop;
+    for (int fd = 0; fd < loop->fds_capacity; fd++) {
+        struct pollen_callback *callback = loop->fds[fd];
+        if (callback != NULL && callback->type == POLLEN_CALLBACK_TYPE_FD &&
+            callback->as.fd.batch == batch) {
+            pollen_fd_set_batch(callback, NULL);
+        }
+    }
+
+    struct pollen_fd_batch **ready = &loop->ready_fd_batches;
+    while (*ready != NULL && *ready != batch) {
+        ready = &(*ready)->next_ready;
+    }
+    if (*ready == batch) {
+        *ready = batch->next_ready;
+    }
+
+    pollen_ll_remove(&batch->link);
+    POLLEN_FREE(batch);
+}
+
+bool pollen_fd_set_batch(struct pollen_callback *callback, struct pollen_fd_batch *batch) {
+    if (callback->type != POLLEN_CALLBACK_TYPE_FD ||
+        (batch != NULL && batch->loop != callback->loop)) {
+        POLLEN_LOG_ERR("fd batch can only be set on fd callback of the same loop");
+        errno = EINVAL;
+        return false;
+    }
+
+    POLLEN_LOG_DEBUG("setting fd batch %p for fd %d", (void *)batch, callback->fd);
+
+    callback->as.fd.batch = batch;
+    callback->dispatch = (batch != NULL) ? pollen_internal_dispatch_fd_batched
+                                         : pollen_internal_dispatch_fd;
+
+    return true;
+}
+
+#if !defined(POLLEN_NO_IDLE)
+struct pollen_callback *pollen_loop_add_idle(struct pollen_loop *loop, int priority,
+                                             pollen_idle_callback_fn callback,
+                                             void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("adding unconditional callback with prio %d to event loop", priority);
+
+    new_callback = pollen_internal_callback_alloc(loop);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_IDLE;
+    new_callback->as.idle.priority = priority;
+    new_callback->fn.idle = callback;
+    new_callback->data = data;
+
+    if (pollen_ll_is_empty(&loop->idle_callbacks_list)) {
+        pollen_ll_insert(&loop->idle_callbacks_list, &new_callback->link);
+    } else {
+        struct pollen_callback *elem;
+        bool found = false;
+        POLLEN_LL_FOR_EACH_REVERSE(elem, &loop->idle_callbacks_list, link) {
+            /*         |6|
+             * |9|  |8|\/|4|  |2|
+             * <-----------------
+             * iterate from the end and find the first callback with higher prio
+             */
+            if (elem->as.idle.priority > priority) {
+                found = true;
+                pollen_ll_insert(&elem->link, &new_callback->link);
+                break;
+            }
+        }
+        if (!found) {
+            pollen_ll_insert(&loop->idle_callbacks_list, &new_callback->link);
+        }
+    }
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+
+#endif /* #if !defined(POLLEN_NO_IDLE) */
+
+#if !defined(POLLEN_NO_SIGNALS)
+struct pollen_callback *pollen_loop_add_signal(struct pollen_loop *loop, int signal,
+                                               pollen_signal_callback_fn callback,
+                                               void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+    bool sigset_saved = false;
+    sigset_t save_global_sigset;
+    sigset_t save_loop_sigset = loop->sigset;
+    bool need_reset_handler = false;
+
+    POLLEN_LOG_INFO("adding signal callback for signal %d", signal);
+
+    if (loop->signal_fd < 0 && pollen_internal_setup_signalfd(loop) < 0) {
+        goto err;
+    }
+
+    if (sigprocmask(SIG_BLOCK /* ignored */, NULL, &save_global_sigset) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to save original sigmask: %s", strerror(errno));
+        goto err;
+    }
+    sigset_saved = true;
+
+    new_callback = pollen_internal_callback_alloc(loop);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_SIGNAL;
+    new_callback->as.signal.sig = signal;
+    new_callback->fn.signal = callback;
+    new_callback->data = data;
+
+    /* first, create empty sigset and add our desired signal there. */
+    sigset_t set;
+    sigemptyset(&set);
+    if (sigaddset(&set, signal) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to add signal %d to sigset: %s", signal, strerror(errno));
+        goto err;
+    }
+
+    /* block the desired signal globally. */
+    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to block signal %d: %s", signal, strerror(errno));
+        goto err;
+    }
+
+    /* on success, add the same signal to loop's sigset. */
+    if (sigaddset(&loop->sigset, signal) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to add signal %d to loop sigset: %s", signal, strerror(errno));
+        goto err;
+    }
+
+    /* check if handler for this signal already exists */
+    if (loop->signal_callbacks[signal] != NULL) {
+        POLLEN_LOG_ERR("callback for signal %d already exists", signal);
+        save_errno = EEXIST;
+        goto err;
+    }
+    loop->signal_callbacks[signal] = new_callback;
+    need_reset_handler = true;
+
+    /* change signalfd mask to report newly added signal */
+    int ret = signalfd(loop->signal_fd, &loop->sigset, 0);
+    if (ret < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to change signalfd sigmask: %s", strerror(errno));
+        goto err;
+    }
+
+    pollen_ll_insert(&loop->signal_callbacks_list, &new_callback->link);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    /* restore original sigmask on failure. important! */
+    if (sigset_saved) {
+        if (sigprocmask(SIG_SETMASK, &save_global_sigset, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to restore original signal mask! %s", strerror(errno));
+        }
+    }
+    loop->sigset = save_loop_sigset;
+
+    if (need_reset_handler) {
+        loop->signal_callbacks[signal] = NULL;
+    }
+
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+
+#endif /* #if !defined(POLLEN_NO_SIGNALS) */
+
+#if !defined(POLLEN_NO_TIMERS)
+static int pollen_internal_dispatch_timer(struct pollen_loop *loop,
+                                          struct pollen_callback *callback, uint32_t events) {
+    POLLEN_LOG_DEBUG("running callback for timer on tfd %d", callback->fd);
+
+    /* drain the timer fd */
+    int ret;
+    uint64_t val, expirations = 0;
+    while ((ret = read(callback->fd, &val, sizeof(val))) > 0) {
+        expirations += val;
+    }
+    if (ret < 0 && errno != EAGAIN) {
+        POLLEN_LOG_ERR("failed to read from timerfd %d: %s", callback->fd, strerror(errno));
+        return -1;
+    }
+
+    /* timer was disarmed or rearmed by another callback after epoll_wait returned */
+    if (expirations == 0) {
+        POLLEN_LOG_DEBUG("timer on tfd %d has no expirations, skipping", callback->fd);
+        return 0;
+    }
+
+    POLLEN_USDT_PROBE2(timer_expire, callback->fd, expirations);
+
+    pollen_internal_record(loop, callback, 0, expirations);
+    return callback->fn.timer(callback, callback->data);
+}
+
+static struct pollen_callback *pollen_internal_add_timer(struct pollen_loop *loop,
+                                                         struct pollen_callback_storage *storage,
+                                                         int clockid,
+                                                         pollen_timer_callback_fn callback,
+                                                         void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+    int tfd = -1;
+
+    POLLEN_LOG_INFO("adding timer callback to event loop, clockid %d", clockid);
+
+    tfd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to create timerfd: %s", strerror(errno));
+        goto err;
+    }
+
+    new_callback = pollen_internal_callback_get(loop, storage);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_TIMER;
+    new_callback->dispatch = pollen_internal_dispatch_timer;
+    new_callback->fd = tfd;
+    new_callback->as.timer.clockid = clockid;
+    new_callback->fn.timer = callback;
+    new_callback->data = data;
+
+    if (pollen_internal_fds_reserve(loop, tfd) < 0) {
+        save_errno = errno;
+        goto err;
+    }
+
+    struct epoll_event epoll_event;
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.ptr = new_callback;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, tfd, &epoll_event) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to add fd %d to epoll: %s", tfd, strerror(errno));
+        goto err;
+    }
+
+    pollen_internal_fds_set(loop, tfd, new_callback);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    if (tfd > 0) {
+        close(tfd);
+    }
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+
+struct pollen_callback *pollen_loop_add_timer(struct pollen_loop *loop, int clockid,
+                                              pollen_timer_callback_fn callback,
+                                              void *data) {
+    return pollen_internal_add_timer(loop, NULL, clockid, callback, data);
+}
+
+struct pollen_callback *pollen_loop_add_timer_static(struct pollen_loop *loop,
+                                                     struct pollen_callback_storage *storage,
+                                                     int clockid,
+                                                     pollen_timer_callback_fn callback,
+                                                     void *data) {
+    return pollen_internal_add_timer(loop, storage, clockid, callback, data);
+}
+
+static uint64_t pollen_internal_timespec_ns(struct timespec ts) {
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec pollen_internal_ns_timespec(uint64_t ns) {
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+    return ts;
+}
+
+/* Keeps loop virtual_timers sorted by deadline, timers with equal deadlines in arming order. */
+static void pollen_internal_virtual_timer_arm(struct pollen_callback *timer,
+                                              uint64_t deadline_ns, uint64_t period_ns) {
+    struct pollen_ll *const head = &timer->loop->virtual_timers;
+
+    if (timer->as.timer.virtual_armed) {
+        pollen_ll_remove(&timer->link);
+    }
+    timer->as.timer.virtual_armed = true;
+    timer->as.timer.deadline_ns = deadline_ns;
+    timer->as.timer.period_ns = period_ns;
+
+    /* most timers are armed for later than the rest, so search from the back */
+    struct pollen_ll *pos = head->prev;
+    while (pos != head) {
+        struct pollen_callback *other = POLLEN_CONTAINER_OF(pos, other, link);
+        if (other->as.timer.deadline_ns <= deadline_ns) {
+            break;
+        }
+        pos = pos->prev;
+    }
+    pollen_ll_insert(pos, &timer->link);
+}
+
+static void pollen_internal_virtual_timer_disarm(struct pollen_callback *timer) {
+    if (timer->as.timer.virtual_armed) {
+        pollen_ll_remove(&timer->link);
+        timer->as.timer.virtual_armed = false;
+    }
+}
+
+static bool pollen_internal_virtual_timers_expired(struct pollen_loop *loop) {
+    if (pollen_ll_is_empty(&loop->virtual_timers)) {
+        return false;
+    }
+
+    struct pollen_callback *first = POLLEN_CONTAINER_OF(loop->virtual_timers.next, first, link);
+    return first->as.timer.deadline_ns <= loop->now_ns;
+}
+
+bool pollen_timer_arm(struct pollen_callback *callback, bool absolute,
+                      struct timespec initial, struct timespec periodic) {
+    int save_errno = 0;
+
+    if (callback->type != POLLEN_CALLBACK_TYPE_TIMER) {
+        POLLEN_LOG_ERR("passed non-timer type callback to pollen_timer_arm");
+        save_errno = EINVAL;
+        goto err;
+    }
+
+    POLLEN_LOG_DEBUG("arming timerfd %d for (%li s %li ns) initial, (%li s %li ns) periodic",
+                     callback->fd,
+                     initial.tv_sec, initial.tv_nsec,
+                     periodic.tv_sec, periodic.tv_nsec);
+
+    if (callback->loop->virtual_time) {
+        /* same as timerfd, zero initial value disarms */
+        uint64_t deadline_ns = pollen_internal_timespec_ns(initial);
+        if (deadline_ns == 0) {
+            pollen_internal_virtual_timer_disarm(callback);
+        } else {
+            if (!absolute) {
+                deadline_ns += callback->loop->now_ns;
+            }
+            pollen_internal_virtual_timer_arm(callback, deadline_ns,
+                                              pollen_internal_timespec_ns(periodic));
+        }
+        return true;
+    }
+
+    const struct itimerspec itimerspec = {
+        .it_value = initial,
+        .it_interval = periodic,
+    };
+    const int flags = absolute ? TFD_TIMER_ABSTIME : 0;
+    if (timerfd_settime(callback->fd, flags, &itimerspec, NULL) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to arm timer: %s", strerror(errno));
+        goto err;
+    }
+
+    return true;
+
+err:
+    errno = save_errno;
+    return false;
+}
+
+bool pollen_timer_arm_s(struct pollen_callback *callback, bool absolute,
+                        unsigned long initial_s, unsigned long periodic_s) {
+    const struct timespec initial = {
+        .tv_sec = initial_s
+    };
+    const struct timespec periodic = {
+        .tv_sec = periodic_s
+    };
+    return pollen_timer_arm(callback, absolute, initial, periodic);
+}
+
+bool pollen_timer_arm_ms(struct pollen_callback *callback, bool absolute,
+                         unsigned long initial_ms, unsigned long periodic_ms) {
+    const struct timespec initial = {
+        .tv_sec = initial_ms / 1000,
+        .tv_nsec = (initial_ms % 1000) * 1000000,
+    };
+    const struct timespec periodic = {
+        .tv_sec = periodic_ms / 1000,
+        .tv_nsec = (periodic_ms % 1000) * 1000000,
+    };
+    return pollen_timer_arm(callback, absolute, initial, periodic);
+}
+
+bool pollen_timer_arm_us(struct pollen_callback *callback, bool absolute,
+                         unsigned long initial_us, unsigned long periodic_us) {
+    const struct timespec initial = {
+        .tv_sec = initial_us / 1000000,
+        .tv_nsec = (initial_us % 1000000) * 1000,
+    };
+    const struct timespec periodic = {
+        .tv_sec = periodic_us / 1000000,
+        .tv_nsec = (periodic_us % 1000000) * 1000,
+    };
+    return pollen_timer_arm(callback, absolute, initial, periodic);
+}
+
+bool pollen_timer_arm_ns(struct pollen_callback *callback, bool absolute,
+                         unsigned long initial_ns, unsigned long periodic_ns) {
+    const struct timespec initial = {
+        .tv_sec = initial_ns / 1000000000,
+        .tv_nsec = initial_ns % 1000000000,
+    };
+    const struct timespec periodic = {
+        .tv_sec = periodic_ns / 1000000000,
+        .tv_nsec = periodic_ns % 1000000000,
+    };
+    return pollen_timer_arm(callback, absolute, initial, periodic);
+}
+
+bool pollen_timer_arm_after(struct pollen_callback *callback,
+                            uint64_t delay_ns, uint64_t periodic_ns) {
+    /* in virtual time, all timers use the clock of loop time */
+    if (callback->type != POLLEN_CALLBACK_TYPE_TIMER ||
+        (!callback->loop->virtual_time &&
+         callback->as.timer.clockid != pollen_internal_timer_clockid())) {
+        POLLEN_LOG_ERR("pollen_timer_arm_after needs a timer using the clock of loop time");
+        errno = EINVAL;
+        return false;
+    }
+
+    const uint64_t deadline_ns = callback->loop->now_ns + delay_ns;
+    const struct timespec initial = {
+        .tv_sec = deadline_ns / 1000000000,
+        .tv_nsec = deadline_ns % 1000000000,
+    };
+    const struct timespec periodic = {
+        .tv_sec = periodic_ns / 1000000000,
+        .tv_nsec = periodic_ns % 1000000000,
+    };
+    return pollen_timer_arm(callback, true, initial, periodic);
+}
+
+bool pollen_timer_disarm(struct pollen_callback *callback) {
+    int save_errno = 0;
+
+    if (callback->type != POLLEN_CALLBACK_TYPE_TIMER) {
+        POLLEN_LOG_ERR("passed non-timer type callback to pollen_timer_disarm");
+        save_errno = EINVAL;
+        goto err;
+    }
+
+    POLLEN_LOG_DEBUG("disarming timerfd %d", callback->fd);
+
+    if (callback->loop->virtual_time) {
+        pollen_internal_virtual_timer_disarm(callback);
+        return true;
+    }
+
+    struct itimerspec itimerspec;
+    itimerspec.it_value.tv_sec = 0;
+    itimerspec.it_value.tv_nsec = 0;
+    itimerspec.it_interval.tv_sec = 0;
+    itimerspec.it_interval.tv_nsec = 0;
+
+    if (timerfd_settime(callback->fd, 0, &itimerspec, NULL) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to disarm timer: %s", strerror(errno));
+        goto err;
+    }
+
+    return true;
+
+err:
+    errno = save_errno;
+    return false;
+}
+
+bool pollen_loop_use_virtual_time(struct pollen_loop *loop, bool auto_advance) {
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("switching loop to virtual time, auto advance %s",
+                    auto_advance ? "on" : "off");
+
+    if (loop->virtual_time) {
+        loop->virtual_auto_advance = auto_advance;
+        return true;
+    }
+
+    pollen_internal_update_time(loop);
+
+    /* move armed timers over, stopping their timerfds. Disarming returns the old value,
+     * so a timer can't expire in between */
+    for (int fd = 0; fd < loop->fds_capacity; fd++) {
+        struct pollen_callback *callback = loop->fds[fd];
+        if (callback == NULL || callback->type != POLLEN_CALLBACK_TYPE_TIMER) {
+            continue;
+        }
+
+        const struct itimerspec disarmed = {0};
+        struct itimerspec current;
+        if (timerfd_settime(fd, 0, &disarmed, &current) < 0) {
+            save_errno = errno;
+            POLLEN_LOG_ERR("failed to disarm timerfd %d: %s", fd, strerror(errno));
+            goto err;
+        }
+        if (current.it_value.tv_sec == 0 && current.it_value.tv_nsec == 0) {
+            continue;
+        }
+
+        pollen_internal_virtual_timer_arm(callback,
+                                          loop->now_ns + pollen_internal_timespec_ns(current.it_value),
+                                          pollen_internal_timespec_ns(current.it_interval));
+    }
+
+    loop->virtual_time = true;
+    loop->virtual_auto_advance = auto_advance;
+
+    return true;
+
+err:
+    /* give timers moved so far back to their timerfds */
+    while (!pollen_ll_is_empty(&loop->virtual_timers)) {
+        struct pollen_callback *callback =
+            POLLEN_CONTAINER_OF(loop->virtual_timers.next, callback, link);
+        const uint64_t deadline_ns = callback->as.timer.deadline_ns;
+        /* loop time didn't change, so this is exactly what the timerfd had left */
+        struct itimerspec restored;
+        restored.it_value = pollen_internal_ns_timespec(deadline_ns - loop->now_ns);
+        restored.it_interval = pollen_internal_ns_timespec(callback->as.timer.period_ns);
+        pollen_internal_virtual_timer_disarm(callback);
+        if (timerfd_settime(callback->fd, 0, &restored, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to rearm timerfd %d: %s", callback->fd, strerror(errno));
+        }
+    }
+
+    errno = save_errno;
+    return false;
+}
+
+void pollen_loop_advance_time(struct pollen_loop *loop, uint64_t delta_ns) {
+    if (!loop->virtual_time) {
+        POLLEN_LOG_WARN("can't advance time of a loop that is not using virtual time");
+        return;
+    }
+
+    POLLEN_LOG_DEBUG("advancing virtual time by %lu ns", delta_ns);
+    loop->now_ns += delta_ns;
+}
+
+#endif /* #if !defined(POLLEN_NO_TIMERS) */
+
+#if !defined(POLLEN_NO_EFDS)
+/* Loop that is iterating on this thread, used to tell same-thread efd triggers apart. */
+static _Thread_local struct pollen_loop *pollen_internal_current_loop = NULL;
+
+/* Takes pending value of efd callback and runs it. Does nothing if it was taken already. */
+static int pollen_internal_efd_run(struct pollen_callback *callback) {
+    if (callback->as.efd.queued) {
+        pollen_ll_remove(&callback->link);
+        callback->as.efd.queued = false;
+    }
+
+    const uint64_t efd_val = atomic_exchange(&callback->as.efd.pending, 0);
+    if (efd_val == 0) {
+        return 0;
+    }
+
+    POLLEN_USDT_PROBE2(efd_read, callback->fd, efd_val);
+
+    pollen_internal_record(callback->loop, callback, 0, efd_val);
+    return callback->fn.efd(callback, efd_val, callback->data);
+}
+
+static int pollen_internal_dispatch_efd(struct pollen_loop *loop,
+                                        struct pollen_callback *callback, uint32_t events) {
+    POLLEN_LOG_DEBUG("running callback for efd %d", callback->fd);
+
+    /* reset before taking the value, so triggers made after that will write again */
+    uint64_t dummy;
+    if (read(callback->fd, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN) {
+        POLLEN_LOG_ERR("failed to read from efd %d: %s", callback->fd, strerror(errno));
+        return -1;
+    }
+
+    return pollen_internal_efd_run(callback);
+}
+
+struct pollen_callback *pollen_loop_add_efd(struct pollen_loop *loop,
+                                            pollen_efd_callback_fn callback,
+                                            void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+    int efd = -1;
+
+    POLLEN_LOG_INFO("adding efd callback to event loop");
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to create eventfd: %s", strerror(errno));
+        goto err;
+    }
+
+    new_callback = pollen_internal_callback_alloc(loop);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_EFD;
+    new_callback->dispatch = pollen_internal_dispatch_efd;
+    new_callback->fd = efd;
+    new_callback->fn.efd = callback;
+    new_callback->data = data;
+
+    if (pollen_internal_fds_reserve(loop, efd) < 0) {
+        save_errno = errno;
+        goto err;
+    }
+
+    struct epoll_event epoll_event;
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.ptr = new_callback;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, efd, &epoll_event) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to add efd %d to epoll: %s", efd, strerror(errno));
+        goto err;
+    }
+
+    pollen_internal_fds_set(loop, efd, new_callback);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    if (efd > 0) {
+        close(efd);
+    }
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+
+bool pollen_efd_inc(struct pollen_callback *callback, uint64_t n) {
+    int save_errno;
+
+    if (callback->type != POLLEN_CALLBACK_TYPE_EFD) {
+        POLLEN_LOG_ERR("passed non-efd type callback to pollen_efd_trigger");
+        save_errno = EINVAL;
+        goto err;
+    }
+
+    /* other threads may trigger it too, so only look at loop fields from the loop thread */
+    const bool same_thread = (pollen_internal_current_loop == callback->loop);
+
+#if !defined(POLLEN_NO_TRACE)
+    /* recorded efd runs are replayed as they are, triggers made by replayed callbacks aren't */
+    if (same_thread && callback->loop->replaying) {
+        return true;
+    }
+#endif
+
+    if (n == 0 || atomic_fetch_add(&callback->as.efd.pending, n) != 0) {
+        /* already pending, whoever made it pending has scheduled it to run */
+        return true;
+    }
+
+    if (same_thread) {
+        pollen_ll_insert(callback->loop->efd_pending.prev, &callback->link);
+        callback->as.efd.queued = true;
+        return true;
+    }
+
+    const uint64_t one = 1;
+    if (write(callback->fd, &one, sizeof(one)) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to write to efd %d: %s", callback->fd, strerror(errno));
+        goto err;
+    }
+
+    return true;
+
+err:
+    errno = save_errno;
+    return false;
+}
+
+bool pollen_efd_trigger(struct pollen_callback *callback) {
+    return pollen_efd_inc(callback, 1);
+}
+
+#endif /* #if !defined(POLLEN_NO_EFDS) */
+
+#if !defined(POLLEN_NO_GROUPS)
+static struct pollen_group_ring *pollen_internal_group_ring_create(int64_t capacity) {
+    struct pollen_group_ring *ring =
+        POLLEN_CALLOC(1, sizeof(*ring) + capacity * sizeof(ring->tasks[0]));
+    if (ring == NULL) {
+        POLLEN_LOG_ERR("failed to allocate memory for task deque: %s", strerror(errno));
+        return NULL;
+    }
+    ring->mask = capacity - 1;
+    return ring;
+}
+
+static inline void pollen_internal_group_ring_get(struct pollen_group_ring *ring, int64_t i,
+                                                  struct pollen_deferred *task) {
+    struct pollen_group_task *slot = &ring->tasks[i & ring->mask];
+    task->fn = atomic_load_explicit(&slot->fn, memory_order_relaxed);
+    task->data = atomic_load_explicit(&slot->data, memory_order_relaxed);
+}
+
+static inline void pollen_internal_group_ring_put(struct pollen_group_ring *ring, int64_t i,
+                                                  pollen_defer_fn fn, void *data) {
+    struct pollen_group_task *slot = &ring->tasks[i & ring->mask];
+    atomic_store_explicit(&slot->fn, fn, memory_order_relaxed);
+    atomic_store_explicit(&slot->data, data, memory_order_relaxed);
+}
+
+static bool pollen_internal_group_push(struct pollen_group_member *member,
+                                       pollen_defer_fn fn, void *data) {
+    const int64_t b = atomic_load_explicit(&member->bottom, memory_order_relaxed);
+    const int64_t t = atomic_load_explicit(&member->top, memory_order_acquire);
+    struct pollen_group_ring *ring = atomic_load_explicit(&member->ring, memory_order_relaxed);
+
+    if (b - t > ring->mask) {
+        POLLEN_LOG_DEBUG("growing task deque to %ld", (long)(ring->mask + 1) * 2);
+
+        struct pollen_group_ring *new_ring = pollen_internal_group_ring_create((ring->mask + 1) * 2);
+        if (new_ring == NULL) {
+            return false;
+        }
+        for (int64_t i = t; i < b; i++) {
+            struct pollen_deferred task;
+            pollen_internal_group_ring_get(ring, i, &task);
+            pollen_internal_group_ring_put(new_ring, i, task.fn, task.data);
+        }
+        new_ring->retired = ring;
+        atomic_store_explicit(&member->ring, new_ring, memory_order_release);
+        ring = new_ring;
+    }
+
+    pollen_internal_group_ring_put(ring, b, fn, data);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&member->bottom, b + 1, memory_order_relaxed);
+
+    return true;
+}
+
+static bool pollen_internal_group_take(struct pollen_group_member *member,
+                                       struct pollen_deferred *task) {
+    const int64_t b = atomic_load_explicit(&member->bottom, memory_order_relaxed) - 1;
+    struct pollen_group_ring *ring = atomic_load_explicit(&member->ring, memory_order_relaxed);
+    atomic_store_explicit(&member->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&member->top, memory_order_relaxed);
+
+    if (t > b) {
+        /* empty */
+        atomic_store_explicit(&member->bottom, b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    pollen_internal_group_ring_get(ring, b, task);
+    if (t < b) {
+        return true;
+    }
+
+    /* last task, race thieves for it */
+    const bool won = atomic_compare_exchange_strong_explicit(&member->top, &t, t + 1,
+                                                             memory_order_seq_cst,
+                                                             memory_order_relaxed);
+    atomic_store_explicit(&member->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+static bool pollen_internal_group_steal_from(struct pollen_group_member *victim,
+                                             struct pollen_deferred *task) {
+    int64_t t = atomic_load_explicit(&victim->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const int64_t b = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+    if (t >= b) {
+        return false;
+    }
+
+    struct pollen_group_ring *ring = atomic_load_explicit(&victim->ring, memory_order_acquire);
+    pollen_internal_group_ring_get(ring, t, task);
+    /* lost to the owner or another thief, not worth retrying the same victim */
+    return atomic_compare_exchange_strong_explicit(&victim->top, &t, t + 1,
+                                                   memory_order_seq_cst, memory_order_relaxed);
+}
+
+static bool pollen_internal_group_has_tasks(struct pollen_group_member *member) {
+    return member->has_stolen ||
+           atomic_load_explicit(&member->bottom, memory_order_relaxed) >
+           atomic_load_explicit(&member->top, memory_order_relaxed);
+}
+
+/* Tries other loops of the group in turn, starting from the next one. */
+static bool pollen_internal_group_steal(struct pollen_group_member *member) {
+    struct pollen_group *group = member->group;
+    const size_t self = member - group->members;
+
+    for (size_t i = 1; i < group->count; i++) {
+        struct pollen_group_member *victim = &group->members[(self + i) % group->count];
+        if (pollen_internal_group_steal_from(victim, &member->stolen)) {
+            POLLEN_LOG_DEBUG("stole a task from loop %zu of the group", victim - group->members);
+            member->has_stolen = true;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Wakes one sleeping loop of the group other than member, if there is one. */
+static void pollen_internal_group_wake_one(struct pollen_group_member *member) {
+    struct pollen_group *group = member->group;
+    const size_t self = member - group->members;
+
+    /* pairs with the fence after setting sleeping flag, see pollen_internal_group_before_wait */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (size_t i = 1; i < group->count; i++) {
+        struct pollen_group_member *other = &group->members[(self + i) % group->count];
+        if (atomic_load_explicit(&other->sleeping, memory_order_relaxed) &&
+            atomic_exchange_explicit(&other->sleeping, false, memory_order_relaxed)) {
+            /* either cleanup sees us in wakers, or we see wake already cleared */
+            atomic_fetch_add_explicit(&other->wakers, 1, memory_order_seq_cst);
+            struct pollen_callback *wake = atomic_load_explicit(&other->wake, memory_order_seq_cst);
+            if (wake != NULL) {
+                POLLEN_LOG_DEBUG("waking loop %zu of the group", other - group->members);
+                pollen_efd_trigger(wake);
+            }
+            atomic_fetch_sub_explicit(&other->wakers, 1, memory_order_release);
+            if (wake != NULL) {
+                return;
+            }
+        }
+    }
+}
+
+/* Returns whether the loop has tasks to run, in which case it must not block. */
+static bool pollen_internal_group_before_wait(struct pollen_group_member *member, bool blocking) {
+    if (pollen_internal_group_has_tasks(member)) {
+        return true;
+    }
+    if (!blocking) {
+        return false;
+    }
+
+    if (pollen_internal_group_steal(member)) {
+        return true;
+    }
+
+    /* a task spawned before the flag became visible would be missed, so look once more */
+    atomic_store_explicit(&member->sleeping, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (pollen_internal_group_steal(member)) {
+        atomic_store_explicit(&member->sleeping, false, memory_order_relaxed);
+        return true;
+    }
+
+    return false;
+}
+
+/* Returns amount of tasks run, or negative value returned by a task. */
+static int pollen_internal_group_run(struct pollen_loop *loop,
+                                     struct pollen_group_member *member) {
+    int n = 0;
+    struct pollen_deferred task;
+
+    while (n < POLLEN_GROUP_TASK_BATCH) {
+        if (member->has_stolen) {
+            task = member->stolen;
+            member->has_stolen = false;
+        } else if (!pollen_internal_group_take(member, &task)) {
+            break;
+        }
+        n += 1;
+
+        const int ret = task.fn(loop, task.data);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return n;
+}
+
+static int pollen_internal_group_wake(struct pollen_callback *callback, uint64_t val, void *data) {
+    /* only here to interrupt epoll_wait, stealing happens before the next one */
+    return 0;
+}
+
+struct pollen_group *pollen_group_create(size_t max_loops) {
+    struct pollen_group *group = NULL;
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("creating loop group of up to %zu loops", max_loops);
+
+    group = POLLEN_CALLOC(1, sizeof(*group));
+    if (group == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for loop group: %s", strerror(errno));
+        goto err;
+    }
+
+    group->members = POLLEN_CALLOC(max_loops, sizeof(*group->members));
+    if (group->members == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for loop group: %s", strerror(errno));
+        goto err;
+    }
+    group->capacity = max_loops;
+
+    return group;
+
+err:
+    POLLEN_FREE(group);
+    errno = save_errno;
+    return NULL;
+}
+
+bool pollen_group_add_loop(struct pollen_group *group, struct pollen_loop *loop) {
+    struct pollen_group_member *member = NULL;
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("adding loop to loop group");
+
+    if (loop->group_member != NULL) {
+        POLLEN_LOG_ERR("loop is already in a group");
+        save_errno = EEXIST;
+        goto err;
+    }
+    if (group->count == group->capacity) {
+        POLLEN_LOG_ERR("loop group is full");
+        save_errno = ENOSPC;
+        goto err;
+    }
+
+    member = &group->members[group->count];
+    member->ring = pollen_internal_group_ring_create(POLLEN_GROUP_DEQUE_CAPACITY);
+    if (member->ring == NULL) {
+        save_errno = errno;
+        goto err;
+    }
+
+    struct pollen_callback *wake = pollen_loop_add_efd(loop, pollen_internal_group_wake, member);
+    if (wake == NULL) {
+        save_errno = errno;
+        goto err;
+    }
+    atomic_store_explicit(&member->wake, wake, memory_order_relaxed);
+
+    member->group = group;
+    member->loop = loop;
+    loop->group_member = member;
+    group->count += 1;
+
+    return true;
+
+err:
+    if (member != NULL) {
+        POLLEN_FREE(member->ring);
+        member->ring = NULL;
+    }
+    errno = save_errno;
+    return false;
+}
+
+void pollen_group_destroy(struct pollen_group *group) {
+    if (group == NULL) {
+        return;
+    }
+
+    POLLEN_LOG_INFO("destroying loop group");
+
+    for (size_t i = 0; i < group->count; i++) {
+        struct pollen_group_member *member = &group->members[i];
+        if (member->loop != NULL) {
+            pollen_loop_remove_callback(atomic_load_explicit(&member->wake, memory_order_relaxed));
+            member->loop->group_member = NULL;
+        }
+
+        struct pollen_group_ring *ring = member->ring;
+        while (ring != NULL) {
+            struct pollen_group_ring *retired = ring->retired;
+            POLLEN_FREE(ring);
+            ring = retired;
+        }
+    }
+
+    POLLEN_FREE(group->members);
+    POLLEN_FREE(group);
+}
+
+bool pollen_loop_spawn(struct pollen_loop *loop, pollen_defer_fn fn, void *data) {
+    struct pollen_group_member *member = loop->group_member;
+    if (member == NULL) {
+        POLLEN_LOG_ERR("tasks can only be spawned on loops in a group");
+        errno = EINVAL;
+        return false;
+    }
+
+    if (!pollen_internal_group_push(member, fn, data)) {
+        return false;
+    }
+
+    /* loop runs its first task itself as soon as it can, only a backlog is worth sharing */
+    const int64_t size = atomic_load_explicit(&member->bottom, memory_order_relaxed) -
+                         atomic_load_explicit(&member->top, memory_order_relaxed);
+    if (size > 1) {
+        pollen_internal_group_wake_one(member);
+    }
+
+    return true;
+}
+#endif /* #if !defined(POLLEN_NO_GROUPS) */
+
+#if !defined(POLLEN_NO_CHANNELS)
+/*
+ * SPSC mode is a plain ring buffer where head and tail are owned by consumer and producer.
+ * MPMC mode is Dmitry Vyukov's bounded MPMC queue, every cell carries a sequence number
+ * that tells whether it is ready to be written or read for the current lap.
+ */
+struct pollen_channel {
+    enum pollen_channel_mode mode;
+    size_t elem_size;
+    size_t cell_size;
+    size_t mask;
+    unsigned char *cells;
+
+    /* shared by all consumers, readable while consumers are scheduled */
+    int wake_fd;
+    /* consumer callbacks on all loops, SPSC mode allows only one */
+    atomic_int consumers;
+
+    pthread_mutex_t producers_lock;
+    struct pollen_ll producers;
+
+    /* keep positions on separate cache lines so producers and consumers don't fight */
+    char pad0[POLLEN_CACHE_LINE_SIZE];
+    _Atomic size_t head;
+    char pad1[POLLEN_CACHE_LINE_SIZE - sizeof(size_t)];
+    _Atomic size_t tail;
+    atomic_bool consumer_scheduled;
+    atomic_bool producers_waiting;
+    char pad2[POLLEN_CACHE_LINE_SIZE];
+};
+
+static inline _Atomic size_t *pollen_internal_channel_seq(struct pollen_channel *channel,
+                                                          size_t pos) {
+    return (_Atomic size_t *)(channel->cells + (pos & channel->mask) * channel->cell_size);
+}
+
+static inline void *pollen_internal_channel_elem(struct pollen_channel *channel, size_t pos) {
+    unsigned char *cell = channel->cells + (pos & channel->mask) * channel->cell_size;
+    return (channel->mode == POLLEN_CHANNEL_MPMC) ? cell + sizeof(size_t) : cell;
+}
+
+static bool pollen_internal_channel_push(struct pollen_channel *channel, const void *msg) {
+    if (channel->mode == POLLEN_CHANNEL_SPSC) {
+        const size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+        const size_t head = atomic_load_explicit(&channel->head, memory_order_acquire);
+        if (tail - head > channel->mask) {
+            return false;
+        }
+
+        memcpy(pollen_internal_channel_elem(channel, tail), msg, channel->elem_size);
+        atomic_store_explicit(&channel->tail, tail + 1, memory_order_release);
+        return true;
+    }
+
+    size_t pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    for (;;) {
+        _Atomic size_t *seq = pollen_internal_channel_seq(channel, pos);
+        const intptr_t dif =
+            (intptr_t)atomic_load_explicit(seq, memory_order_acquire) - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                memcpy(pollen_internal_channel_elem(channel, pos), msg, channel->elem_size);
+                atomic_store_explicit(seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/* Copies up to max messages to out. Returns amount of messages copied. */
+static size_t pollen_internal_channel_pop(struct pollen_channel *channel, void *out, size_t max) {
+    unsigned char *dst = out;
+
+    if (channel->mode == POLLEN_CHANNEL_SPSC) {
+        const size_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        const size_t tail = atomic_load_explicit(&channel->tail, memory_order_acquire);
+        size_t n = tail - head;
+        if (n > max) {
+            n = max;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            memcpy(dst + i * channel->elem_size,
+                   pollen_internal_channel_elem(channel, head + i), channel->elem_size);
+        }
+        atomic_store_explicit(&channel->head, head + n, memory_order_release);
+        return n;
+    }
+
+    size_t n = 0;
+    size_t pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    while (n < max) {
+        _Atomic size_t *seq = pollen_internal_channel_seq(channel, pos);
+        const intptr_t dif =
+            (intptr_t)atomic_load_explicit(seq, memory_order_acquire) - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                memcpy(dst + n * channel->elem_size,
+                       pollen_internal_channel_elem(channel, pos), channel->elem_size);
+                atomic_store_explicit(seq, pos + channel->mask + 1, memory_order_release);
+                n += 1;
+                pos += 1;
+            }
+        } else if (dif < 0) {
+            break;
+        } else {
+            pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        }
+    }
+
+    return n;
+}
+
+/* Returns true if there is at least one message that can be popped right now. */
+static bool pollen_internal_channel_ready(struct pollen_channel *channel) {
+    const size_t head = atomic_load(&channel->head);
+
+    if (channel->mode == POLLEN_CHANNEL_SPSC) {
+        return atomic_load(&channel->tail) != head;
+    } else {
+        return atomic_load(pollen_internal_channel_seq(channel, head)) == head + 1;
+    }
+}
+
+static void pollen_internal_channel_wake_producers(struct pollen_channel *channel) {
+    pthread_mutex_lock(&channel->producers_lock);
+
+    struct pollen_callback *producer;
+    POLLEN_LL_FOR_EACH(producer, &channel->producers, as.channel.link) {
+        const uint64_t one = 1;
+        if (write(producer->fd, &one, sizeof(one)) < 0) {
+            POLLEN_LOG_WARN("failed to wake up channel producer on efd %d: %s",
+                            producer->fd, strerror(errno));
+        }
+    }
+
+    pthread_mutex_unlock(&channel->producers_lock);
+}
+
+struct pollen_channel *pollen_channel_create(size_t elem_size, size_t capacity,
+                                             enum pollen_channel_mode mode) {
+    struct pollen_channel *channel = NULL;
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("creating channel, elem_size %zu, capacity %zu", elem_size, capacity);
+
+    if (elem_size == 0 || capacity == 0) {
+        POLLEN_LOG_ERR("channel elem_size and capacity must not be 0");
+        save_errno = EINVAL;
+        goto err;
+    }
+
+    channel = POLLEN_CALLOC(1, sizeof(*channel));
+    if (channel == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for channel: %s", strerror(errno));
+        goto err;
+    }
+    channel->wake_fd = -1;
+    channel->mode = mode;
+    channel->elem_size = elem_size;
+
+    size_t real_capacity = 1;
+    while (real_capacity < capacity) {
+        real_capacity *= 2;
+    }
+    channel->mask = real_capacity - 1;
+
+    if (mode == POLLEN_CHANNEL_MPMC) {
+        const size_t align = _Alignof(_Atomic size_t);
+        channel->cell_size = (sizeof(size_t) + elem_size + align - 1) & ~(align - 1);
+    } else {
+        channel->cell_size = elem_size;
+    }
+
+    channel->cells = POLLEN_CALLOC(real_capacity, channel->cell_size);
+    if (channel->cells == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for channel buffer: %s", strerror(errno));
+        goto err;
+    }
+    if (mode == POLLEN_CHANNEL_MPMC) {
+        for (size_t i = 0; i < real_capacity; i++) {
+            atomic_init(pollen_internal_channel_seq(channel, i), i);
+        }
+    }
+
+    channel->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->wake_fd < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to create eventfd: %s", strerror(errno));
+        goto err;
+    }
+
+    pthread_mutex_init(&channel->producers_lock, NULL);
+    pollen_ll_init(&channel->producers);
+
+    return channel;
+
+err:
+    if (channel != NULL) {
+        POLLEN_FREE(channel->cells);
+    }
+    POLLEN_FREE(channel);
+    errno = save_errno;
+    return NULL;
+}
+
+void pollen_channel_destroy(struct pollen_channel *channel) {
+    if (channel == NULL) {
+        return;
+    }
+
+    POLLEN_LOG_INFO("destroying channel");
+
+    close(channel->wake_fd);
+    pthread_mutex_destroy(&channel->producers_lock);
+    POLLEN_FREE(channel->cells);
+    POLLEN_FREE(channel);
+}
+
+bool pollen_channel_send(struct pollen_channel *channel, const void *msg) {
+    if (!pollen_internal_channel_push(channel, msg)) {
+        /* tell consumers someone is waiting, then check again in case they drained it already */
+        atomic_store(&channel->producers_waiting, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!pollen_internal_channel_push(channel, msg)) {
+            errno = EAGAIN;
+            return false;
+        }
+    }
+
+    /* pairs with the fence in consumer, see pollen_internal_dispatch_channel_consumer */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&channel->consumer_scheduled, memory_order_relaxed) &&
+        !atomic_exchange(&channel->consumer_scheduled, true)) {
+        const uint64_t one = 1;
+        if (write(channel->wake_fd, &one, sizeof(one)) < 0) {
+            POLLEN_LOG_WARN("failed to wake up channel consumer: %s", strerror(errno));
+        }
+    }
+
+    return true;
+}
+
+static int pollen_internal_dispatch_channel_consumer(struct pollen_loop *loop,
+                                                     struct pollen_callback *callback,
+                                                     uint32_t events) {
+    struct pollen_channel *channel = callback->as.channel.channel;
+    bool wake_fd_reset = false;
+    size_t total = 0;
+
+    POLLEN_LOG_DEBUG("running channel consumer callback");
+
+    for (;;) {
+        const size_t n = pollen_internal_channel_pop(channel, callback->as.channel.batch,
+                                                     POLLEN_CHANNEL_BATCH);
+        if (n == 0) {
+            /* drained, reset wakeup and let producers wake us up again */
+            uint64_t dummy;
+            if (read(channel->wake_fd, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN) {
+                POLLEN_LOG_ERR("failed to read from channel eventfd: %s", strerror(errno));
+                return -1;
+            }
+            wake_fd_reset = true;
+
+            atomic_store(&channel->consumer_scheduled, false);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!pollen_internal_channel_ready(channel) ||
+                atomic_exchange(&channel->consumer_scheduled, true)) {
+                return 0;
+            }
+            continue;
+        }
+
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&channel->producers_waiting, memory_order_relaxed) &&
+            atomic_exchange(&channel->producers_waiting, false)) {
+            pollen_internal_channel_wake_producers(channel);
+        }
+
+        int ret = callback->fn.channel_recv(callback, callback->as.channel.batch, n,
+                                            callback->data);
+        if (ret < 0 || callback->dead) {
+            return ret;
+        }
+
+        /* don't starve the rest of the loop, make sure wake_fd is readable so we'll be back */
+        total += n;
+        if (total > channel->mask) {
+            if (wake_fd_reset) {
+                const uint64_t one = 1;
+                if (write(channel->wake_fd, &one, sizeof(one)) < 0) {
+                    POLLEN_LOG_ERR("failed to write to channel eventfd: %s", strerror(errno));
+                    return -1;
+                }
+            }
+            return 0;
+        }
+    }
+}
+
+static int pollen_internal_dispatch_channel_producer(struct pollen_loop *loop,
+                                                     struct pollen_callback *callback,
+                                                     uint32_t events) {
+    POLLEN_LOG_DEBUG("running channel producer callback on efd %d", callback->fd);
+
+    uint64_t dummy;
+    if (read(callback->fd, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN) {
+        POLLEN_LOG_ERR("failed to read from efd %d: %s", callback->fd, strerror(errno));
+        return -1;
+    }
+
+    return callback->fn.channel_writable(callback, callback->data);
+}
+
+struct pollen_callback *pollen_loop_add_channel_consumer(struct pollen_loop *loop,
+                                                         struct pollen_channel *channel,
+                                                         pollen_channel_recv_fn callback,
+                                                         void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+    bool counted = false;
+
+    POLLEN_LOG_INFO("adding channel consumer callback to event loop");
+
+    /* consumers could be added from several threads at once, so claim the slot atomically */
+    if (channel->mode == POLLEN_CHANNEL_SPSC) {
+        int expected = 0;
+        if (!atomic_compare_exchange_strong(&channel->consumers, &expected, 1)) {
+            POLLEN_LOG_ERR("SPSC channel already has a consumer");
+            save_errno = EBUSY;
+            goto err;
+        }
+    } else {
+        atomic_fetch_add(&channel->consumers, 1);
+    }
+    counted = true;
+
+    new_callback = pollen_internal_callback_alloc(loop);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_CHANNEL;
+    new_callback->dispatch = pollen_internal_dispatch_channel_consumer;
+    new_callback->fd = channel->wake_fd;
+    new_callback->fn.channel_recv = callback;
+    new_callback->as.channel.channel = channel;
+    new_callback->as.channel.consumer = true;
+    new_callback->data = data;
+
+    new_callback->as.channel.batch = POLLEN_CALLOC(POLLEN_CHANNEL_BATCH, channel->elem_size);
+    if (new_callback->as.channel.batch == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for channel batch: %s", strerror(errno));
+        goto err;
+    }
+
+    if (pollen_internal_fds_reserve(loop, channel->wake_fd) < 0) {
+        save_errno = errno;
+        goto err;
+    }
+
+    /* with many consumers, wake only one of them per wakeup */
+    struct epoll_event epoll_event;
+    epoll_event.events = EPOLLIN;
+    if (channel->mode == POLLEN_CHANNEL_MPMC) {
+        epoll_event.events |= EPOLLEXCLUSIVE;
+    }
+    epoll_event.data.ptr = new_callback;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, channel->wake_fd, &epoll_event) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to add channel eventfd %d to epoll: %s",
+                       channel->wake_fd, strerror(errno));
+        goto err;
+    }
+
+    pollen_internal_fds_set(loop, channel->wake_fd, new_callback);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    if (counted) {
+        atomic_fetch_sub(&channel->consumers, 1);
+    }
+    if (new_callback != NULL) {
+        POLLEN_FREE(new_callback->as.channel.batch);
+    }
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+
+struct pollen_callback *pollen_loop_add_channel_producer(struct pollen_loop *loop,
+                                                         struct pollen_channel *channel,
+                                                         pollen_channel_writable_fn callback,
+                                                         void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+    int efd = -1;
+
+    POLLEN_LOG_INFO("adding channel producer callback to event loop");
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to create eventfd: %s", strerror(errno));
+        goto err;
+    }
+
+    new_callback = pollen_internal_callback_alloc(loop);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_CHANNEL;
+    new_callback->dispatch = pollen_internal_dispatch_channel_producer;
+    new_callback->fd = efd;
+    new_callback->fn.channel_writable = callback;
+    new_callback->as.channel.channel = channel;
+    new_callback->as.channel.consumer = false;
+    new_callback->data = data;
+
+    if (pollen_internal_fds_reserve(loop, efd) < 0) {
+        save_errno = errno;
+        goto err;
+    }
+
+    struct epoll_event epoll_event;
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.ptr = new_callback;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, efd, &epoll_event) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to add efd %d to epoll: %s", efd, strerror(errno));
+        goto err;
+    }
+
+    pollen_internal_fds_set(loop, efd, new_callback);
+
+    pthread_mutex_lock(&channel->producers_lock);
+    pollen_ll_insert(&channel->producers, &new_callback->as.channel.link);
+    pthread_mutex_unlock(&channel->producers_lock);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    if (efd > 0) {
+        close(efd);
+    }
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+#endif /* #if !defined(POLLEN_NO_CHANNELS) */
+
+#if !defined(POLLEN_NO_DGRAMS)
+/* kernel won't take more than this in one GSO send, see udp(7). Same as IPv4 max payload */
+#define POLLEN_UDP_MAX_PAYLOAD 65507
+
+/*
+ * Batch of datagrams together with everything recvmmsg/sendmmsg need to read or write it.
+ * Datagram buffers of max_size bytes each are allocated right after the struct.
+ */
+struct pollen_dgram_queue {
+    size_t count; /* send queue only, amount of queued datagrams */
+    struct pollen_dgram dgrams[POLLEN_DGRAM_BATCH];
+    struct mmsghdr msgs[POLLEN_DGRAM_BATCH];
+    struct iovec iovs[POLLEN_DGRAM_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        size_t align; /* same as struct cmsghdr, which can't be a member itself */
+    } cmsgs[POLLEN_DGRAM_BATCH];
+};
+
+static struct pollen_dgram_queue *pollen_internal_dgram_queue_create(size_t max_size) {
+    struct pollen_dgram_queue *queue =
+        POLLEN_CALLOC(1, sizeof(*queue) + POLLEN_DGRAM_BATCH * max_size);
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    unsigned char *bufs = (unsigned char *)(queue + 1);
+    for (int i = 0; i < POLLEN_DGRAM_BATCH; i++) {
+        queue->dgrams[i].buf = bufs + i * max_size;
+    }
+
+    return queue;
+}
+
+static void pollen_internal_dgram_want_writable(struct pollen_callback *callback, bool want) {
+    const uint32_t events = want ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    if (events == callback->events) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.data.ptr = callback;
+    ev.events = events;
+    if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_MOD, callback->fd, &ev) < 0) {
+        POLLEN_LOG_WARN("failed to modify events for fd %d: %s", callback->fd, strerror(errno));
+        return;
+    }
+
+    callback->events = events;
+}
+
+static int pollen_internal_dispatch_dgram(struct pollen_loop *loop,
+                                          struct pollen_callback *callback,
+                                          uint32_t events) {
+    struct pollen_dgram_queue *rx = callback->as.dgram.rx;
+    const int fd = callback->fd;
+
+    POLLEN_LOG_DEBUG("running dgram callback for fd %d", fd);
+
+    if (events & EPOLLOUT) {
+        pollen_dgram_flush(callback);
+    }
+    if (!(events & (EPOLLIN | EPOLLERR))) {
+        return 0;
+    }
+
+    /* kernel overwrites these, everything else is set up once by pollen_loop_add_dgram */
+    for (int i = 0; i < POLLEN_DGRAM_BATCH; i++) {
+        rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->dgrams[i].addr);
+        if (callback->as.dgram.flags & POLLEN_DGRAM_GRO) {
+            rx->msgs[i].msg_hdr.msg_controllen = sizeof(rx->cmsgs[i].buf);
+        }
+    }
+
+    /* level-triggered, so if there's more we'll be back on the next iteration */
+    const int n = recvmmsg(fd, rx->msgs, POLLEN_DGRAM_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            /* for example, ICMP port unreachable on connected socket. Not fatal */
+            POLLEN_LOG_WARN("failed to receive datagrams on fd %d: %s", fd, strerror(errno));
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct pollen_dgram *dgram = &rx->dgrams[i];
+        struct msghdr *hdr = &rx->msgs[i].msg_hdr;
+
+        dgram->len = rx->msgs[i].msg_len;
+        dgram->addrlen = hdr->msg_namelen;
+        dgram->segment_size = 0;
+
+        if (callback->as.dgram.flags & POLLEN_DGRAM_GRO) {
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+                 cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int segment_size;
+                    memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                    if (segment_size > 0 && (size_t)segment_size < dgram->len) {
+                        dgram->segment_size = segment_size;
+                    }
+                }
+            }
+        }
+    }
+
+    int ret = callback->fn.dgram(callback, rx->dgrams, n, callback->data);
+    if (ret < 0 || callback->dead) {
+        return ret;
+    }
+
+    /* send replies queued by the callback right away */
+    if (callback->as.dgram.tx->count > 0) {
+        pollen_dgram_flush(callback);
+    }
+
+    return 0;
+}
+
+struct pollen_callback *pollen_loop_add_dgram(struct pollen_loop *loop, int fd, bool autoclose,
+                                              size_t max_size, unsigned flags,
+                                              pollen_dgram_recv_fn callback, void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("adding dgram callback to event loop, fd %d, max_size %zu, flags %X",
+                    fd, max_size, flags);
+
+    if (max_size == 0) {
+        POLLEN_LOG_ERR("dgram max_size must not be 0");
+        save_errno = EINVAL;
+        goto err;
+    }
+    if (max_size > 65535) {
+        POLLEN_LOG_ERR("dgram max_size %zu is more than 65535", max_size);
+        save_errno = EINVAL;
+        goto err;
+    }
+
+    new_callback = pollen_internal_callback_alloc(loop);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_DGRAM;
+    new_callback->dispatch = pollen_internal_dispatch_dgram;
+    new_callback->fd = fd;
+    new_callback->events = EPOLLIN;
+    new_callback->fn.dgram = callback;
+    new_callback->as.dgram.autoclose = autoclose;
+    new_callback->as.dgram.max_size = max_size;
+    new_callback->data = data;
+
+    if (flags & POLLEN_DGRAM_GRO) {
+        const int one = 1;
+        if (setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+            POLLEN_LOG_INFO("UDP GRO is not available on fd %d: %s", fd, strerror(errno));
+            flags &= ~POLLEN_DGRAM_GRO;
+        }
+    }
+    if (flags & POLLEN_DGRAM_GSO) {
+        int segment_size;
+        socklen_t len = sizeof(segment_size);
+        if (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size, &len) < 0) {
+            POLLEN_LOG_INFO("UDP GSO is not available on fd %d: %s", fd, strerror(errno));
+            flags &= ~POLLEN_DGRAM_GSO;
+        }
+    }
+    new_callback->as.dgram.flags = flags;
+
+    new_callback->as.dgram.rx = pollen_internal_dgram_queue_create(max_size);
+    new_callback->as.dgram.tx = pollen_internal_dgram_queue_create(max_size);
+    if (new_callback->as.dgram.rx == NULL || new_callback->as.dgram.tx == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for dgram buffers: %s", strerror(errno));
+        goto err;
+    }
+
+    struct pollen_dgram_queue *rx = new_callback->as.dgram.rx;
+    for (int i = 0; i < POLLEN_DGRAM_BATCH; i++) {
+        rx->iovs[i].iov_base = rx->dgrams[i].buf;
+        rx->iovs[i].iov_len = max_size;
+        rx->msgs[i].msg_hdr.msg_name = &rx->dgrams[i].addr;
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+        if (flags & POLLEN_DGRAM_GRO) {
+            rx->msgs[i].msg_hdr.msg_control = rx->cmsgs[i].buf;
+        }
+    }
+
+    if (pollen_internal_fds_reserve(loop, fd) < 0) {
+        save_errno = errno;
+        goto err;
+    }
+
+    struct epoll_event epoll_event;
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.ptr = new_callback;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to add fd %d to epoll: %s", fd, strerror(errno));
+        goto err;
+    }
+
+    pollen_internal_fds_set(loop, fd, new_callback);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    if (new_callback != NULL) {
+        POLLEN_FREE(new_callback->as.dgram.rx);
+        POLLEN_FREE(new_callback->as.dgram.tx);
+    }
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+
+bool pollen_dgram_send(struct pollen_callback *callback, const void *buf, size_t len,
+                       const struct sockaddr *addr, socklen_t addrlen) {
+    if (callback->type != POLLEN_CALLBACK_TYPE_DGRAM) {
+        POLLEN_LOG_ERR("passed non-dgram callback to pollen_dgram_send");
+        errno = EINVAL;
+        return false;
+    }
+    if (addr == NULL) {
+        addrlen = 0;
+    } else if (addrlen > sizeof(struct sockaddr_storage)) {
+        POLLEN_LOG_ERR("invalid address length %u", (unsigned)addrlen);
+        errno = EINVAL;
+        return false;
+    }
+
+    const size_t max_size = callback->as.dgram.max_size;
+    if (len > max_size) {
+        POLLEN_LOG_ERR("datagram of %zu bytes is larger than max_size %zu", len, max_size);
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    struct pollen_dgram_queue *tx = callback->as.dgram.tx;
+
+    /* append to the previous datagram if it can go out as one more GSO segment */
+    if ((callback->as.dgram.flags & POLLEN_DGRAM_GSO) && tx->count > 0) {
+        struct pollen_dgram *last = &tx->dgrams[tx->count - 1];
+        const size_t segment_size = (last->segment_size != 0) ? last->segment_size : last->len;
+
+        if (segment_size != 0 && len != 0 && len <= segment_size &&
+            last->len % segment_size == 0 /* only the last segment can be shorter */ &&
+            last->len / segment_size < POLLEN_UDP_MAX_SEGMENTS &&
+            last->len + len <= max_size && last->len + len <= POLLEN_UDP_MAX_PAYLOAD &&
+            last->addrlen == addrlen && (addr == NULL || memcmp(&last->addr, addr, addrlen) == 0)) {
+            memcpy((unsigned char *)last->buf + last->len, buf, len);
+            last->len += len;
+            last->segment_size = segment_size;
+            return true;
+        }
+    }
+
+    if (tx->count == POLLEN_DGRAM_BATCH) {
+        pollen_dgram_flush(callback);
+        if (tx->count == POLLEN_DGRAM_BATCH) {
+            errno = EAGAIN;
+            return false;
+        }
+    }
+
+    struct pollen_dgram *dgram = &tx->dgrams[tx->count++];
+    memcpy(dgram->buf, buf, len);
+    dgram->len = len;
+    dgram->segment_size = 0;
+    dgram->addrlen = addrlen;
+    if (addr != NULL) {
+        memcpy(&dgram->addr, addr, addrlen);
+    }
+
+    return true;
+}
+
+bool pollen_dgram_flush(struct pollen_callback *callback) {
+    if (callback->type != POLLEN_CALLBACK_TYPE_DGRAM) {
+        POLLEN_LOG_ERR("passed non-dgram callback to pollen_dgram_flush");
+        errno = EINVAL;
+        return false;
+    }
+
+    struct pollen_dgram_queue *tx = callback->as.dgram.tx;
+    int save_errno = 0;
+    size_t sent = 0;
+
+    for (size_t i = 0; i < tx->count; i++) {
+        struct pollen_dgram *dgram = &tx->dgrams[i];
+        struct msghdr *hdr = &tx->msgs[i].msg_hdr;
+
+        tx->iovs[i].iov_base = dgram->buf;
+        tx->iovs[i].iov_len = dgram->len;
+        *hdr = (struct msghdr){
+            .msg_name = (dgram->addrlen != 0) ? &dgram->addr : NULL,
+            .msg_namelen = dgram->addrlen,
+            .msg_iov = &tx->iovs[i],
+            .msg_iovlen = 1,
+        };
+
+        if (dgram->segment_size != 0) {
+            const uint16_t segment_size = dgram->segment_size;
+            hdr->msg_control = tx->cmsgs[i].buf;
+            hdr->msg_controllen = CMSG_SPACE(sizeof(segment_size));
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+    }
+
+    while (sent < tx->count) {
+        const int n = sendmmsg(callback->fd, &tx->msgs[sent], tx->count - sent, MSG_DONTWAIT);
+        if (n > 0) {
+            sent += n;
+        } else if (errno == EAGAIN) {
+            break;
+        } else if (errno != EINTR) {
+            /* first datagram was rejected, drop it and carry on with the rest */
+            save_errno = errno;
+            POLLEN_LOG_WARN("failed to send datagram of %zu bytes on fd %d: %s",
+                            tx->dgrams[sent].len, callback->fd, strerror(errno));
+            sent += 1;
+        }
+    }
+
+    POLLEN_LOG_DEBUG("sent %zu of %zu queued datagrams on fd %d", sent, tx->count, callback->fd);
+
+    /* move unsent datagrams to the front. Swapping keeps every buffer owned by one slot */
+    for (size_t i = 0; sent != 0 && i < tx->count - sent; i++) {
+        struct pollen_dgram tmp = tx->dgrams[i];
+        tx->dgrams[i] = tx->dgrams[sent + i];
+        tx->dgrams[sent + i] = tmp;
+    }
+    tx->count -= sent;
+
+    pollen_internal_dgram_want_writable(callback, tx->count > 0);
+
+    if (save_errno != 0) {
+        errno = save_errno;
+        return false;
+    }
+    return true;
+}
+#endif /* #if !defined(POLLEN_NO_DGRAMS) */
+
+#if !defined(POLLEN_NO_LISTENERS)
+static bool pollen_internal_listener_register(struct pollen_callback *callback) {
+    struct epoll_event epoll_event;
+    epoll_event.events = EPOLLIN;
+    if (callback->as.listener.exclusive) {
+        epoll_event.events |= EPOLLEXCLUSIVE;
+    }
+    epoll_event.data.ptr = callback;
+    if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_ADD, callback->fd, &epoll_event) < 0) {
+        POLLEN_LOG_ERR("failed to add fd %d to epoll: %s", callback->fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#if !defined(POLLEN_NO_TIMERS)
+/*
+ * Removes listener from epoll until the retry timer fires.
+ * Dropping EPOLLIN with EPOLL_CTL_MOD would be enough, but EPOLLEXCLUSIVE fds can't be modified.
+ */
+static void pollen_internal_listener_pause(struct pollen_loop *loop,
+                                           struct pollen_callback *callback) {
+    if (pollen_ll_is_empty(&loop->paused_listeners) &&
+        !pollen_timer_arm_ms(loop->listener_retry_timer, false, POLLEN_LISTENER_RETRY_MS, 0)) {
+        POLLEN_LOG_ERR("failed to arm listener retry timer: %s", strerror(errno));
+        return;
+    }
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, callback->fd, NULL) < 0) {
+        POLLEN_LOG_WARN("failed to remove fd %d from epoll: %s", callback->fd, strerror(errno));
+        return;
+    }
+
+    POLLEN_LOG_DEBUG("pausing listener for fd %d for %d ms", callback->fd, POLLEN_LISTENER_RETRY_MS);
+    callback->as.listener.paused = true;
+    pollen_ll_insert(&loop->paused_listeners, &callback->as.listener.paused_link);
+}
+
+static int pollen_internal_listeners_resume(struct pollen_callback *timer, void *data) {
+    struct pollen_loop *loop = data;
+
+    while (!pollen_ll_is_empty(&loop->paused_listeners)) {
+        struct pollen_callback *callback =
+            POLLEN_CONTAINER_OF(loop->paused_listeners.next, callback, as.listener.paused_link);
+
+        if (!pollen_internal_listener_register(callback)) {
+            if (!pollen_timer_arm_ms(timer, false, POLLEN_LISTENER_RETRY_MS, 0)) {
+                POLLEN_LOG_ERR("failed to arm listener retry timer: %s", strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+
+        POLLEN_LOG_DEBUG("resuming listener for fd %d", callback->fd);
+        pollen_ll_remove(&callback->as.listener.paused_link);
+        callback->as.listener.paused = false;
+    }
+
+    return 0;
+}
+#endif /* #if !defined(POLLEN_NO_TIMERS) */
+
+static int pollen_internal_dispatch_listener(struct pollen_loop *loop,
+                                             struct pollen_callback *callback,
+                                             uint32_t events) {
+    int fds[POLLEN_LISTENER_BATCH];
+    size_t n = 0;
+
+    POLLEN_LOG_DEBUG("running listener callback for fd %d", callback->fd);
+
+    while (n < POLLEN_LISTENER_BATCH) {
+        const int fd = accept4(callback->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            fds[n++] = fd;
+        } else if (errno == EAGAIN) {
+            break;
+        } else if (errno == EINTR || errno == ECONNABORTED) {
+            /* connection reset before we got to it, try the next one */
+            continue;
+        } else {
+            /* out of fds or memory. Connections stay in backlog, so don't wake up for them
+             * on every iteration until something is freed */
+            POLLEN_LOG_WARN("failed to accept connection on fd %d: %s",
+                            callback->fd, strerror(errno));
+#if !defined(POLLEN_NO_TIMERS)
+            pollen_internal_listener_pause(loop, callback);
+#endif
+            break;
+        }
+    }
+
+    POLLEN_LOG_DEBUG("accepted %zu connections on fd %d", n, callback->fd);
+
+    if (n == 0) {
+        return 0;
+    }
+    return callback->fn.listener(callback, fds, n, callback->data);
+}
+
+struct pollen_callback *pollen_loop_add_listener(struct pollen_loop *loop, int fd, bool autoclose,
+                                                 unsigned flags, pollen_listener_fn callback,
+                                                 void *data) {
+    struct pollen_callback *new_callback = NULL;
+    int save_errno = 0;
+
+    POLLEN_LOG_INFO("adding listener callback to event loop, fd %d, flags %X", fd, flags);
+
+#if !defined(POLLEN_NO_TIMERS)
+    /* created upfront, there might be no fds left for it by the time it's needed */
+    if (loop->listener_retry_timer == NULL) {
+        loop->listener_retry_timer = pollen_loop_add_timer(loop, pollen_internal_timer_clockid(),
+                                                           pollen_internal_listeners_resume, loop);
+        if (loop->listener_retry_timer == NULL) {
+            save_errno = errno;
+            goto err;
+        }
+    }
+#endif
+
+    new_callback = pollen_internal_callback_alloc(loop);
+    if (new_callback == NULL) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
+        goto err;
+    }
+    new_callback->type = POLLEN_CALLBACK_TYPE_LISTENER;
+    new_callback->dispatch = pollen_internal_dispatch_listener;
+    new_callback->fd = fd;
+    new_callback->fn.listener = callback;
+    new_callback->as.listener.autoclose = autoclose;
+    new_callback->as.listener.exclusive = (flags & POLLEN_LISTENER_EXCLUSIVE) != 0;
+    new_callback->data = data;
+
+    if (pollen_internal_fds_reserve(loop, fd) < 0) {
+        save_errno = errno;
+        goto err;
+    }
+
+    if (!pollen_internal_listener_register(new_callback)) {
+        save_errno = errno;
+        goto err;
+    }
+
+    pollen_internal_fds_set(loop, fd, new_callback);
+
+    POLLEN_USDT_PROBE2(callback_add, new_callback->type, new_callback->fd);
+    pollen_internal_callback_count(loop, new_callback->type, 1);
+
+    return new_callback;
+
+err:
+    pollen_internal_callback_free(loop, new_callback);
+    errno = save_errno;
+    return NULL;
+}
+
+bool pollen_listener_steer_by_cpu(int fd, unsigned n_sockets) {
+    POLLEN_LOG_INFO("steering connections of fd %d by cpu over %u sockets", fd, n_sockets);
+
+    if (n_sockets == 0) {
+        POLLEN_LOG_ERR("n_sockets must not be 0");
+        errno = EINVAL;
+        return false;
+    }
+
+    /* A = cpu; A %= n_sockets; return A */
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n_sockets },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        POLLEN_LOG_ERR("failed to attach reuseport program to fd %d: %s", fd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+#endif /* #if !defined(POLLEN_NO_LISTENERS) */
+
+#if !defined(POLLEN_NO_ASYNC_CLOSE)
+/*
+ * Background thread that closes fds for the loop, see pollen_loop_set_async_close.
+ * Loop appends to queue, the thread swaps it with spare and closes everything in it,
+ * so after warming up neither side allocates.
+ */
+struct pollen_closer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* protected by lock */
+    int *queue;
+    size_t count;
+    size_t capacity;
+    bool quit;
+    bool idle;
+
+    /* closer thread only */
+    int *spare;
+    size_t spare_capacity;
+
+    _Atomic size_t pending;
+};
+
+static void *pollen_internal_closer_thread(void *data) {
+    struct pollen_closer *closer = data;
+
+    pthread_mutex_lock(&closer->lock);
+    for (;;) {
+        while (closer->count == 0 && !closer->quit) {
+            closer->idle = true;
+            pthread_cond_wait(&closer->cond, &closer->lock);
+        }
+        closer->idle = false;
+        if (closer->count == 0) {
+            break;
+        }
+
+        int *batch = closer->queue;
+        const size_t n = closer->count;
+        closer->queue = closer->spare;
+        closer->spare = batch;
+        const size_t capacity = closer->capacity;
+        closer->capacity = closer->spare_capacity;
+        closer->spare_capacity = capacity;
+        closer->count = 0;
+        pthread_mutex_unlock(&closer->lock);
+
+        for (size_t i = 0; i < n; i++) {
+            if (close(batch[i]) < 0) {
+                POLLEN_LOG_WARN("closing fd %d failed: %s (was it closed somewhere else?)",
+                                batch[i], strerror(errno));
+            }
+            atomic_fetch_sub_explicit(&closer->pending, 1, memory_order_release);
+        }
+
+        pthread_mutex_lock(&closer->lock);
+    }
+    pthread_mutex_unlock(&closer->lock);
+
+    return NULL;
+}
+
+/* Queues fd for the closer thread. Returns false if it has to be closed right away. */
+static bool pollen_internal_closer_push(struct pollen_closer *closer, int fd) {
+    pthread_mutex_lock(&closer->lock);
+
+    if (closer->count == closer->capacity) {
+        const size_t new_capacity = (closer->capacity > 0) ? closer->capacity * 2 : 64;
+        int *new_queue = POLLEN_CALLOC(new_capacity, sizeof(*new_queue));
+        if (new_queue == NULL) {
+            pthread_mutex_unlock(&closer->lock);
+            POLLEN_LOG_WARN("failed to allocate memory for close queue: %s", strerror(errno));
+            return false;
+        }
+        if (closer->queue != NULL) {
+            memcpy(new_queue, closer->queue, closer->count * sizeof(*new_queue));
+            POLLEN_FREE(closer->queue);
+        }
+        closer->queue = new_queue;
+        closer->capacity = new_capacity;
+    }
+
+    closer->queue[closer->count++] = fd;
+    atomic_fetch_add_explicit(&closer->pending, 1, memory_order_relaxed);
+    /* busy thread picks it up when it is done with the current batch */
+    const bool wake = closer->idle;
+    pthread_mutex_unlock(&closer->lock);
+
+    if (wake) {
+        pthread_cond_signal(&closer->cond);
+    }
+
+    return true;
+}
+
+bool pollen_loop_set_async_close(struct pollen_loop *loop, bool enable) {
+    struct pollen_closer *closer = loop->closer;
+    int ret;
+
+    if (enable == (closer != NULL)) {
+        return true;
+    }
+
+    if (!enable) {
+        POLLEN_LOG_INFO("stopping closer thread, %zu fds left to close",
+                        pollen_loop_get_pending_closes(loop));
+
+        pthread_mutex_lock(&closer->lock);
+        closer->quit = true;
+        pthread_mutex_unlock(&closer->lock);
+        pthread_cond_signal(&closer->cond);
+        pthread_join(closer->thread, NULL);
+
+        pthread_cond_destroy(&closer->cond);
+        pthread_mutex_destroy(&closer->lock);
+        POLLEN_FREE(closer->queue);
+        POLLEN_FREE(closer->spare);
+        POLLEN_FREE(closer);
+        loop->closer = NULL;
+
+        return true;
+    }
+
+    POLLEN_LOG_INFO("starting closer thread");
+
+    closer = POLLEN_CALLOC(1, sizeof(*closer));
+    if (closer == NULL) {
+        POLLEN_LOG_ERR("failed to allocate memory for closer thread: %s", strerror(errno));
+        return false;
+    }
+    pthread_mutex_init(&closer->lock, NULL);
+    pthread_cond_init(&closer->cond, NULL);
+
+    /* closes can run while the loop is busy, so don't let the thread compete with it for signals */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&closer->thread, NULL, pollen_internal_closer_thread, closer);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        POLLEN_LOG_ERR("failed to start closer thread: %s", strerror(ret));
+        pthread_cond_destroy(&closer->cond);
+        pthread_mutex_destroy(&closer->lock);
+        POLLEN_FREE(closer);
+        errno = ret;
+        return false;
+    }
+
+    loop->closer = closer;
+    return true;
+}
+
+size_t pollen_loop_get_pending_closes(struct pollen_loop *loop) {
+    struct pollen_closer *closer = loop->closer;
+    return (closer != NULL) ? atomic_load_explicit(&closer->pending, memory_order_acquire) : 0;
+}
+#endif /* #if !defined(POLLEN_NO_ASYNC_CLOSE) */
+
+/* Closes autoclose fd of a removed callback, on the closer thread if there is one. */
+static void pollen_internal_autoclose(struct pollen_loop *loop, int fd) {
+#if !defined(POLLEN_NO_ASYNC_CLOSE)
+    if (loop->closer != NULL && pollen_internal_closer_push(loop->closer, fd)) {
+        POLLEN_LOG_INFO("queued fd %d for closing", fd);
+        return;
+    }
+#endif
+
+    POLLEN_LOG_INFO("closing fd %d", fd);
+    if (close(fd) < 0) {
+        POLLEN_LOG_WARN("closing fd %d failed: %s (was it closed somewhere else?)",
+                        fd, strerror(errno));
+    }
+}
+
+void pollen_loop_remove_callback(struct pollen_callback *callback) {
+    if (callback == NULL) {
+        return;
+    }
+
+    POLLEN_USDT_PROBE2(callback_remove, callback->type, callback->fd);
+    pollen_internal_callback_count(callback->loop, callback->type, -1);
+
+    switch (callback->type) {
+    case POLLEN_CALLBACK_TYPE_FD: {
+        int fd = callback->fd;
+
+        POLLEN_LOG_INFO("removing pollable callback for fd %d from event loop", fd);
+
+#if !defined(POLLEN_NO_TIMERS)
+        if (callback->as.fd.timeout_ns != 0) {
+            pollen_internal_timeout_unlink(callback);
+        }
+        if (callback->as.fd.rate_limit != NULL) {
+            pollen_ll_remove(&callback->as.fd.rate_limit_link);
+        }
+#endif
+
+        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to remove fd %d from epoll: %s", fd, strerror(errno));
+        }
+
+        if (callback->as.fd.autoclose) {
+            pollen_internal_autoclose(callback->loop, fd);
+        }
+
+        pollen_internal_fds_set(callback->loop, fd, NULL);
+        break;
+    }
+#if !defined(POLLEN_NO_IDLE)
+    case POLLEN_CALLBACK_TYPE_IDLE: {
+        POLLEN_LOG_INFO("removing unconditional callback with prio %d from event loop",
+                             callback->as.idle.priority);
+
+        pollen_ll_remove(&callback->link);
+        break;
+    }
+#endif
+#if !defined(POLLEN_NO_SIGNALS)
+    case POLLEN_CALLBACK_TYPE_SIGNAL: {
+        int signal = callback->as.signal.sig;
+        struct pollen_loop *loop = callback->loop;
+
+        POLLEN_LOG_INFO("removing signal callback for signal %d from event loop", signal);
+
+        sigdelset(&loop->sigset, signal);
+        int ret = signalfd(loop->signal_fd, &loop->sigset, 0);
+        if (ret < 0) {
+            POLLEN_LOG_WARN("failed to remove signal %d from signalfd: %s (THIS IS VERY BAD)",
+                                signal, strerror(errno));
+        }
+
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, signal);
+        if (sigprocmask(SIG_UNBLOCK, &set, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to unblock signal %d: %s (program might misbehave)",
+                                signal, strerror(errno));
+        };
+
+        loop->signal_callbacks[signal] = NULL;
+
+        pollen_ll_remove(&callback->link);
+        break;
+    }
+#endif
+#if !defined(POLLEN_NO_TIMERS)
+    case POLLEN_CALLBACK_TYPE_TIMER: {
+        int tfd = callback->fd;
+
+        POLLEN_LOG_INFO("removing timer callback with tfd %d for from event loop", tfd);
+
+        pollen_internal_virtual_timer_disarm(callback);
+
+        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, tfd, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to remove tfd %d from epoll: %s", tfd, strerror(errno));
+        }
+
+        if (close(tfd) < 0) {
+            POLLEN_LOG_WARN("closing tfd %d failed: %s", tfd, strerror(errno));
+        };
+
+        pollen_internal_fds_set(callback->loop, tfd, NULL);
+        break;
+    }
+#endif
+#if !defined(POLLEN_NO_EFDS)
+    case POLLEN_CALLBACK_TYPE_EFD: {
+        int efd = callback->fd;
+
+        POLLEN_LOG_INFO("removing efd callback for efd %d from event loop", efd);
+
+        if (callback->as.efd.queued) {
+            pollen_ll_remove(&callback->link);
+        }
+
+        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, efd, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to remove efd %d from epoll: %s", efd, strerror(errno));
+        }
+
+        if (close(efd) < 0) {
+            POLLEN_LOG_WARN("closing efd %d failed: %s", efd, strerror(errno));
+        };
+
+        pollen_internal_fds_set(callback->loop, efd, NULL);
+        break;
+    }
+#endif
+#if !defined(POLLEN_NO_CHANNELS)
+    case POLLEN_CALLBACK_TYPE_CHANNEL: {
+        int fd = callback->fd;
+        struct pollen_channel *channel = callback->as.channel.channel;
+
+        POLLEN_LOG_INFO("removing channel %s callback for efd %d from event loop",
+                        callback->as.channel.consumer ? "consumer" : "producer", fd);
+
+        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to remove efd %d from epoll: %s", fd, strerror(errno));
+        }
+
+        if (callback->as.channel.consumer) {
+            /* wake_fd belongs to the channel */
+            POLLEN_FREE(callback->as.channel.batch);
+            atomic_fetch_sub(&channel->consumers, 1);
+        } else {
+            pthread_mutex_lock(&channel->producers_lock);
+            pollen_ll_remove(&callback->as.channel.link);
+            pthread_mutex_unlock(&channel->producers_lock);
+
+            if (close(fd) < 0) {
+                POLLEN_LOG_WARN("closing efd %d failed: %s", fd, strerror(errno));
+            };
+        }
+
+        pollen_internal_fds_set(callback->loop, fd, NULL);
+        break;
+    }
+#endif
+#if !defined(POLLEN_NO_DGRAMS)
+    case POLLEN_CALLBACK_TYPE_DGRAM: {
+        int fd = callback->fd;
+
+        POLLEN_LOG_INFO("removing dgram callback for fd %d from event loop, dropping %zu "
+                        "queued datagrams", fd, callback->as.dgram.tx->count);
+
+        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to remove fd %d from epoll: %s", fd, strerror(errno));
+        }
+
+        if (callback->as.dgram.autoclose) {
+            pollen_internal_autoclose(callback->loop, fd);
+        }
+
+        POLLEN_FREE(callback->as.dgram.rx);
+        POLLEN_FREE(callback->as.dgram.tx);
+
+        pollen_internal_fds_set(callback->loop, fd, NULL);
+        break;
+    }
+#endif
+#if !defined(POLLEN_NO_LISTENERS)
+    case POLLEN_CALLBACK_TYPE_LISTENER: {
+        int fd = callback->fd;
+
+        POLLEN_LOG_INFO("removing listener callback for fd %d from event loop", fd);
+
+        bool registered = true;
+#if !defined(POLLEN_NO_TIMERS)
+        if (callback->as.listener.paused) {
+            pollen_ll_remove(&callback->as.listener.paused_link);
+            registered = false;
+        }
+#endif
+        if (registered && epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            POLLEN_LOG_WARN("failed to remove fd %d from epoll: %s", fd, strerror(errno));
+        }
+
+        if (callback->as.listener.autoclose) {
+            pollen_internal_autoclose(callback->loop, fd);
+        }
+
+        pollen_internal_fds_set(callback->loop, fd, NULL);
+        break;
+    }
+#endif
+    }
+
+    if (callback->loop->dispatching) {
+        /* there might be pending events for this callback in current batch, can't free yet */
+        callback->dead = true;
+        callback->next_free = callback->loop->dead_callbacks;
+        callback->loop->dead_callbacks = callback;
+    } else {
+        pollen_internal_callback_free(callback->loop, callback);
+    }
+}
+
+struct pollen_loop *pollen_callback_get_loop(struct pollen_callback *callback) {
+    return callback->loop;
+}
+
+uint32_t pollen_callback_get_id(struct pollen_callback *callback) {
+    return callback->id;
+}
+
+struct pollen_callback *pollen_loop_find_fd(struct pollen_loop *loop, int fd) {
+    if (fd < 0 || fd >= loop->fds_capacity) {
+        return NULL;
+    }
+    return loop->fds[fd];
+}
+
+int pollen_loop_for_each_fd(struct pollen_loop *loop, pollen_fd_iter_fn iter_fn, void *data) {
+    /* table might get reallocated by iter_fn, so don't cache anything */
+    for (int fd = 0; fd < loop->fds_capacity; fd++) {
+        struct pollen_callback *callback = loop->fds[fd];
+        if (callback == NULL) {
+            continue;
+        }
+
+        int ret = iter_fn(callback, fd, data);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Converts timeout in ns to epoll_wait timeout, rounding up. */
+static int pollen_internal_timeout_ms(int64_t timeout_ns) {
+    if (timeout_ns < 0) {
+        return -1;
+    }
+
+    const int64_t timeout_ms = (timeout_ns + 999999) / 1000000;
+    return (timeout_ms > INT_MAX) ? INT_MAX : (int)timeout_ms;
+}
+
+#if !defined(POLLEN_NO_TIMERS)
+/*
+ * Runs virtual timers that are due at loop time. Periodic ones are rescheduled before running,
+ * ones armed by the callbacks for already passed time wait until the next iteration.
+ * Returns amount of run timers, or negative value returned by a callback.
+ */
+static int pollen_internal_virtual_timers_run(struct pollen_loop *loop, uint64_t *trace_ns) {
+    (void)trace_ns;
+
+    struct pollen_ll batch;
+    pollen_ll_init(&batch);
+    while (pollen_internal_virtual_timers_expired(loop)) {
+        struct pollen_ll *link = loop->virtual_timers.next;
+        pollen_ll_remove(link);
+        pollen_ll_insert(batch.prev, link);
+    }
+
+    int fired = 0;
+    while (!pollen_ll_is_empty(&batch)) {
+        struct pollen_callback *timer = POLLEN_CONTAINER_OF(batch.next, timer, link);
+        const uint64_t deadline_ns = timer->as.timer.deadline_ns;
+        const uint64_t period_ns = timer->as.timer.period_ns;
+        const int tfd = timer->fd;
+        (void)tfd;
+
+        pollen_ll_remove(&timer->link);
+        timer->as.timer.virtual_armed = false;
+
+        /* same as timerfd, periodic timer that missed several periods fires once */
+        uint64_t expirations = 1;
+        if (period_ns != 0) {
+            expirations += (loop->now_ns - deadline_ns) / period_ns;
+            pollen_internal_virtual_timer_arm(timer, deadline_ns + expirations * period_ns,
+                                              period_ns);
+        }
+
+        POLLEN_LOG_DEBUG("virtual timer with tfd %d expired %lu times", tfd, expirations);
+        POLLEN_USDT_PROBE2(timer_expire, tfd, expirations);
+
+        POLLEN_USDT_PROBE2(callback_start, POLLEN_CALLBACK_TYPE_TIMER, tfd);
+        pollen_internal_record(loop, timer, 0, expirations);
+        const int ret = timer->fn.timer(timer, timer->data);
+        POLLEN_USDT_PROBE3(callback_end, POLLEN_CALLBACK_TYPE_TIMER, tfd, ret);
+
+#if !defined(POLLEN_NO_TRACE)
+        if (loop->trace_records != NULL) {
+            const uint64_t end_ns = pollen_internal_clock_ns();
+            pollen_internal_trace(loop, POLLEN_TRACE_DISPATCH, POLLEN_CALLBACK_TYPE_TIMER, tfd,
+                                  EPOLLIN, *trace_ns, end_ns);
+            *trace_ns = end_ns;
+        }
+#endif
+
+        if (ret < 0) {
+            /* the rest are still due */
+            while (!pollen_ll_is_empty(&batch)) {
+                struct pollen_callback *rest = POLLEN_CONTAINER_OF(batch.next, rest, link);
+                pollen_ll_remove(&rest->link);
+                rest->as.timer.virtual_armed = false;
+                pollen_internal_virtual_timer_arm(rest, rest->as.timer.deadline_ns,
+                                                  rest->as.timer.period_ns);
+            }
+            return ret;
+        }
+
+        fired += 1;
+    }
+
+    return fired;
+}
+#endif /* #if !defined(POLLEN_NO_TIMERS) */
+
+#if !defined(POLLEN_NO_METRICS)
+/* Updates counters after an iteration and copies them to the shared page. */
+static void pollen_internal_metrics_publish(struct pollen_loop *loop, int number_fds,
+                                            uint64_t busy_ns) {
+    struct pollen_metrics *metrics = &loop->metrics;
+
+    metrics->iterations += 1;
+    metrics->events += number_fds;
+    metrics->last_events = number_fds;
+    metrics->busy_ns += busy_ns;
+    if (busy_ns > metrics->max_busy_ns) {
+        metrics->max_busy_ns = busy_ns;
+    }
+    metrics->fds = loop->fds_count;
+#if !defined(POLLEN_NO_TIMERS)
+    metrics->timeouts = loop->timeout_count;
+#endif
+#if !defined(POLLEN_NO_ASYNC_CLOSE)
+    metrics->pending_closes = pollen_loop_get_pending_closes(loop);
+#endif
+
+    /* seqlock: readers retry if seq is odd or changed while they were copying */
+    const uint64_t seq = metrics->seq;
+    __atomic_store_n(&loop->metrics_page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)loop->metrics_page + offsetof(struct pollen_metrics, iterations),
+           (char *)metrics + offsetof(struct pollen_metrics, iterations),
+           sizeof(*metrics) - offsetof(struct pollen_metrics, iterations));
+    metrics->seq = seq + 2;
+    __atomic_store_n(&loop->metrics_page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+#endif /* #if !defined(POLLEN_NO_METRICS) */
+
+bool pollen_loop_defer(struct pollen_loop *loop, pollen_defer_fn fn, void *data) {
+    if (loop->deferred_tail - loop->deferred_head > loop->deferred_mask) {
+        const uint32_t capacity = loop->deferred_mask + 1;
+        const uint32_t new_capacity = capacity * 2;
+
+        POLLEN_LOG_DEBUG("growing deferred task ring from %u to %u", capacity, new_capacity);
+
+        struct pollen_deferred *new_deferred = POLLEN_CALLOC(new_capacity, sizeof(*new_deferred));
+        if (new_deferred == NULL) {
+            POLLEN_LOG_ERR("failed to allocate memory for deferred tasks: %s", strerror(errno));
+            return false;
+        }
+        /* counters stay as they are, only positions in the ring move */
+        for (uint32_t i = loop->deferred_head; i != loop->deferred_tail; i++) {
+            new_deferred[i & (new_capacity - 1)] = loop->deferred[i & loop->deferred_mask];
+        }
+        POLLEN_FREE(loop->deferred);
+        loop->deferred = new_deferred;
+        loop->deferred_mask = new_capacity - 1;
+    }
+
+    struct pollen_deferred *task = &loop->deferred[loop->deferred_tail & loop->deferred_mask];
+    task->fn = fn;
+    task->data = data;
+    loop->deferred_tail += 1;
+
+    return true;
+}
+
+/*
+ * Runs tasks queued before this call, ones queued by them wait until the next call.
+ * Returns negative value returned by a task, or 0. Tasks after the failed one stay queued.
+ */
+static int pollen_internal_deferred_run(struct pollen_loop *loop) {
+    const uint32_t end = loop->deferred_tail;
+
+    POLLEN_LOG_DEBUG("running %u deferred tasks", end - loop->deferred_head);
+
+#if !defined(POLLEN_NO_TRACE)
+    if (loop->record_out != NULL) {
+        pollen_internal_record_write(loop, POLLEN_RECORD_DEFERRED,
+                                     end - loop->deferred_head, 0);
+    }
+#endif
+
+    while (loop->deferred_head != end) {
+        /* ring might grow while the task runs */
+        const struct pollen_deferred task =
+            loop->deferred[loop->deferred_head & loop->deferred_mask];
+        loop->deferred_head += 1;
+
+        const int ret = task.fn(loop, task.data);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Waits up to timeout_ns (negative means forever) for events, dispatches them,
+ * then runs idle callbacks.
+ * Returns amount of received events, or negative value on error or if any of the callbacks
+ * returned negative value. In this case, loop->retcode is also set.
+ */
+static int pollen_internal_iterate(struct pollen_loop *loop, int64_t timeout_ns) {
+    int ret = 0;
+    int number_fds = -1;
+
+    /* tasks deferred after fd dispatch of the previous iteration */
+    if (loop->deferred_head != loop->deferred_tail) {
+        timeout_ns = 0;
+    }
+
+#if !defined(POLLEN_NO_EFDS)
+    /* loops can be nested, so restore whatever was there before */
+    struct pollen_loop *const prev_loop = pollen_internal_current_loop;
+    pollen_internal_current_loop = loop;
+
+    /* efds triggered by efd callbacks at the end of previous iteration are still pending */
+    if (!pollen_ll_is_empty(&loop->efd_pending)) {
+        timeout_ns = 0;
+    }
+#endif
+
+#if !defined(POLLEN_NO_TIMERS)
+    /* instead of blocking, check for events and jump to the next deadline if there are none */
+    bool advance_virtual_time = false;
+    const int64_t wait_ns = timeout_ns;
+    if (loop->virtual_time) {
+        if (pollen_internal_virtual_timers_expired(loop)) {
+            timeout_ns = 0;
+        } else if (loop->virtual_auto_advance && timeout_ns != 0 &&
+                   (timeout_ns > 0 || !pollen_ll_is_empty(&loop->virtual_timers))) {
+            advance_virtual_time = true;
+            timeout_ns = 0;
+        }
+    }
+#endif
+
+#if !defined(POLLEN_NO_GROUPS)
+    /* steal instead of blocking if other loops of the group have work */
+    if (loop->group_member != NULL &&
+        pollen_internal_group_before_wait(loop->group_member, timeout_ns != 0)) {
+        timeout_ns = 0;
+    }
+#endif
+
+    const int timeout_ms = pollen_internal_timeout_ms(timeout_ns);
+
+#if !defined(POLLEN_NO_TRACE)
+    const uint64_t wait_start_ns = (loop->trace_records != NULL) ? pollen_internal_clock_ns() : 0;
+#endif
+#if !defined(POLLEN_NO_METRICS)
+    const uint64_t metrics_wait_ns = (loop->metrics_page != NULL) ? pollen_internal_clock_ns() : 0;
+    uint64_t metrics_wakeup_ns = 0;
+#endif
+
+    do {
+        number_fds = epoll_wait(loop->epoll_fd, loop->events, POLLEN_EPOLL_MAX_EVENTS, timeout_ms);
+        /* epoll_wait failing with EINTR is normal. Only retry if there's no timeout to respect */
+    } while (number_fds == -1 && errno == EINTR && timeout_ms < 0);
+
+    if (number_fds == -1) {
+        if (errno == EINTR) {
+            number_fds = 0;
+        } else {
+            ret = errno;
+            POLLEN_LOG_ERR("epoll_wait error (%s)", strerror(errno));
+            loop->retcode = -ret;
+#if !defined(POLLEN_NO_GROUPS)
+            if (loop->group_member != NULL) {
+                atomic_store_explicit(&loop->group_member->sleeping, false, memory_order_relaxed);
+            }
+#endif
+#if !defined(POLLEN_NO_EFDS)
+            pollen_internal_current_loop = prev_loop;
+#endif
+            return -ret;
+        }
+    }
+
+    pollen_internal_update_time(loop);
+#if !defined(POLLEN_NO_GROUPS)
+    if (loop->group_member != NULL) {
+        atomic_store_explicit(&loop->group_member->sleeping, false, memory_order_relaxed);
+    }
+#endif
+#if !defined(POLLEN_NO_METRICS)
+    if (loop->metrics_page != NULL) {
+        metrics_wakeup_ns = pollen_internal_clock_ns();
+        loop->metrics.wait_ns += metrics_wakeup_ns - metrics_wait_ns;
+    }
+#endif
+#if !defined(POLLEN_NO_TIMERS)
+    if (advance_virtual_time && number_fds == 0) {
+        /* timeout_ns was overwritten, so take the wait from the original deadline */
+        uint64_t next_ns = UINT64_MAX;
+        if (!pollen_ll_is_empty(&loop->virtual_timers)) {
+            struct pollen_callback *first =
+                POLLEN_CONTAINER_OF(loop->virtual_timers.next, first, link);
+            next_ns = first->as.timer.deadline_ns;
+        }
+        if (wait_ns >= 0 && loop->now_ns + wait_ns < next_ns) {
+            next_ns = loop->now_ns + wait_ns;
+        }
+        POLLEN_LOG_DEBUG("advancing virtual time by %lu ns", next_ns - loop->now_ns);
+        loop->now_ns = next_ns;
+    }
+#endif
+    loop->dispatching = true;
+
+    POLLEN_LOG_DEBUG("received events on %d fds", number_fds);
+    POLLEN_USDT_PROBE1(wakeup, number_fds);
+
+#if !defined(POLLEN_NO_TRACE)
+    if (loop->record_out != NULL) {
+        pollen_internal_record_write(loop, 0, number_fds, loop->now_ns);
+    }
+#endif
+
+#if !defined(POLLEN_NO_TRACE)
+    /* end of the previous traced span is the start of the next one.
+     * Loop time is not used here because POLLEN_CLOCK might be a coarse clock. */
+    uint64_t trace_ns = 0;
+    if (loop->trace_records != NULL) {
+        trace_ns = pollen_internal_clock_ns();
+        if (wait_start_ns != 0) {
+            pollen_internal_trace(loop, POLLEN_TRACE_WAIT, 0, number_fds, 0,
+                                  wait_start_ns, trace_ns);
+        }
+    }
+#endif
+
+    for (int n = 0; n < number_fds; n++) {
+        struct pollen_callback *callback = loop->events[n].data.ptr;
+        if (callback->dead) {
+            POLLEN_LOG_DEBUG("skipping event for removed callback");
+            continue;
+        }
+
+        /* callback might remove itself, so save these before running it */
+        const int fd = callback->fd;
+        const uint8_t type = callback->type;
+        (void)fd;
+        (void)type;
+
+        POLLEN_USDT_PROBE2(callback_start, type, fd);
+        ret = callback->dispatch(loop, callback, loop->events[n].events);
+        POLLEN_USDT_PROBE3(callback_end, type, fd, ret);
+
+#if !defined(POLLEN_NO_TRACE)
+        if (loop->trace_records != NULL) {
+            const uint64_t end_ns = pollen_internal_clock_ns();
+            pollen_internal_trace(loop, POLLEN_TRACE_DISPATCH, type, fd,
+                                  loop->events[n].events, trace_ns, end_ns);
+            trace_ns = end_ns;
+        }
+#endif
+
+        if (ret < 0) {
+            POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+            loop->retcode = ret;
+            goto out;
+        }
+    }
+
+    if (loop->ready_fd_batches != NULL) {
+        ret = pollen_internal_fd_batches_run(loop);
+
+#if !defined(POLLEN_NO_TRACE)
+        if (loop->trace_records != NULL) {
+            const uint64_t end_ns = pollen_internal_clock_ns();
+            pollen_internal_trace(loop, POLLEN_TRACE_BATCH, POLLEN_CALLBACK_TYPE_FD, number_fds, 0,
+                                  trace_ns, end_ns);
+            trace_ns = end_ns;
+        }
+#endif
+
+        if (ret < 0) {
+            POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+            loop->retcode = ret;
+            goto out;
+        }
+    }
+
+    if (loop->deferred_head != loop->deferred_tail) {
+#if !defined(POLLEN_NO_TRACE)
+        const uint32_t n_deferred = loop->deferred_tail - loop->deferred_head;
+#endif
+        ret = pollen_internal_deferred_run(loop);
+
+#if !defined(POLLEN_NO_TRACE)
+        if (loop->trace_records != NULL) {
+            const uint64_t end_ns = pollen_internal_clock_ns();
+            pollen_internal_trace(loop, POLLEN_TRACE_DEFERRED, 0, n_deferred, 0,
+                                  trace_ns, end_ns);
+            trace_ns = end_ns;
+        }
+#endif
+
+        if (ret < 0) {
+            POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+            loop->retcode = ret;
+            goto out;
+        }
+    }
+
+#if !defined(POLLEN_NO_GROUPS)
+    if (loop->group_member != NULL) {
+        ret = pollen_internal_group_run(loop, loop->group_member);
+
+#if !defined(POLLEN_NO_TRACE)
+        if (ret > 0 && loop->trace_records != NULL) {
+            const uint64_t end_ns = pollen_internal_clock_ns();
+            pollen_internal_trace(loop, POLLEN_TRACE_TASKS, 0, ret, 0, trace_ns, end_ns);
+            trace_ns = end_ns;
+        }
+#endif
+
+        if (ret < 0) {
+            POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+            loop->retcode = ret;
+            goto out;
+        }
+    }
+#endif
+
+#if !defined(POLLEN_NO_TIMERS)
+    if (loop->virtual_time) {
+#if !defined(POLLEN_NO_TRACE)
+        ret = pollen_internal_virtual_timers_run(loop, &trace_ns);
+#else
+        ret = pollen_internal_virtual_timers_run(loop, NULL);
+#endif
+        if (ret < 0) {
+            POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+            loop->retcode = ret;
+            goto out;
+        }
+        number_fds += ret;
+    }
+#endif
+
+#if !defined(POLLEN_NO_IDLE)
+    /* process unconditional callbacks */
+    struct pollen_callback *callback, *callback_tmp;
+    POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->idle_callbacks_list, link) {
+        /* removed callbacks are unlinked but not freed, so their next pointers stay valid */
+        if (callback->dead) {
+            continue;
+        }
+
+        POLLEN_LOG_DEBUG("running unconditional callback with prio %d",
+                         callback->as.idle.priority);
+
+        POLLEN_USDT_PROBE2(callback_start, POLLEN_CALLBACK_TYPE_IDLE, -1);
+        pollen_internal_record(loop, callback, 0, 0);
+        ret = callback->fn.idle(callback, callback->data);
+        POLLEN_USDT_PROBE3(callback_end, POLLEN_CALLBACK_TYPE_IDLE, -1, ret);
+
+#if !defined(POLLEN_NO_TRACE)
+        if (loop->trace_records != NULL) {
+            const uint64_t end_ns = pollen_internal_clock_ns();
+            pollen_internal_trace(loop, POLLEN_TRACE_IDLE, POLLEN_CALLBACK_TYPE_IDLE,
+                                  callback->as.idle.priority, 0, trace_ns, end_ns);
+            trace_ns = end_ns;
+        }
+#endif
+
+        if (ret < 0) {
+            POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+            loop->retcode = ret;
+            goto out;
+        }
+    }
+#endif
+
+#if !defined(POLLEN_NO_EFDS)
+    /* process efds triggered from this thread. Ones triggered while doing that wait until
+     * the next iteration, so callbacks that keep triggering each other can't hang the loop */
+    if (!pollen_ll_is_empty(&loop->efd_pending)) {
+        struct pollen_ll batch;
+        pollen_ll_move(&batch, &loop->efd_pending);
+
+        while (!pollen_ll_is_empty(&batch)) {
+            struct pollen_callback *efd_callback =
+                POLLEN_CONTAINER_OF(batch.next, efd_callback, link);
+            const int fd = efd_callback->fd;
+            (void)fd;
+
+            POLLEN_LOG_DEBUG("running pending callback for efd %d", fd);
+
+            POLLEN_USDT_PROBE2(callback_start, POLLEN_CALLBACK_TYPE_EFD, fd);
+            ret = pollen_internal_efd_run(efd_callback);
+            POLLEN_USDT_PROBE3(callback_end, POLLEN_CALLBACK_TYPE_EFD, fd, ret);
+
+#if !defined(POLLEN_NO_TRACE)
+            if (loop->trace_records != NULL) {
+                const uint64_t end_ns = pollen_internal_clock_ns();
+                pollen_internal_trace(loop, POLLEN_TRACE_DISPATCH, POLLEN_CALLBACK_TYPE_EFD, fd,
+                                      EPOLLIN, trace_ns, end_ns);
+                trace_ns = end_ns;
+            }
+#endif
+
+            if (ret < 0) {
+                POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+                loop->retcode = ret;
+                /* put the rest back, they are still pending */
+                while (!pollen_ll_is_empty(&batch)) {
+                    struct pollen_ll *link = batch.next;
+                    pollen_ll_remove(link);
+                    pollen_ll_insert(loop->efd_pending.prev, link);
+                }
+                goto out;
+            }
+        }
+    }
+#endif
+
+    ret = number_fds;
+
+out:
+    loop->dispatching = false;
+    pollen_internal_reclaim_dead(loop);
+#if !defined(POLLEN_NO_EFDS)
+    pollen_internal_current_loop = prev_loop;
+#endif
+#if !defined(POLLEN_NO_METRICS)
+    /* metrics might have been started by a callback */
+    if (loop->metrics_page != NULL && metrics_wakeup_ns != 0) {
+        pollen_internal_metrics_publish(loop, number_fds, pollen_internal_clock_ns() - metrics_wakeup_ns);
+    }
+#endif
+
+    return ret;
+}
+
+int pollen_loop_run(struct pollen_loop *loop) {
+    POLLEN_LOG_INFO("running event loop");
+
+    loop->should_quit = false;
+    while (!loop->should_quit) {
+        if (pollen_internal_iterate(loop, -1) < 0) {
+            break;
+        }
+    }
+
+    return loop->retcode;
+}
 
-    return true;
+int pollen_loop_run_for(struct pollen_loop *loop, uint64_t duration_ns) {
+    POLLEN_LOG_INFO("running event loop for %lu ns", duration_ns);
 
-err:
-    errno = save_errno;
-    return false;
+    pollen_internal_update_time(loop);
+    const uint64_t deadline = loop->now_ns + duration_ns;
+
+    loop->should_quit = false;
+    loop->retcode = 0;
+    while (!loop->should_quit && loop->now_ns < deadline) {
+        if (pollen_internal_iterate(loop, deadline - loop->now_ns) < 0) {
+            break;
+        }
+    }
+
+    return loop->retcode;
 }
 
-struct pollen_callback *pollen_loop_add_efd(struct pollen_loop *loop,
-                                            pollen_efd_callback_fn callback,
-                                            void *data) {
-    struct pollen_callback *new_callback = NULL;
-    int save_errno = 0;
+#if !defined(POLLEN_NO_EFDS)
+static int pollen_internal_dispatch_wake(struct pollen_callback *callback, uint64_t val,
+                                         void *data) {
+    /* only here to make epoll fd readable, leftover work runs in the iteration anyway */
+    return 0;
+}
 
-    POLLEN_LOG_INFO("adding efd callback to event loop");
+/* Returns efd whose write makes epoll fd readable, or NULL if there is nothing left to run. */
+static struct pollen_callback *pollen_internal_dispatch_wake_efd(struct pollen_loop *loop) {
+    struct pollen_callback *callback;
+    if (!pollen_ll_is_empty(&loop->efd_pending)) {
+        return POLLEN_CONTAINER_OF(loop->efd_pending.next, callback, link);
+    }
 
-    int efd = eventfd(0, EFD_CLOEXEC);
-    if (efd < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to create eventfd: %s", strerror(errno));
-        goto err;
+    bool pending = loop->deferred_head != loop->deferred_tail;
+#if !defined(POLLEN_NO_GROUPS)
+    pending = pending ||
+              (loop->group_member != NULL && pollen_internal_group_has_tasks(loop->group_member));
+#endif
+    if (!pending) {
+        return NULL;
     }
 
-    new_callback = POLLEN_CALLOC(1, sizeof(*new_callback));
-    if (new_callback == NULL) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to allocate memory for callback: %s", strerror(errno));
-        goto err;
+    if (loop->dispatch_wake == NULL) {
+        loop->dispatch_wake = pollen_loop_add_efd(loop, pollen_internal_dispatch_wake, NULL);
+        if (loop->dispatch_wake == NULL) {
+            POLLEN_LOG_WARN("failed to add efd for waking up loop: %s", strerror(errno));
+        }
     }
-    new_callback->loop = loop;
-    new_callback->type = POLLEN_CALLBACK_TYPE_EFD;
-    new_callback->as.efd.efd = efd;
-    new_callback->as.efd.callback = callback;
-    new_callback->data = data;
+    return loop->dispatch_wake;
+}
+#endif
 
-    struct epoll_event epoll_event;
-    epoll_event.events = EPOLLIN;
-    epoll_event.data.ptr = new_callback;
-    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, efd, &epoll_event) < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to add efd %d to epoll: %s", efd, strerror(errno));
-        goto err;
+int pollen_loop_dispatch(struct pollen_loop *loop, int64_t timeout_ns) {
+    const int ret = pollen_internal_iterate(loop, timeout_ns);
+
+#if !defined(POLLEN_NO_EFDS)
+    /* outer loop only calls us again when epoll fd is readable, so make it readable */
+    struct pollen_callback *callback = pollen_internal_dispatch_wake_efd(loop);
+    if (callback != NULL) {
+        const uint64_t one = 1;
+        if (write(callback->fd, &one, sizeof(one)) < 0) {
+            POLLEN_LOG_WARN("failed to wake up loop via efd %d: %s",
+                            callback->fd, strerror(errno));
+        }
     }
+#endif
 
-    pollen_ll_insert(&loop->efd_callbacks_list, &new_callback->link);
+    return ret;
+}
 
-    return new_callback;
+int pollen_loop_get_fd(struct pollen_loop *loop) {
+    return loop->epoll_fd;
+}
 
-err:
-    POLLEN_FREE(new_callback);
-    errno = save_errno;
-    return NULL;
+uint64_t pollen_loop_now(struct pollen_loop *loop) {
+    return loop->now_ns;
 }
 
-bool pollen_efd_inc(struct pollen_callback *callback, uint64_t n) {
-    int save_errno;
+uint64_t pollen_loop_update_time(struct pollen_loop *loop) {
+    pollen_internal_update_time(loop);
+    return loop->now_ns;
+}
 
-    if (callback->type != POLLEN_CALLBACK_TYPE_EFD) {
-        POLLEN_LOG_ERR("passed non-efd type callback to pollen_efd_trigger");
-        save_errno = EINVAL;
-        goto err;
+void pollen_loop_quit(struct pollen_loop *loop, int retcode) {
+    POLLEN_LOG_INFO("quitting pollen loop");
+
+    loop->should_quit = true;
+    loop->retcode = retcode;
+}
+
+#if !defined(POLLEN_NO_TRACE)
+bool pollen_loop_trace_start(struct pollen_loop *loop, size_t capacity) {
+    size_t rounded = 1;
+    while (rounded < capacity) {
+        rounded *= 2;
     }
 
-    if (write(callback->as.efd.efd, &n, sizeof(n)) < 0) {
-        save_errno = errno;
-        POLLEN_LOG_ERR("failed to write %lu to efd %d: %s",
-                       n, callback->as.efd.efd, strerror(errno));
-        goto err;
+    POLLEN_LOG_INFO("starting trace with %zu records", rounded);
+
+    struct pollen_trace_record *records = POLLEN_CALLOC(rounded, sizeof(*records));
+    if (records == NULL) {
+        POLLEN_LOG_ERR("failed to allocate memory for trace records: %s", strerror(errno));
+        return false;
     }
 
-    return true;
+    POLLEN_FREE(loop->trace_records);
+    loop->trace_records = records;
+    loop->trace_mask = rounded - 1;
+    loop->trace_head = 0;
 
-err:
-    errno = save_errno;
-    return false;
+    return true;
 }
 
-bool pollen_efd_trigger(struct pollen_callback *callback) {
-    return pollen_efd_inc(callback, 1);
+void pollen_loop_trace_stop(struct pollen_loop *loop) {
+    POLLEN_LOG_INFO("stopping trace");
+
+    POLLEN_FREE(loop->trace_records);
+    loop->trace_records = NULL;
+    loop->trace_mask = 0;
+    loop->trace_head = 0;
 }
 
-void pollen_loop_remove_callback(struct pollen_callback *callback) {
-    if (callback == NULL) {
-        return;
-    }
+bool pollen_loop_trace_dump(struct pollen_loop *loop, FILE *out) {
+    static const char *const callback_names[] = {
+        [POLLEN_CALLBACK_TYPE_FD] = "fd",
+        [POLLEN_CALLBACK_TYPE_IDLE] = "idle",
+        [POLLEN_CALLBACK_TYPE_SIGNAL] = "signal",
+        [POLLEN_CALLBACK_TYPE_TIMER] = "timer",
+        [POLLEN_CALLBACK_TYPE_EFD] = "efd",
+        [POLLEN_CALLBACK_TYPE_CHANNEL] = "channel",
+        [POLLEN_CALLBACK_TYPE_DGRAM] = "dgram",
+        [POLLEN_CALLBACK_TYPE_LISTENER] = "listener",
+    };
 
-    switch (callback->type) {
-    case POLLEN_CALLBACK_TYPE_FD: {
-        int fd = callback->as.fd.fd;
+    const int pid = getpid();
+    const int tid = loop->epoll_fd;
 
-        POLLEN_LOG_INFO("removing pollable callback for fd %d from event loop", fd);
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                 "\"args\":{\"name\":\"pollen loop %d\"}}", pid, tid, tid);
 
-        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-            POLLEN_LOG_WARN("failed to remove fd %d from epoll: %s", fd, strerror(errno));
-        }
+    if (loop->trace_records != NULL) {
+        const uint64_t capacity = loop->trace_mask + 1;
+        const uint64_t first = (loop->trace_head > capacity) ? loop->trace_head - capacity : 0;
 
-        if (callback->as.fd.autoclose) {
-            POLLEN_LOG_INFO("closing fd %d", fd);
-            if (close(fd) < 0) {
-                POLLEN_LOG_WARN("closing fd %d failed: %s (was it closed somewhere else?)",
-                                    fd, strerror(errno));
-            };
-        }
-        break;
-    }
-    case POLLEN_CALLBACK_TYPE_IDLE: {
-        POLLEN_LOG_INFO("removing unconditional callback with prio %d from event loop",
-                             callback->as.idle.priority);
-        break;
-    }
-    case POLLEN_CALLBACK_TYPE_SIGNAL: {
-        int signal = callback->as.signal.sig;
-        struct pollen_loop *loop = callback->loop;
+        for (uint64_t i = first; i < loop->trace_head; i++) {
+            const struct pollen_trace_record *record = &loop->trace_records[i & loop->trace_mask];
 
-        POLLEN_LOG_INFO("removing signal callback for signal %d from event loop", signal);
+            fprintf(out, ",\n{\"cat\":\"pollen\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                         "\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,",
+                    pid, tid, record->start_ns / 1000, record->start_ns % 1000,
+                    record->duration_ns / 1000, record->duration_ns % 1000);
 
-        sigdelset(&loop->sigset, signal);
-        int ret = signalfd(loop->signal_fd, &loop->sigset, 0);
-        if (ret < 0) {
-            POLLEN_LOG_WARN("failed to remove signal %d from signalfd: %s (THIS IS VERY BAD)",
-                                signal, strerror(errno));
+            switch ((enum pollen_trace_kind)record->kind) {
+            case POLLEN_TRACE_WAIT:
+                fprintf(out, "\"name\":\"epoll_wait\",\"args\":{\"events\":%d}}",
+                        record->arg);
+                break;
+            case POLLEN_TRACE_DISPATCH:
+                fprintf(out, "\"name\":\"%s\",\"args\":{\"fd\":%d,\"events\":%u}}",
+                        callback_names[record->type], record->arg, record->events);
+                break;
+            case POLLEN_TRACE_IDLE:
+                fprintf(out, "\"name\":\"idle\",\"args\":{\"priority\":%d}}", record->arg);
+                break;
+            case POLLEN_TRACE_BATCH:
+                fprintf(out, "\"name\":\"fd batch\",\"args\":{\"events\":%d}}", record->arg);
+                break;
+            case POLLEN_TRACE_DEFERRED:
+                fprintf(out, "\"name\":\"deferred\",\"args\":{\"tasks\":%d}}", record->arg);
+                break;
+            case POLLEN_TRACE_TASKS:
+                fprintf(out, "\"name\":\"group tasks\",\"args\":{\"tasks\":%d}}", record->arg);
+                break;
+            }
         }
+    }
 
-        sigset_t set;
-        sigemptyset(&set);
-        sigaddset(&set, signal);
-        if (sigprocmask(SIG_UNBLOCK, &set, NULL) < 0) {
-            POLLEN_LOG_WARN("failed to unblock signal %d: %s (program might misbehave)",
-                                signal, strerror(errno));
-        };
+    fprintf(out, "\n]}\n");
 
-        loop->signal_callbacks[signal] = NULL;
-        break;
+    if (fflush(out) == EOF || ferror(out)) {
+        POLLEN_LOG_ERR("failed to write trace: %s", strerror(errno));
+        return false;
     }
-    case POLLEN_CALLBACK_TYPE_TIMER: {
-        int tfd = callback->as.timer.fd;
 
-        POLLEN_LOG_INFO("removing timer callback with tfd %d for from event loop", tfd);
+    return true;
+}
 
-        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, tfd, NULL) < 0) {
-            POLLEN_LOG_WARN("failed to remove tfd %d from epoll: %s", tfd, strerror(errno));
-        }
+bool pollen_loop_record_start(struct pollen_loop *loop, FILE *out) {
+    POLLEN_LOG_INFO("starting recording");
 
-        if (close(tfd) < 0) {
-            POLLEN_LOG_WARN("closing tfd %d failed: %s", tfd, strerror(errno));
-        };
-        break;
+    if (fwrite(POLLEN_RECORD_MAGIC, 8, 1, out) != 1) {
+        POLLEN_LOG_ERR("failed to write recording header: %s", strerror(errno));
+        return false;
     }
-    case POLLEN_CALLBACK_TYPE_EFD: {
-        int efd = callback->as.efd.efd;
-
-        POLLEN_LOG_INFO("removing efd callback for efd %d from event loop", efd);
 
-        if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_DEL, efd, NULL) < 0) {
-            POLLEN_LOG_WARN("failed to remove efd %d from epoll: %s", efd, strerror(errno));
-        }
+    loop->record_out = out;
+    return true;
+}
 
-        if (close(efd) < 0) {
-            POLLEN_LOG_WARN("closing efd %d failed: %s", efd, strerror(errno));
-        };
-        break;
-    }
+void pollen_loop_record_stop(struct pollen_loop *loop) {
+    if (loop->record_out == NULL) {
+        return;
     }
 
-    pollen_ll_remove(&callback->link);
+    POLLEN_LOG_INFO("stopping recording");
 
-    POLLEN_FREE(callback);
+    if (fflush(loop->record_out) == EOF) {
+        POLLEN_LOG_WARN("failed to flush recording: %s", strerror(errno));
+    }
+    loop->record_out = NULL;
 }
 
-struct pollen_loop *pollen_callback_get_loop(struct pollen_callback *callback) {
-    return callback->loop;
+/* Returns batch that recorded callback belongs to, NULL if it is not a batched fd callback. */
+static struct pollen_fd_batch *pollen_internal_replay_batch(struct pollen_loop *loop,
+                                                           const struct pollen_record *record) {
+    struct pollen_callback *callback =
+        (record->id < loop->replay_capacity) ? loop->replay_callbacks[record->id] : NULL;
+    if (callback == NULL || callback->dead || callback->type != POLLEN_CALLBACK_TYPE_FD) {
+        return NULL;
+    }
+    return callback->as.fd.batch;
 }
 
-int pollen_loop_run(struct pollen_loop *loop) {
-    POLLEN_LOG_INFO("running event loop");
+/* Runs one recorded callback. Returns whatever the callback returned. */
+static int pollen_internal_replay_one(struct pollen_loop *loop, const struct pollen_record *record) {
+    struct pollen_callback *callback =
+        (record->id < loop->replay_capacity) ? loop->replay_callbacks[record->id] : NULL;
+    if (callback == NULL || callback->dead) {
+        POLLEN_LOG_DEBUG("callback with id %u is gone, skipping", record->id);
+        return 0;
+    }
+
+    const int fd = callback->fd;
+    const uint8_t type = callback->type;
+    (void)fd;
 
     int ret = 0;
-    int number_fds = -1;
-    static struct epoll_event events[POLLEN_EPOLL_MAX_EVENTS];
+    POLLEN_USDT_PROBE2(callback_start, type, fd);
+    switch (type) {
+    case POLLEN_CALLBACK_TYPE_IDLE:
+        ret = callback->fn.idle(callback, callback->data);
+        break;
+    case POLLEN_CALLBACK_TYPE_FD:
+#if !defined(POLLEN_NO_TIMERS)
+        callback->last_active_ns = loop->now_ns;
+#endif
+        if (callback->as.fd.batch != NULL) {
+            /* runs once the whole batch is collected, see pollen_loop_replay */
+            pollen_internal_fd_batch_push(loop, callback, record->events);
+            break;
+        }
+        ret = callback->fn.fd(callback, fd, record->events, callback->data);
+        break;
+    case POLLEN_CALLBACK_TYPE_SIGNAL:
+        ret = callback->fn.signal(callback, (int)record->value, callback->data);
+        break;
+    case POLLEN_CALLBACK_TYPE_TIMER:
+        ret = callback->fn.timer(callback, callback->data);
+        break;
+    case POLLEN_CALLBACK_TYPE_EFD:
+        ret = callback->fn.efd(callback, record->value, callback->data);
+        break;
+    default:
+        POLLEN_LOG_WARN("callback with id %u has type %d, which can't be replayed",
+                        record->id, type);
+        break;
+    }
+    POLLEN_USDT_PROBE3(callback_end, type, fd, ret);
 
-    loop->should_quit = false;
-    while (!loop->should_quit) {
-        do {
-            number_fds = epoll_wait(loop->epoll_fd, events, POLLEN_EPOLL_MAX_EVENTS, -1);
-        } while (number_fds == -1 && errno == EINTR); /* epoll_wait failing with EINTR is normal */
+    return ret;
+}
 
-        if (number_fds == -1) {
-            ret = errno;
-            POLLEN_LOG_ERR("epoll_wait error (%s)", strerror(errno));
-            loop->retcode = -ret;
-            goto out;
+/* Registers callbacks that exist before replay starts, the rest get registered when added. */
+static bool pollen_internal_replay_setup(struct pollen_loop *loop) {
+    for (int fd = 0; fd < loop->fds_capacity; fd++) {
+        if (loop->fds[fd] != NULL && !pollen_internal_replay_register(loop, loop->fds[fd])) {
+            return false;
         }
+    }
 
-        POLLEN_LOG_DEBUG("received events on %d fds", number_fds);
+#if !defined(POLLEN_NO_IDLE)
+    struct pollen_callback *idle;
+    POLLEN_LL_FOR_EACH(idle, &loop->idle_callbacks_list, link) {
+        if (!pollen_internal_replay_register(loop, idle)) {
+            return false;
+        }
+    }
+#endif
 
-        for (int n = 0; n < number_fds; n++) {
-            struct pollen_callback *callback = events[n].data.ptr;
+#if !defined(POLLEN_NO_SIGNALS)
+    for (size_t i = 0; i < sizeof(loop->signal_callbacks) / sizeof(loop->signal_callbacks[0]); i++) {
+        struct pollen_callback *callback = loop->signal_callbacks[i];
+        if (callback != NULL && !pollen_internal_replay_register(loop, callback)) {
+            return false;
+        }
+    }
+#endif
 
-            switch (callback->type) {
-            case POLLEN_CALLBACK_TYPE_FD:
-                POLLEN_LOG_DEBUG("running callback for fd %d", callback->as.fd.fd);
-                ret = callback->as.fd.callback(callback, callback->as.fd.fd,
-                                               events[n].events, callback->data);
-                break;
-            case POLLEN_CALLBACK_TYPE_TIMER:
-                POLLEN_LOG_DEBUG("running callback for timer on tfd %d", callback->as.timer.fd);
+    return true;
+}
 
-                /* drain the timer fd */
-                uint64_t dummy;
-                while ((ret = read(callback->as.timer.fd, &dummy, sizeof(dummy))) > 0) {
-                    /* no-op */
-                }
-                if (ret < 0 && errno != EAGAIN) {
-                    POLLEN_LOG_ERR("failed to read from timerfd %d: %s",
-                                   callback->as.timer.fd, strerror(errno));
-                    loop->retcode = ret;
-                    goto out;
-                }
+int pollen_loop_replay(struct pollen_loop *loop, FILE *in) {
+    POLLEN_LOG_INFO("replaying recording");
 
-                ret = callback->as.timer.callback(callback, callback->data);
-                break;
-            case POLLEN_CALLBACK_TYPE_SIGNAL:
-                POLLEN_LOG_DEBUG("running internal signals handler");
+    char magic[8];
+    if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, POLLEN_RECORD_MAGIC, 8) != 0) {
+        POLLEN_LOG_ERR("input is not a pollen recording");
+        return -EINVAL;
+    }
 
-                ret = callback->as.signal.callback(callback, 0xDEAD, NULL);
-                break;
-            case POLLEN_CALLBACK_TYPE_EFD:
-                POLLEN_LOG_DEBUG("running callback for efd %d", callback->as.efd.efd);
-
-                uint64_t efd_val;
-                if (read(callback->as.efd.efd, &efd_val, sizeof(efd_val)) < 0) {
-                    POLLEN_LOG_ERR("failed to read from efd %d: %s",
-                                   callback->as.efd.efd, strerror(errno));
-                    loop->retcode = -1;
-                    goto out;
-                }
+    if (!pollen_internal_replay_setup(loop)) {
+        const int save_errno = errno;
+        POLLEN_FREE(loop->replay_callbacks);
+        loop->replay_callbacks = NULL;
+        loop->replay_capacity = 0;
+        return -save_errno;
+    }
+    loop->replaying = true;
+    loop->should_quit = false;
+    loop->retcode = 0;
+#if !defined(POLLEN_NO_EFDS)
+    /* replayed callbacks run on this thread, same as when the loop iterates */
+    struct pollen_loop *const prev_loop = pollen_internal_current_loop;
+    pollen_internal_current_loop = loop;
+#endif
 
-                ret = callback->as.efd.callback(callback, efd_val, callback->data);
-                break;
-            default:
-                POLLEN_LOG_ERR("got invalid callback type from epoll");
-                loop->retcode = -1;
-                goto out;
-            }
+    int ret = 0;
+    struct pollen_record record;
+    size_t n = fread(&record, sizeof(record), 1, in);
+    while (n == 1 && !loop->should_quit) {
+        if (record.id != 0) {
+            POLLEN_LOG_ERR("recording does not start with an iteration");
+            loop->retcode = -EINVAL;
+            goto out;
+        }
 
+        loop->now_ns = record.value;
+        loop->dispatching = true;
+
+        /* everything up to the next iteration. Events of a batch are recorded together
+         * when it runs, so the batch runs as soon as they are over. A batch never gets more
+         * events than one epoll_wait returns, so longer runs come from a broken recording */
+        while ((n = fread(&record, sizeof(record), 1, in)) == 1 && record.id != 0) {
+            struct pollen_fd_batch *pending = loop->ready_fd_batches;
+            if (pending != NULL && (pending->count == POLLEN_EPOLL_MAX_EVENTS ||
+                                    pollen_internal_replay_batch(loop, &record) != pending)) {
+                ret = pollen_internal_fd_batches_run(loop);
+            }
+            if (ret >= 0 && record.id == POLLEN_RECORD_DEFERRED) {
+                ret = pollen_internal_deferred_run(loop);
+            } else if (ret >= 0) {
+                ret = pollen_internal_replay_one(loop, &record);
+            }
             if (ret < 0) {
                 POLLEN_LOG_ERR("callback returned %d, quitting", ret);
                 loop->retcode = ret;
                 goto out;
             }
         }
+        ret = pollen_internal_fd_batches_run(loop);
+        if (ret < 0) {
+            POLLEN_LOG_ERR("callback returned %d, quitting", ret);
+            loop->retcode = ret;
+            goto out;
+        }
 
-        /* process unconditional callbacks */
-        struct pollen_callback *callback, *callback_tmp;
-        POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->idle_callbacks_list, link) {
-            POLLEN_LOG_DEBUG("running unconditional callback with prio %d",
-                             callback->as.idle.priority);
+        loop->dispatching = false;
+        pollen_internal_reclaim_dead(loop);
+    }
 
-            ret = callback->as.idle.callback(callback, callback->data);
-            if (ret < 0) {
-                POLLEN_LOG_ERR("callback returned %d, quitting", ret);
-                loop->retcode = ret;
-                goto out;
-            }
-        }
+    if (ferror(in)) {
+        POLLEN_LOG_ERR("failed to read recording");
+        loop->retcode = -EIO;
     }
 
 out:
+#if !defined(POLLEN_NO_EFDS)
+    pollen_internal_current_loop = prev_loop;
+#endif
+    loop->dispatching = false;
+    pollen_internal_reclaim_dead(loop);
+    loop->replaying = false;
+    POLLEN_FREE(loop->replay_callbacks);
+    loop->replay_callbacks = NULL;
+    loop->replay_capacity = 0;
+
     return loop->retcode;
 }
+#endif /* #if !defined(POLLEN_NO_TRACE) */
 
-void pollen_loop_quit(struct pollen_loop *loop, int retcode) {
-    POLLEN_LOG_INFO("quitting pollen loop");
+#if !defined(POLLEN_NO_METRICS)
+int pollen_loop_metrics_start(struct pollen_loop *loop) {
+    int save_errno = 0;
+    int fd = -1;
 
-    loop->should_quit = true;
-    loop->retcode = retcode;
+    if (loop->metrics_page != NULL) {
+        return loop->metrics_fd;
+    }
+
+    POLLEN_LOG_INFO("starting to publish metrics");
+
+    fd = memfd_create("pollen-metrics", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to create memfd: %s", strerror(errno));
+        goto err;
+    }
+
+    if (ftruncate(fd, sizeof(struct pollen_metrics)) < 0) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to resize memfd: %s", strerror(errno));
+        goto err;
+    }
+
+    /* readers can't be killed by SIGBUS if the size can't change */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        POLLEN_LOG_WARN("failed to seal memfd: %s", strerror(errno));
+    }
+
+    void *page = mmap(NULL, sizeof(struct pollen_metrics), PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (page == MAP_FAILED) {
+        save_errno = errno;
+        POLLEN_LOG_ERR("failed to map memfd: %s", strerror(errno));
+        goto err;
+    }
+
+    loop->metrics.magic = POLLEN_METRICS_MAGIC;
+    memcpy(page, &loop->metrics, sizeof(loop->metrics));
+    loop->metrics_page = page;
+    loop->metrics_fd = fd;
+
+    return fd;
+
+err:
+    if (fd >= 0) {
+        close(fd);
+    }
+    errno = save_errno;
+    return -1;
+}
+
+void pollen_loop_metrics_stop(struct pollen_loop *loop) {
+    if (loop->metrics_page == NULL) {
+        return;
+    }
+
+    POLLEN_LOG_INFO("stopping to publish metrics");
+
+    munmap(loop->metrics_page, sizeof(struct pollen_metrics));
+    close(loop->metrics_fd);
+    loop->metrics_page = NULL;
+    loop->metrics_fd = -1;
+}
+
+bool pollen_metrics_read(const struct pollen_metrics *page, struct pollen_metrics *out) {
+    if (page->magic != POLLEN_METRICS_MAGIC) {
+        errno = EINVAL;
+        return false;
+    }
+
+    /* updates are short, so the writer being stuck mid update means it's gone */
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        const uint64_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(out, page, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+            out->seq = seq;
+            return true;
+        }
+    }
+
+    errno = EAGAIN;
+    return false;
 }
+#endif /* #if !defined(POLLEN_NO_METRICS) */
 
 #endif /* #ifndef POLLEN_IMPLEMENTATION */
 
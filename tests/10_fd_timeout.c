@@ -0,0 +1,79 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+struct timespec ts_start;
+int active_efd;
+
+long elapsed_ms(void) {
+    struct timespec ts_now;
+    assert(clock_gettime(CLOCK_MONOTONIC, &ts_now) == 0);
+    return (ts_now.tv_sec - ts_start.tv_sec) * 1000 + (ts_now.tv_nsec - ts_start.tv_nsec) / 1000000;
+}
+
+int efd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    uint64_t n;
+    assert(read(fd, &n, sizeof(n)) == sizeof(n));
+    return 0;
+}
+
+int active_timeout(struct pollen_callback *callback, int fd, void *data) {
+    /* this one receives activity every 100ms, so it should never time out */
+    assert(0 && "active fd timed out");
+    return -1;
+}
+
+int idle_timeout(struct pollen_callback *callback, int fd, void *data) {
+    long elapsed = elapsed_ms();
+    fprintf(stderr, "idle fd timed out after %ld ms\n", elapsed);
+    assert(elapsed >= 500);
+    assert(elapsed < 500 + 2 * POLLEN_TIMEOUT_GRANULARITY_MS + 100);
+
+    return -69;
+}
+
+int timer_callback(struct pollen_callback *callback, void *data) {
+    uint64_t n = 1;
+    assert(write(active_efd, &n, sizeof(n)) == sizeof(n));
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *active, *idle, *timer;
+    int idle_efd;
+
+    assert(clock_gettime(CLOCK_MONOTONIC, &ts_start) == 0);
+
+    assert((active_efd = eventfd(0, EFD_NONBLOCK)) > 0);
+    assert((idle_efd = eventfd(0, EFD_NONBLOCK)) > 0);
+
+    assert((loop = pollen_loop_create()));
+    assert((active = pollen_loop_add_fd(loop, active_efd, EPOLLIN, true, efd_callback, NULL)));
+    assert((idle = pollen_loop_add_fd(loop, idle_efd, EPOLLIN, true, efd_callback, NULL)));
+
+    assert(pollen_fd_set_timeout(active, 300, active_timeout));
+    assert(pollen_fd_set_timeout(idle, 500, idle_timeout));
+
+    assert((timer = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, timer_callback, NULL)));
+    assert(pollen_timer_arm_ms(timer, false, 100, 100));
+
+    /* timeout can only be set on fd callbacks */
+    assert(!pollen_fd_set_timeout(timer, 100, idle_timeout) && errno == EINVAL);
+
+    assert(pollen_loop_run(loop) == -69);
+
+    /* disabling and removing must unlink callbacks from the wheel */
+    assert(pollen_fd_set_timeout(idle, 0, NULL));
+    pollen_loop_remove_callback(active);
+
+    pollen_loop_cleanup(loop);
+}
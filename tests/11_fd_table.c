@@ -0,0 +1,80 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_FDS 10
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    return 0;
+}
+
+int count_and_remove_odd(struct pollen_callback *callback, int fd, void *data) {
+    int *counter = data;
+    *counter += 1;
+
+    if (fd % 2 == 1) {
+        pollen_loop_remove_callback(callback);
+    }
+
+    return 0;
+}
+
+int stop_iteration(struct pollen_callback *callback, int fd, void *data) {
+    return -69;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *callbacks[N_FDS];
+    int fds[N_FDS];
+
+    assert((loop = pollen_loop_create()));
+
+    for (int i = 0; i < N_FDS; i++) {
+        assert((fds[i] = eventfd(0, EFD_NONBLOCK)) > 0);
+        assert((callbacks[i] = pollen_loop_add_fd(loop, fds[i], EPOLLIN, true,
+                                                  fd_callback, NULL)));
+    }
+
+    /* this fd is far beyond initial table size, the table must grow */
+    int high_fd = dup2(fds[0], 1000);
+    assert(high_fd == 1000);
+    struct pollen_callback *high;
+    assert((high = pollen_loop_add_fd(loop, high_fd, EPOLLIN, true, fd_callback, NULL)));
+
+    for (int i = 0; i < N_FDS; i++) {
+        assert(pollen_loop_find_fd(loop, fds[i]) == callbacks[i]);
+    }
+    assert(pollen_loop_find_fd(loop, high_fd) == high);
+    assert(pollen_loop_find_fd(loop, 999) == NULL);
+    assert(pollen_loop_find_fd(loop, 100000) == NULL);
+    assert(pollen_loop_find_fd(loop, -1) == NULL);
+
+    /* double registration must be caught without asking the kernel */
+    assert(pollen_loop_add_fd(loop, fds[3], EPOLLIN, false, fd_callback, NULL) == NULL);
+    assert(errno == EEXIST);
+    assert(pollen_loop_find_fd(loop, fds[3]) == callbacks[3]);
+
+    int counter = 0;
+    assert(pollen_loop_for_each_fd(loop, count_and_remove_odd, &counter) == 0);
+    assert(counter == N_FDS + 1);
+
+    for (int i = 0; i < N_FDS; i++) {
+        if (fds[i] % 2 == 1) {
+            assert(pollen_loop_find_fd(loop, fds[i]) == NULL);
+        } else {
+            assert(pollen_loop_find_fd(loop, fds[i]) == callbacks[i]);
+        }
+    }
+
+    assert(pollen_loop_for_each_fd(loop, stop_iteration, NULL) == -69);
+
+    pollen_loop_cleanup(loop);
+}
@@ -0,0 +1,77 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+struct pollen_callback *fd_callbacks[2];
+int fd_callbacks_ran = 0;
+struct pollen_callback *idle_victim;
+bool replacement_ran = false;
+
+int replacement_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    /* nobody writes to this fd, stale event of the removed callback must not get here */
+    replacement_ran = true;
+    return 0;
+}
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    int other = (callback == fd_callbacks[0]) ? 1 : 0;
+    fd_callbacks_ran += 1;
+
+    /* both fds are ready in the same batch, remove the other one and reuse its fd number */
+    pollen_loop_remove_callback(fd_callbacks[other]);
+
+    int efd = eventfd(0, EFD_NONBLOCK);
+    assert(efd > 0);
+    assert(pollen_loop_add_fd(pollen_callback_get_loop(callback), efd, EPOLLIN, true,
+                              replacement_callback, NULL));
+
+    /* and remove itself as well */
+    pollen_loop_remove_callback(callback);
+
+    return 0;
+}
+
+int idle_killer(struct pollen_callback *callback, void *data) {
+    pollen_loop_remove_callback(idle_victim);
+    return 0;
+}
+
+int idle_victim_callback(struct pollen_callback *callback, void *data) {
+    assert(0 && "removed idle callback ran");
+    return -1;
+}
+
+int idle_last(struct pollen_callback *callback, void *data) {
+    return -69;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+
+    assert((loop = pollen_loop_create()));
+
+    for (int i = 0; i < 2; i++) {
+        int efd;
+        assert((efd = eventfd(1, EFD_NONBLOCK)) > 0);
+        assert((fd_callbacks[i] = pollen_loop_add_fd(loop, efd, EPOLLIN, true,
+                                                     fd_callback, NULL)));
+    }
+
+    assert(pollen_loop_add_idle(loop, 3, idle_killer, NULL));
+    assert((idle_victim = pollen_loop_add_idle(loop, 2, idle_victim_callback, NULL)));
+    assert(pollen_loop_add_idle(loop, 1, idle_last, NULL));
+
+    assert(pollen_loop_run(loop) == -69);
+
+    assert(fd_callbacks_ran == 1);
+    assert(!replacement_ran);
+
+    pollen_loop_cleanup(loop);
+}
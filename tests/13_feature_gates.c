@@ -0,0 +1,51 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_NO_IDLE
+#define POLLEN_NO_SIGNALS
+#define POLLEN_NO_TIMERS
+#define POLLEN_NO_EFDS
+#define POLLEN_NO_TRACE
+#define POLLEN_NO_DGRAMS
+#define POLLEN_NO_LISTENERS
+#define POLLEN_NO_METRICS
+#define POLLEN_NO_GROUPS
+#define POLLEN_NO_ASYNC_CLOSE
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+int efd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    int *counter = data;
+    uint64_t n;
+    assert(read(fd, &n, sizeof(n)) == sizeof(n));
+
+    if (++*counter == 3) {
+        return -69;
+    }
+
+    n = 1;
+    assert(write(fd, &n, sizeof(n)) == sizeof(n));
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    int efd;
+    int counter = 0;
+
+    assert((efd = eventfd(1, EFD_NONBLOCK)) > 0);
+
+    /* only fd callbacks are left, and they must work exactly the same */
+    assert((loop = pollen_loop_create()));
+    assert(pollen_loop_add_fd(loop, efd, EPOLLIN, true, efd_callback, &counter));
+
+    assert(pollen_loop_run(loop) == -69);
+    assert(counter == 3);
+
+    pollen_loop_cleanup(loop);
+}
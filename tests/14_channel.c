@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) (void)(fmt)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_MESSAGES 200000
+#define MAX_PRODUCERS 4
+
+struct message {
+    uint32_t producer;
+    uint32_t seq;
+};
+
+struct producer {
+    struct pollen_channel *channel;
+    uint32_t id;
+    uint32_t next_seq;
+};
+
+uint32_t expected_seq[MAX_PRODUCERS];
+uint64_t received = 0;
+uint64_t batches = 0;
+int n_producers;
+
+int writable_callback(struct pollen_callback *callback, void *data) {
+    struct producer *producer = data;
+
+    while (producer->next_seq < N_MESSAGES) {
+        struct message msg = { .producer = producer->id, .seq = producer->next_seq };
+        if (!pollen_channel_send(producer->channel, &msg)) {
+            /* full, wait until consumer makes space */
+            assert(errno == EAGAIN);
+            return 0;
+        }
+        producer->next_seq += 1;
+    }
+
+    pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    return 0;
+}
+
+void *producer_thread(void *data) {
+    struct producer *producer = data;
+    struct pollen_loop *loop;
+    struct pollen_callback *callback;
+
+    assert((loop = pollen_loop_create()));
+    assert((callback = pollen_loop_add_channel_producer(loop, producer->channel,
+                                                        writable_callback, producer)));
+
+    writable_callback(callback, producer);
+    if (producer->next_seq < N_MESSAGES) {
+        assert(pollen_loop_run(loop) == 0);
+    }
+
+    pollen_loop_remove_callback(callback);
+    pollen_loop_cleanup(loop);
+    return NULL;
+}
+
+int recv_callback(struct pollen_callback *callback, const void *msgs, size_t n, void *data) {
+    const struct message *messages = msgs;
+
+    assert(n > 0 && n <= POLLEN_CHANNEL_BATCH);
+    batches += 1;
+
+    for (size_t i = 0; i < n; i++) {
+        assert(messages[i].producer < (uint32_t)n_producers);
+        /* messages from one producer must arrive in order */
+        assert(messages[i].seq == expected_seq[messages[i].producer]);
+        expected_seq[messages[i].producer] += 1;
+    }
+
+    received += n;
+    if (received == (uint64_t)N_MESSAGES * n_producers) {
+        return -69;
+    }
+    return 0;
+}
+
+void run(enum pollen_channel_mode mode, int producers) {
+    struct pollen_loop *loop;
+    struct pollen_channel *channel;
+    struct pollen_callback *consumer;
+    struct producer producer_data[MAX_PRODUCERS];
+    pthread_t threads[MAX_PRODUCERS];
+
+    n_producers = producers;
+    received = 0;
+    batches = 0;
+    for (int i = 0; i < MAX_PRODUCERS; i++) {
+        expected_seq[i] = 0;
+    }
+
+    assert((channel = pollen_channel_create(sizeof(struct message), 1000, mode)));
+    assert((loop = pollen_loop_create()));
+    assert((consumer = pollen_loop_add_channel_consumer(loop, channel, recv_callback, NULL)));
+
+    for (int i = 0; i < producers; i++) {
+        producer_data[i] = (struct producer){ .channel = channel, .id = i };
+        assert(pthread_create(&threads[i], NULL, producer_thread, &producer_data[i]) == 0);
+    }
+
+    assert(pollen_loop_run(loop) == -69);
+
+    for (int i = 0; i < producers; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    fprintf(stderr, "received %lu messages in %lu batches\n", received, batches);
+    assert(batches < received);
+
+    pollen_loop_remove_callback(consumer);
+    pollen_loop_cleanup(loop);
+    pollen_channel_destroy(channel);
+}
+
+int main(void) {
+    struct pollen_channel *channel;
+    int n = 1;
+
+    /* capacity is rounded up to power of 2 */
+    assert((channel = pollen_channel_create(sizeof(n), 3, POLLEN_CHANNEL_SPSC)));
+    for (int i = 0; i < 4; i++) {
+        assert(pollen_channel_send(channel, &n));
+    }
+    assert(!pollen_channel_send(channel, &n) && errno == EAGAIN);
+    pollen_channel_destroy(channel);
+
+    assert(pollen_channel_create(0, 10, POLLEN_CHANNEL_SPSC) == NULL && errno == EINVAL);
+
+    /* SPSC channel has one consumer at a time, even across loops */
+    struct pollen_loop *loops[2];
+    struct pollen_callback *consumers[2];
+    assert((channel = pollen_channel_create(sizeof(n), 4, POLLEN_CHANNEL_SPSC)));
+    assert((loops[0] = pollen_loop_create()) && (loops[1] = pollen_loop_create()));
+    assert((consumers[0] = pollen_loop_add_channel_consumer(loops[0], channel,
+                                                             recv_callback, NULL)));
+    assert(!pollen_loop_add_channel_consumer(loops[1], channel, recv_callback, NULL));
+    assert(errno == EBUSY);
+    pollen_loop_remove_callback(consumers[0]);
+    assert((consumers[1] = pollen_loop_add_channel_consumer(loops[1], channel,
+                                                             recv_callback, NULL)));
+    pollen_loop_cleanup(loops[0]);
+    pollen_loop_cleanup(loops[1]);
+    pollen_channel_destroy(channel);
+
+    run(POLLEN_CHANNEL_SPSC, 1);
+    run(POLLEN_CHANNEL_MPMC, MAX_PRODUCERS);
+}
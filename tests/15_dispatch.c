@@ -0,0 +1,144 @@
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    int *counter = data;
+    *counter += 1;
+
+    return 0;
+}
+
+int timer_callback(struct pollen_callback *callback, void *data) {
+    int *counter = data;
+    *counter += 1;
+
+    return 0;
+}
+
+int idle_callback(struct pollen_callback *callback, void *data) {
+    int *counter = data;
+    *counter += 1;
+
+    return 0;
+}
+
+int counting_task(struct pollen_loop *loop, void *data) {
+    int *counter = data;
+    *counter += 1;
+
+    return 0;
+}
+
+int deferring_idle_callback(struct pollen_callback *callback, void *data) {
+    assert(pollen_loop_defer(pollen_callback_get_loop(callback), counting_task, data));
+
+    return 0;
+}
+
+int failing_efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    return -69;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *efd, *timer, *idle;
+    int efd_counter = 0, timer_counter = 0, idle_counter = 0;
+
+    assert((loop = pollen_loop_create()));
+    assert(pollen_loop_get_fd(loop) >= 0);
+
+    assert((efd = pollen_loop_add_efd(loop, efd_callback, &efd_counter)));
+    assert((timer = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, timer_callback, &timer_counter)));
+    assert((idle = pollen_loop_add_idle(loop, 0, idle_callback, &idle_counter)));
+
+    /* nothing is ready: non-blocking dispatch returns immediately, but idle callbacks still run */
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(idle_counter == 1);
+
+    /* timeout is respected */
+    uint64_t start = now_ns();
+    assert(pollen_loop_dispatch(loop, 20 * 1000000) == 0);
+    assert(now_ns() - start >= 20 * 1000000);
+    assert(idle_counter == 2);
+
+    /* embed into a poll(2) based host loop */
+    struct pollfd pfd = { .fd = pollen_loop_get_fd(loop), .events = POLLIN };
+    assert(poll(&pfd, 1, 0) == 0);
+
+    assert(pollen_efd_trigger(efd));
+    assert(poll(&pfd, 1, 1000) == 1);
+    assert(pfd.revents & POLLIN);
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(efd_counter == 1);
+    assert(poll(&pfd, 1, 0) == 0);
+
+    assert(pollen_timer_arm_ms(timer, false, 10, 0));
+    assert(poll(&pfd, 1, 1000) == 1);
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(timer_counter == 1);
+
+    /* task deferred by an idle callback makes the fd readable for the next dispatch */
+    int task_counter = 0;
+    struct pollen_callback *deferring;
+    assert((deferring = pollen_loop_add_idle(loop, 0, deferring_idle_callback, &task_counter)));
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    pollen_loop_remove_callback(deferring);
+    assert(task_counter == 0);
+    assert(poll(&pfd, 1, 1000) == 1);
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(task_counter == 1);
+    assert(poll(&pfd, 1, 0) == 0);
+
+    /* so does group backlog that didn't fit in one iteration */
+    struct pollen_group *group;
+    assert((group = pollen_group_create(1)));
+    assert(pollen_group_add_loop(group, loop));
+    task_counter = 0;
+    for (int i = 0; i < POLLEN_GROUP_TASK_BATCH + 1; i++) {
+        assert(pollen_loop_spawn(loop, counting_task, &task_counter));
+    }
+    assert(pollen_loop_dispatch(loop, 0) >= 0);
+    assert(task_counter == POLLEN_GROUP_TASK_BATCH);
+    assert(poll(&pfd, 1, 1000) == 1);
+    assert(pollen_loop_dispatch(loop, 0) >= 0);
+    assert(task_counter == POLLEN_GROUP_TASK_BATCH + 1);
+    pollen_group_destroy(group);
+    assert(pollen_loop_dispatch(loop, 0) >= 0);
+    assert(poll(&pfd, 1, 0) == 0);
+
+    /* run_for returns 0 after the duration passed, periodic timer fires in the meantime */
+    assert(pollen_timer_arm_ms(timer, false, 10, 10));
+    timer_counter = 0;
+    start = now_ns();
+    assert(pollen_loop_run_for(loop, 100 * 1000000) == 0);
+    assert(now_ns() - start >= 100 * 1000000);
+    assert(timer_counter >= 5);
+    assert(pollen_timer_disarm(timer));
+
+    /* negative callback return value is propagated from both */
+    pollen_loop_remove_callback(efd);
+    assert((efd = pollen_loop_add_efd(loop, failing_efd_callback, NULL)));
+    assert(pollen_efd_trigger(efd));
+    assert(pollen_loop_dispatch(loop, -1) == -69);
+    assert(pollen_efd_trigger(efd));
+    assert(pollen_loop_run_for(loop, 1000 * 1000000) == -69);
+
+    pollen_loop_cleanup(loop);
+
+    return 0;
+}
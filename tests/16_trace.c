@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+int efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    return 0;
+}
+
+int idle_callback(struct pollen_callback *callback, void *data) {
+    return 0;
+}
+
+static int count(const char *haystack, const char *needle) {
+    int n = 0;
+    while ((haystack = strstr(haystack, needle)) != NULL) {
+        haystack += strlen(needle);
+        n += 1;
+    }
+    return n;
+}
+
+static char *dump(struct pollen_loop *loop) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out;
+
+    assert((out = open_memstream(&buf, &size)));
+    assert(pollen_loop_trace_dump(loop, out));
+    fclose(out);
+
+    fprintf(stderr, "%s", buf);
+    return buf;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *efd;
+    char *buf;
+
+    assert((loop = pollen_loop_create()));
+    assert((efd = pollen_loop_add_efd(loop, efd_callback, NULL)));
+    assert(pollen_loop_add_idle(loop, 7, idle_callback, NULL));
+
+    /* nothing is recorded without starting the trace */
+    assert(pollen_efd_trigger(efd));
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    buf = dump(loop);
+    assert(count(buf, "\"ph\":\"X\"") == 0);
+    assert(strstr(buf, "\"traceEvents\":["));
+    free(buf);
+
+    /* one wait, one efd callback and one idle callback per iteration */
+    assert(pollen_loop_trace_start(loop, 30));
+    assert(pollen_efd_trigger(efd));
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    buf = dump(loop);
+    assert(count(buf, "\"ph\":\"X\"") == 3);
+    assert(count(buf, "\"name\":\"epoll_wait\",\"args\":{\"events\":1}") == 1);
+    assert(count(buf, "\"name\":\"efd\"") == 1);
+    assert(count(buf, "\"name\":\"idle\",\"args\":{\"priority\":7}") == 1);
+    free(buf);
+
+    /* capacity is rounded up to 32, oldest records are overwritten */
+    for (int i = 0; i < 100; i++) {
+        assert(pollen_efd_trigger(efd));
+        assert(pollen_loop_dispatch(loop, 0) == 1);
+    }
+    buf = dump(loop);
+    assert(count(buf, "\"ph\":\"X\"") == 32);
+    free(buf);
+
+    pollen_loop_trace_stop(loop);
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    buf = dump(loop);
+    assert(count(buf, "\"ph\":\"X\"") == 0);
+    free(buf);
+
+    /* restart after stop, and cleanup with tracing active */
+    assert(pollen_loop_trace_start(loop, 4));
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+
+    pollen_loop_cleanup(loop);
+
+    return 0;
+}
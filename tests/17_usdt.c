@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_USDT
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+static const char *const probes[] = {
+    "wakeup", "callback_start", "callback_end", "callback_add", "callback_remove",
+    "timer_expire", "efd_read", "signal",
+};
+
+int efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    return -69;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *efd;
+
+    /* probes don't change behaviour */
+    assert((loop = pollen_loop_create()));
+    assert((efd = pollen_loop_add_efd(loop, efd_callback, NULL)));
+    assert(pollen_efd_trigger(efd));
+    assert(pollen_loop_run(loop) == -69);
+    pollen_loop_cleanup(loop);
+
+#if defined(__LP64__)
+    /* every probe has a note with provider and name in our own executable */
+    FILE *exe;
+    static char buf[16 * 1024 * 1024];
+    assert((exe = fopen("/proc/self/exe", "rb")));
+    size_t size = fread(buf, 1, sizeof(buf), exe);
+    assert(size > 0 && size < sizeof(buf));
+    fclose(exe);
+
+    for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+        char needle[64];
+        int len = snprintf(needle, sizeof(needle), "pollen%c%s%c", '\0', probes[i], '\0');
+        assert(memmem(buf, size, needle, len) != NULL);
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+/* Both callbacks become ready in the same iteration, whichever runs first disables the other. */
+struct pair {
+    struct pollen_callback *callbacks[2];
+    int runs;
+};
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    struct pair *pair = data;
+    pair->runs += 1;
+
+    struct pollen_callback *other =
+        (pair->callbacks[0] == callback) ? pair->callbacks[1] : pair->callbacks[0];
+    assert(pollen_fd_modify_events(other, 0));
+    assert(pollen_fd_modify_events(callback, 0));
+
+    return 0;
+}
+
+int timer_callback(struct pollen_callback *callback, void *data) {
+    struct pair *pair = data;
+    pair->runs += 1;
+
+    struct pollen_callback *other =
+        (pair->callbacks[0] == callback) ? pair->callbacks[1] : pair->callbacks[0];
+    assert(pollen_timer_disarm(other));
+
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pair fds = {0}, timers = {0};
+
+    assert((loop = pollen_loop_create()));
+
+    for (int i = 0; i < 2; i++) {
+        int efd;
+        assert((efd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC)) > 0);
+        assert((fds.callbacks[i] = pollen_loop_add_fd(loop, efd, EPOLLIN, true,
+                                                      fd_callback, &fds)));
+    }
+    assert(pollen_loop_dispatch(loop, 0) == 2);
+    assert(fds.runs == 1);
+
+    for (int i = 0; i < 2; i++) {
+        assert((timers.callbacks[i] = pollen_loop_add_timer(loop, CLOCK_MONOTONIC,
+                                                            timer_callback, &timers)));
+        assert(pollen_timer_arm_ms(timers.callbacks[i], false, 1, 0));
+    }
+    usleep(10000);
+    assert(pollen_loop_dispatch(loop, 0) == 2);
+    assert(timers.runs == 1);
+
+    pollen_loop_cleanup(loop);
+
+    return 0;
+}
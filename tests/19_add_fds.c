@@ -0,0 +1,107 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) (void)(fmt)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_FDS 1000
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    int *counter = data;
+    uint64_t val;
+    assert(read(fd, &val, sizeof(val)) == sizeof(val));
+
+    if (++*counter == N_FDS) {
+        pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    }
+    return 0;
+}
+
+int count_fds(struct pollen_callback *callback, int fd, void *data) {
+    int *counter = data;
+    *counter += 1;
+    return 0;
+}
+
+static int registered(struct pollen_loop *loop) {
+    int n = 0;
+    assert(pollen_loop_for_each_fd(loop, count_fds, &n) == 0);
+    return n;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    static struct pollen_fd_spec specs[N_FDS + 1];
+    static struct pollen_callback *callbacks[N_FDS + 1];
+    int counter = 0;
+
+    assert((loop = pollen_loop_create()));
+
+    for (int i = 0; i < N_FDS; i++) {
+        specs[i].fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert(specs[i].fd > 0);
+        specs[i].events = EPOLLIN;
+        specs[i].autoclose = true;
+        specs[i].callback = fd_callback;
+        specs[i].data = &counter;
+    }
+
+    assert(pollen_loop_add_fds(loop, specs, N_FDS, callbacks));
+    assert(registered(loop) == N_FDS);
+    for (int i = 0; i < N_FDS; i++) {
+        assert(pollen_loop_find_fd(loop, specs[i].fd) == callbacks[i]);
+        /* all allocated from the same block, in order */
+        if (i > 0) {
+            assert((char *)callbacks[i] > (char *)callbacks[i - 1]);
+        }
+    }
+
+    assert(pollen_loop_run(loop) == 0);
+    assert(counter == N_FDS);
+
+    /* duplicate fd in the last spec: nothing gets added, fds are not closed */
+    int a = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), b = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct pollen_fd_spec bad[] = {
+        { .fd = a, .events = EPOLLIN, .autoclose = true, .callback = fd_callback },
+        { .fd = b, .events = EPOLLIN, .autoclose = true, .callback = fd_callback },
+        { .fd = a, .events = EPOLLIN, .autoclose = true, .callback = fd_callback },
+    };
+    callbacks[0] = callbacks[1] = NULL;
+    assert(!pollen_loop_add_fds(loop, bad, 3, callbacks));
+    assert(errno == EEXIST);
+    assert(callbacks[0] == NULL && callbacks[1] == NULL);
+    assert(registered(loop) == N_FDS);
+    assert(pollen_loop_find_fd(loop, a) == NULL && pollen_loop_find_fd(loop, b) == NULL);
+    assert(fcntl(a, F_GETFD) >= 0 && fcntl(b, F_GETFD) >= 0);
+
+    /* already registered fd and invalid fd */
+    bad[2].fd = specs[0].fd;
+    assert(!pollen_loop_add_fds(loop, bad, 3, NULL));
+    assert(errno == EEXIST);
+    bad[2].fd = -1;
+    assert(!pollen_loop_add_fds(loop, bad, 3, NULL));
+    assert(errno == EBADF);
+    assert(registered(loop) == N_FDS);
+
+    /* fd that epoll rejects */
+    int dir = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bad[2].fd = dir;
+    assert(!pollen_loop_add_fds(loop, bad, 3, NULL));
+    assert(errno == EPERM);
+    assert(registered(loop) == N_FDS);
+
+    /* rolled back callbacks are reusable */
+    assert(pollen_loop_add_fds(loop, bad, 2, NULL));
+    assert(registered(loop) == N_FDS + 2);
+    assert(pollen_loop_add_fds(loop, NULL, 0, NULL));
+
+    close(dir);
+    pollen_loop_cleanup(loop);
+
+    return 0;
+}
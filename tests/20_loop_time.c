@@ -0,0 +1,72 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+static uint64_t seen[2];
+static int n_seen = 0;
+
+int efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    seen[n_seen++] = pollen_loop_now(pollen_callback_get_loop(callback));
+    usleep(2000);
+    return 0;
+}
+
+static uint64_t armed_at;
+
+int timer_callback(struct pollen_callback *callback, void *data) {
+    struct pollen_loop *loop = pollen_callback_get_loop(callback);
+    assert(pollen_loop_now(loop) >= armed_at + 10 * 1000000);
+    return -69;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *efds[2], *timer, *realtime_timer;
+
+    assert((loop = pollen_loop_create()));
+    assert(pollen_loop_now(loop) > 0);
+
+    /* loop time is the same for all callbacks in one iteration */
+    for (int i = 0; i < 2; i++) {
+        assert((efds[i] = pollen_loop_add_efd(loop, efd_callback, NULL)));
+        assert(pollen_efd_trigger(efds[i]));
+    }
+    assert(pollen_loop_dispatch(loop, 0) == 2);
+    assert(n_seen == 2 && seen[0] == seen[1]);
+    assert(pollen_loop_now(loop) == seen[0]);
+
+    /* until updated explicitly */
+    const uint64_t updated = pollen_loop_update_time(loop);
+    assert(updated >= seen[0] + 4 * 1000000);
+    assert(pollen_loop_now(loop) == updated);
+
+    /* arming relative to loop time */
+    assert((timer = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, timer_callback, NULL)));
+    armed_at = pollen_loop_now(loop);
+    assert(pollen_timer_arm_after(timer, 10 * 1000000, 0));
+    assert(pollen_loop_run(loop) == -69);
+
+    /* deadline in the past expires right away */
+    armed_at = 0;
+    usleep(20000);
+    assert(pollen_timer_arm_after(timer, 10 * 1000000, 0));
+    assert(pollen_loop_dispatch(loop, 0) == -69);
+
+    /* only timers on the clock of loop time are accepted */
+    assert((realtime_timer = pollen_loop_add_timer(loop, CLOCK_REALTIME, timer_callback, NULL)));
+    assert(!pollen_timer_arm_after(realtime_timer, 1000000, 0));
+    assert(errno == EINVAL);
+    assert(!pollen_timer_arm_after(efds[0], 1000000, 0));
+    assert(errno == EINVAL);
+
+    pollen_loop_cleanup(loop);
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <sys/socket.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define RATE 100000 /* bytes per second */
+#define BURST 10000
+#define CHUNK 100
+
+size_t total_read = 0;
+
+int read_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    char buf[CHUNK];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    assert(n > 0);
+    total_read += n;
+    pollen_fd_consume(callback, n);
+    return 0;
+}
+
+/* Returns the read end of a socketpair with its buffer filled up. */
+int make_busy_socket(int *peer) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+    static char buf[4096];
+    while (write(sv[1], buf, sizeof(buf)) > 0) {}
+    assert(errno == EAGAIN);
+
+    *peer = sv[1];
+    return sv[0];
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *a, *b;
+    struct pollen_rate_limit *limit;
+    int peer_a, peer_b;
+
+    assert((loop = pollen_loop_create()));
+    assert(!pollen_loop_add_rate_limit(loop, 0, BURST) && errno == EINVAL);
+    assert((limit = pollen_loop_add_rate_limit(loop, RATE, BURST)));
+
+    assert((a = pollen_loop_add_fd(loop, make_busy_socket(&peer_a), EPOLLIN, true,
+                                   read_callback, NULL)));
+    assert((b = pollen_loop_add_fd(loop, make_busy_socket(&peer_b), EPOLLIN, true,
+                                   read_callback, NULL)));
+
+    /* both fds share one bucket, so together they get burst plus rate * time */
+    assert(pollen_fd_set_rate_limit(a, limit));
+    assert(pollen_fd_set_rate_limit(b, limit));
+    assert(pollen_loop_run_for(loop, 300000000) == 0);
+    fprintf(stderr, "read %zu bytes in 300ms\n", total_read);
+    assert(total_read >= BURST + RATE * 3 / 10 * 8 / 10);
+    assert(total_read <= BURST + RATE * 3 / 10 * 12 / 10 + 2 * CHUNK);
+
+    /* bucket is empty right after running, so fds are suspended */
+    assert(!pollen_fd_consume(a, BURST));
+    assert(!(a->events & EPOLLIN) && !(b->events & EPOLLIN));
+
+    /* modifying events keeps EPOLLIN suspended, but remembers it for later */
+    assert(pollen_fd_modify_events(b, EPOLLIN | EPOLLRDHUP));
+    assert(b->events == EPOLLRDHUP);
+
+    /* detached fd is read at full speed, while the other one stays suspended */
+    assert(pollen_fd_set_rate_limit(b, NULL));
+    assert(b->events == (EPOLLIN | EPOLLRDHUP));
+    total_read = 0;
+    assert(pollen_loop_run_for(loop, 50000000) == 0);
+    assert(total_read > 5 * BURST);
+
+    /* destroying the bucket resumes its fds */
+    assert(pollen_fd_set_rate_limit(b, limit));
+    pollen_rate_limit_destroy(limit);
+    assert(a->as.fd.rate_limit == NULL && b->as.fd.rate_limit == NULL);
+    assert((a->events & EPOLLIN) && (b->events & EPOLLIN));
+
+    /* buckets that are still alive are freed by cleanup */
+    assert((limit = pollen_loop_add_rate_limit(loop, RATE, BURST)));
+    assert(pollen_fd_set_rate_limit(a, limit));
+    assert(!pollen_fd_consume(a, 2 * BURST));
+
+    /* only fd callbacks can be rate limited */
+    struct pollen_callback *timer;
+    assert((timer = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, NULL, NULL)));
+    assert(!pollen_fd_set_rate_limit(timer, limit) && errno == EINVAL);
+
+    pollen_loop_cleanup(loop);
+    close(peer_a);
+    close(peer_b);
+}
@@ -0,0 +1,139 @@
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_ECHOES 100
+#define N_SEGMENTS 64
+#define SEGMENT_SIZE 1000
+
+uint32_t echoes_received = 0;
+size_t segments_received = 0;
+int n_batches = 0;
+
+int make_socket(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    assert(fd > 0);
+
+    *addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(*addr);
+    assert(bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+    assert(getsockname(fd, (struct sockaddr *)addr, &len) == 0);
+
+    return fd;
+}
+
+int echo_callback(struct pollen_callback *callback, struct pollen_dgram *dgrams, size_t n,
+                  void *data) {
+    for (size_t i = 0; i < n; i++) {
+        assert(dgrams[i].len == sizeof(uint32_t));
+        assert(pollen_dgram_send(callback, dgrams[i].buf, dgrams[i].len,
+                                 (struct sockaddr *)&dgrams[i].addr, dgrams[i].addrlen));
+    }
+    return 0;
+}
+
+int reply_callback(struct pollen_callback *callback, struct pollen_dgram *dgrams, size_t n,
+                   void *data) {
+    n_batches += 1;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t seq;
+        assert(dgrams[i].len == sizeof(seq));
+        memcpy(&seq, dgrams[i].buf, sizeof(seq));
+        assert(seq == echoes_received);
+        echoes_received += 1;
+    }
+
+    if (echoes_received == N_ECHOES) {
+        pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    }
+    return 0;
+}
+
+int segments_callback(struct pollen_callback *callback, struct pollen_dgram *dgrams, size_t n,
+                      void *data) {
+    for (size_t i = 0; i < n; i++) {
+        const size_t segment_size = dgrams[i].segment_size ? dgrams[i].segment_size : dgrams[i].len;
+        assert(segment_size == SEGMENT_SIZE);
+        assert(dgrams[i].len % SEGMENT_SIZE == 0);
+        if (dgrams[i].segment_size != 0) {
+            fprintf(stderr, "received %zu segments at once\n", dgrams[i].len / SEGMENT_SIZE);
+        }
+
+        for (size_t off = 0; off < dgrams[i].len; off += segment_size) {
+            const unsigned char *segment = (unsigned char *)dgrams[i].buf + off;
+            assert(segment[0] == segments_received % 256);
+            assert(segment[SEGMENT_SIZE - 1] == segments_received % 256);
+            segments_received += 1;
+        }
+    }
+
+    if (segments_received == N_SEGMENTS) {
+        pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    }
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *client, *server, *gso, *gro, *efd;
+    struct sockaddr_in client_addr, server_addr, gso_addr, gro_addr;
+
+    assert((loop = pollen_loop_create()));
+    assert(!pollen_loop_add_dgram(loop, make_socket(&client_addr), true, 0, 0,
+                                  reply_callback, NULL) && errno == EINVAL);
+    assert(!pollen_loop_add_dgram(loop, make_socket(&client_addr), true, SIZE_MAX, 0,
+                                  reply_callback, NULL) && errno == EINVAL);
+
+    assert((client = pollen_loop_add_dgram(loop, make_socket(&client_addr), true, 64, 0,
+                                           reply_callback, NULL)));
+    assert((server = pollen_loop_add_dgram(loop, make_socket(&server_addr), true, 64, 0,
+                                           echo_callback, NULL)));
+
+    /* more than one batch, so the queue has to flush by itself in the middle */
+    for (uint32_t seq = 0; seq < N_ECHOES; seq++) {
+        assert(pollen_dgram_send(client, &seq, sizeof(seq),
+                                 (struct sockaddr *)&server_addr, sizeof(server_addr)));
+    }
+    assert(pollen_dgram_flush(client));
+    assert(pollen_loop_run_for(loop, 2000000000) == 0);
+    assert(echoes_received == N_ECHOES);
+    /* datagrams must have arrived in batches, not one by one */
+    fprintf(stderr, "received %d echoes in %d batches\n", N_ECHOES, n_batches);
+    assert(n_batches < N_ECHOES);
+
+    char big[65] = {0};
+    assert(!pollen_dgram_send(client, big, sizeof(big), NULL, 0) && errno == EMSGSIZE);
+
+    assert((efd = pollen_loop_add_efd(loop, NULL, NULL)));
+    assert(!pollen_dgram_send(efd, big, 1, NULL, 0) && errno == EINVAL);
+    assert(!pollen_dgram_flush(efd) && errno == EINVAL);
+
+    /* GSO and GRO are optional, data must arrive intact either way */
+    assert((gso = pollen_loop_add_dgram(loop, make_socket(&gso_addr), true,
+                                        N_SEGMENTS * SEGMENT_SIZE, POLLEN_DGRAM_GSO,
+                                        NULL, NULL)));
+    assert((gro = pollen_loop_add_dgram(loop, make_socket(&gro_addr), true, 65535,
+                                        POLLEN_DGRAM_GRO, segments_callback, NULL)));
+    for (int i = 0; i < N_SEGMENTS; i++) {
+        unsigned char segment[SEGMENT_SIZE];
+        memset(segment, i, sizeof(segment));
+        assert(pollen_dgram_send(gso, segment, sizeof(segment),
+                                 (struct sockaddr *)&gro_addr, sizeof(gro_addr)));
+    }
+    assert(pollen_dgram_flush(gso));
+    assert(pollen_loop_run_for(loop, 2000000000) == 0);
+    assert(segments_received == N_SEGMENTS);
+
+    /* queued datagrams are dropped on removal */
+    assert(pollen_dgram_send(client, big, 1, (struct sockaddr *)&server_addr,
+                             sizeof(server_addr)));
+    pollen_loop_cleanup(loop);
+}
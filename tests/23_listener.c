@@ -0,0 +1,191 @@
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_CLIENTS 10
+
+int accepted[2] = {0};
+int n_batches = 0;
+in_port_t peer_ports[N_CLIENTS];
+int n_peers = 0;
+
+int make_listener(struct sockaddr_in *addr, bool reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(fd > 0);
+
+    const int one = 1;
+    if (reuseport) {
+        assert(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0);
+    }
+
+    socklen_t len = sizeof(*addr);
+    assert(bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+    assert(getsockname(fd, (struct sockaddr *)addr, &len) == 0);
+    assert(listen(fd, N_CLIENTS) == 0);
+
+    return fd;
+}
+
+void connect_clients(const struct sockaddr_in *addr, int *clients) {
+    for (int i = 0; i < N_CLIENTS; i++) {
+        assert((clients[i] = socket(AF_INET, SOCK_STREAM, 0)) > 0);
+        assert(connect(clients[i], (struct sockaddr *)addr, sizeof(*addr)) == 0);
+    }
+}
+
+int listener_callback(struct pollen_callback *callback, const int *fds, size_t n, void *data) {
+    int *counter = data;
+
+    n_batches += 1;
+    for (size_t i = 0; i < n; i++) {
+        assert(fcntl(fds[i], F_GETFL) & O_NONBLOCK);
+        assert(fcntl(fds[i], F_GETFD) & FD_CLOEXEC);
+        close(fds[i]);
+    }
+
+    *counter += n;
+    if (accepted[0] + accepted[1] == N_CLIENTS) {
+        pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    }
+    return 0;
+}
+
+int shared_listener_callback(struct pollen_callback *callback, const int *fds, size_t n,
+                             void *data) {
+    int *counter = data;
+
+    for (size_t i = 0; i < n; i++) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        assert(getpeername(fds[i], (struct sockaddr *)&peer, &len) == 0);
+        assert(n_peers < N_CLIENTS);
+        peer_ports[n_peers++] = peer.sin_port;
+        close(fds[i]);
+    }
+
+    *counter += n;
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop, *other_loop;
+    struct pollen_callback *listener;
+    int clients[N_CLIENTS];
+
+    assert((loop = pollen_loop_create()));
+
+    /* all pending connections are accepted and delivered at once */
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    const int fd = make_listener(&addr, false);
+    assert((listener = pollen_loop_add_listener(loop, fd, true, 0, listener_callback, &accepted[0])));
+    connect_clients(&addr, clients);
+    assert(pollen_loop_run_for(loop, 2000000000) == 0);
+    assert(accepted[0] == N_CLIENTS);
+    assert(n_batches == 1);
+    for (int i = 0; i < N_CLIENTS; i++) {
+        close(clients[i]);
+    }
+    pollen_loop_remove_callback(listener);
+
+    /* the same fd can be shared by several loops */
+    addr.sin_port = 0;
+    const int shared_fd = make_listener(&addr, false);
+    assert((other_loop = pollen_loop_create()));
+    int shared_accepted[2] = {0};
+    assert(pollen_loop_add_listener(loop, shared_fd, true, POLLEN_LISTENER_EXCLUSIVE,
+                                    shared_listener_callback, &shared_accepted[0]));
+    assert(pollen_loop_add_listener(other_loop, shared_fd, false, POLLEN_LISTENER_EXCLUSIVE,
+                                    shared_listener_callback, &shared_accepted[1]));
+    connect_clients(&addr, clients);
+    for (int i = 0; i < 100 && n_peers < N_CLIENTS; i++) {
+        assert(pollen_loop_dispatch(loop, 10000000) >= 0);
+        assert(pollen_loop_dispatch(other_loop, 10000000) >= 0);
+    }
+    /* nothing is left for the other loop to accept twice */
+    assert(pollen_loop_dispatch(loop, 10000000) >= 0);
+    assert(pollen_loop_dispatch(other_loop, 10000000) >= 0);
+    fprintf(stderr, "shared fd: accepted %d and %d\n", shared_accepted[0], shared_accepted[1]);
+    assert(shared_accepted[0] + shared_accepted[1] == N_CLIENTS);
+    for (int i = 0; i < N_CLIENTS; i++) {
+        struct sockaddr_in local;
+        socklen_t len = sizeof(local);
+        assert(getsockname(clients[i], (struct sockaddr *)&local, &len) == 0);
+        int seen = 0;
+        for (int j = 0; j < n_peers; j++) {
+            seen += (peer_ports[j] == local.sin_port);
+        }
+        assert(seen == 1);
+        close(clients[i]);
+    }
+    pollen_loop_cleanup(other_loop);
+
+    /* listener that ran out of fds stops being polled until the retry timer fires */
+    addr.sin_port = 0;
+    const int limited_fd = make_listener(&addr, false);
+    accepted[0] = 0;
+    assert(pollen_loop_add_listener(loop, limited_fd, true, 0, listener_callback, &accepted[0]));
+    connect_clients(&addr, clients);
+
+    struct rlimit old_limit, limit;
+    assert(getrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+    limit = old_limit;
+    limit.rlim_cur = 256;
+    assert(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+    int fillers[256];
+    int n_fillers = 0;
+    while (n_fillers < 256 && (fillers[n_fillers] = dup(limited_fd)) >= 0) {
+        n_fillers += 1;
+    }
+    assert(errno == EMFILE);
+
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(accepted[0] == 0);
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+
+    for (int i = 0; i < n_fillers; i++) {
+        close(fillers[i]);
+    }
+    assert(setrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+    assert(pollen_loop_run_for(loop, 2000000000) == 0);
+    assert(accepted[0] == N_CLIENTS);
+    for (int i = 0; i < N_CLIENTS; i++) {
+        close(clients[i]);
+    }
+
+    /* with steering by cpu, connections made on this cpu all land on one socket of the group */
+    int cpu = sched_getcpu();
+    assert(cpu >= 0);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    assert(sched_setaffinity(0, sizeof(set), &set) == 0);
+
+    addr.sin_port = 0;
+    const int group_fd = make_listener(&addr, true);
+    const int group_fd2 = make_listener(&addr, true);
+    assert(!pollen_listener_steer_by_cpu(group_fd, 0) && errno == EINVAL);
+    assert(pollen_listener_steer_by_cpu(group_fd, 2));
+    assert(pollen_loop_add_listener(loop, group_fd, true, 0, listener_callback, &accepted[0]));
+    assert(pollen_loop_add_listener(loop, group_fd2, true, 0, listener_callback, &accepted[1]));
+
+    accepted[0] = 0;
+    connect_clients(&addr, clients);
+    assert(pollen_loop_run_for(loop, 2000000000) == 0);
+    fprintf(stderr, "cpu %d: accepted %d and %d\n", cpu, accepted[0], accepted[1]);
+    assert(accepted[cpu % 2] == N_CLIENTS);
+    for (int i = 0; i < N_CLIENTS; i++) {
+        close(clients[i]);
+    }
+
+    pollen_loop_cleanup(loop);
+}
@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <poll.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_CROSS_THREAD 100000
+
+struct pollen_callback *first, *second, *removed, *remote;
+int iteration = 0;
+int first_ran_at = -1, second_ran_at = -1;
+int second_runs = 0;
+uint64_t remote_total = 0;
+
+bool readable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1;
+}
+
+int first_callback(struct pollen_callback *callback, uint64_t n, void *data) {
+    assert(n == 1);
+    first_ran_at = iteration;
+
+    /* same thread triggers don't touch the eventfd and are merged */
+    assert(pollen_efd_inc(second, 2));
+    assert(pollen_efd_trigger(second));
+    assert(!readable(second->fd));
+
+    /* removed callbacks don't run even if they are pending */
+    assert(pollen_efd_trigger(removed));
+    pollen_loop_remove_callback(removed);
+    return 0;
+}
+
+int second_callback(struct pollen_callback *callback, uint64_t n, void *data) {
+    assert(n == (second_runs == 0 ? 3 : 1));
+    second_ran_at = iteration;
+    second_runs += 1;
+
+    /* retriggering itself must not hang the loop, it runs again on the next iteration */
+    if (second_runs < 5) {
+        assert(pollen_efd_trigger(callback));
+    }
+    return 0;
+}
+
+int removed_callback(struct pollen_callback *callback, uint64_t n, void *data) {
+    assert(0 && "removed callback ran");
+    return -1;
+}
+
+int remote_callback(struct pollen_callback *callback, uint64_t n, void *data) {
+    remote_total += n;
+    if (remote_total == N_CROSS_THREAD) {
+        pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    }
+    return 0;
+}
+
+void *remote_thread(void *data) {
+    for (int i = 0; i < N_CROSS_THREAD; i++) {
+        assert(pollen_efd_trigger(remote));
+    }
+    return NULL;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+
+    assert((loop = pollen_loop_create()));
+    assert((first = pollen_loop_add_efd(loop, first_callback, NULL)));
+    assert((second = pollen_loop_add_efd(loop, second_callback, NULL)));
+    assert((removed = pollen_loop_add_efd(loop, removed_callback, NULL)));
+    assert((remote = pollen_loop_add_efd(loop, remote_callback, NULL)));
+
+    /* outside of the loop, triggers have to wake it up */
+    assert(pollen_efd_trigger(first));
+    assert(readable(first->fd));
+
+    /* pending callbacks run at the end of the iteration that triggered them */
+    assert(pollen_loop_dispatch(loop, -1) == 1);
+    assert(first_ran_at == 0 && second_ran_at == 0);
+
+    /* the rest of the chain doesn't block, and keeps epoll fd readable for embedding */
+    while (second_runs < 5) {
+        assert(readable(pollen_loop_get_fd(loop)));
+        iteration += 1;
+        assert(pollen_loop_dispatch(loop, -1) >= 0);
+        assert(second_ran_at == iteration);
+    }
+    assert(second_runs == 5);
+
+    /* nothing is lost when another thread triggers concurrently */
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, remote_thread, NULL) == 0);
+    assert(pollen_loop_run(loop) == 0);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(remote_total == N_CROSS_THREAD);
+
+    pollen_loop_cleanup(loop);
+}
@@ -0,0 +1,150 @@
+#include <sys/socket.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define MS 1000000ULL
+
+static uint64_t start;
+static char order[64];
+static int n_order = 0;
+static int periodic_fired = 0;
+static uint64_t periodic_last = 0;
+
+static uint64_t real_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int periodic_callback(struct pollen_callback *callback, void *data) {
+    struct pollen_loop *loop = pollen_callback_get_loop(callback);
+    periodic_fired += 1;
+    periodic_last = pollen_loop_now(loop);
+    return 0;
+}
+
+int oneshot_callback(struct pollen_callback *callback, void *data) {
+    order[n_order++] = *(const char *)data;
+    return 0;
+}
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    return 0;
+}
+
+static uint64_t timed_out_at = 0;
+
+int timeout_callback(struct pollen_callback *callback, int fd, void *data) {
+    timed_out_at = pollen_loop_now(pollen_callback_get_loop(callback));
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *periodic, *oneshots[3], *migrated, *conn;
+
+    /* failed switch gives timers that were already moved back to their timerfds */
+    struct pollen_loop *failing;
+    struct pollen_callback *armed, *broken;
+    assert((failing = pollen_loop_create()));
+    assert((armed = pollen_loop_add_timer(failing, CLOCK_MONOTONIC, oneshot_callback, "x")));
+    assert((broken = pollen_loop_add_timer(failing, CLOCK_MONOTONIC, oneshot_callback, "y")));
+    assert(pollen_timer_arm_ns(armed, false, 20 * MS, 0));
+    const int not_timerfd = eventfd(0, EFD_CLOEXEC);
+    assert(dup2(not_timerfd, broken->fd) == broken->fd);
+    close(not_timerfd);
+    assert(!pollen_loop_use_virtual_time(failing, false));
+    assert(errno == EINVAL);
+    assert(pollen_loop_run_for(failing, 200 * MS) == 0);
+    assert(n_order == 1 && order[0] == 'x');
+    n_order = 0;
+    pollen_loop_cleanup(failing);
+
+    assert((loop = pollen_loop_create()));
+
+    /* timers armed before the switch keep their remaining time */
+    assert((migrated = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, oneshot_callback, "m")));
+    assert(pollen_timer_arm_ns(migrated, false, 5000 * MS, 0));
+
+    assert(pollen_loop_use_virtual_time(loop, true));
+    start = pollen_loop_now(loop);
+
+    assert((periodic = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, periodic_callback, NULL)));
+    assert(pollen_timer_arm_ns(periodic, false, 100 * MS, 100 * MS));
+
+    /* same deadline fires in arming order, whatever the clock */
+    assert((oneshots[0] = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, oneshot_callback, "a")));
+    assert((oneshots[1] = pollen_loop_add_timer(loop, CLOCK_REALTIME, oneshot_callback, "b")));
+    assert((oneshots[2] = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, oneshot_callback, "c")));
+    assert(pollen_timer_arm_ns(oneshots[2], false, 2500 * MS, 0));
+    assert(pollen_timer_arm_ns(oneshots[0], false, 2500 * MS, 0));
+    assert(pollen_timer_arm_after(oneshots[1], 1000 * MS, 0));
+    assert(pollen_timer_arm_ns(oneshots[1], true, start + 2500 * MS, 0));
+
+    /* ten virtual seconds take no real time */
+    const uint64_t real_start = real_ns();
+    assert(pollen_loop_run_for(loop, 10000 * MS) == 0);
+    assert(real_ns() - real_start < 1000 * MS);
+
+    assert(pollen_loop_now(loop) == start + 10000 * MS);
+    /* fires exactly on its deadlines */
+    assert(periodic_fired == 100);
+    assert(periodic_last == start + 10000 * MS);
+    assert(n_order == 4);
+    assert(memcmp(order, "cabm", 4) == 0);
+
+    /* manual mode, time stands still until advanced */
+    assert(pollen_loop_use_virtual_time(loop, false));
+    assert(pollen_timer_arm_ns(oneshots[0], false, 50 * MS, 0));
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(periodic_fired == 100 && n_order == 4);
+
+    pollen_loop_advance_time(loop, 50 * MS);
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(n_order == 5 && order[4] == 'a');
+
+    /* periodic timer that missed several periods fires once and keeps its phase */
+    pollen_loop_advance_time(loop, 450 * MS);
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(periodic_fired == 101);
+    pollen_loop_advance_time(loop, 99 * MS);
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    pollen_loop_advance_time(loop, 1 * MS);
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(periodic_fired == 102);
+    assert(periodic_last == start + 10600 * MS);
+
+    /* disarming and removing armed timers */
+    assert(pollen_timer_disarm(periodic));
+    assert(pollen_timer_arm_ns(oneshots[2], false, 10 * MS, 0));
+    pollen_loop_remove_callback(oneshots[2]);
+    pollen_loop_advance_time(loop, 1000 * MS);
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+
+    /* inactivity timeouts follow virtual time */
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+    assert((conn = pollen_loop_add_fd(loop, sv[0], EPOLLIN, true, fd_callback, NULL)));
+    const uint64_t idle_since = pollen_loop_now(loop);
+    assert(pollen_fd_set_timeout(conn, 30000, timeout_callback));
+
+    assert(pollen_loop_use_virtual_time(loop, true));
+    assert(pollen_loop_run_for(loop, 29000 * MS) == 0);
+    assert(timed_out_at == 0);
+    assert(pollen_loop_run_for(loop, 2000 * MS) == 0);
+    assert(timed_out_at >= idle_since + 30000 * MS);
+    assert(timed_out_at <= idle_since + (30000 + POLLEN_TIMEOUT_GRANULARITY_MS) * MS);
+
+    close(sv[1]);
+    pollen_loop_cleanup(loop);
+
+    return 0;
+}
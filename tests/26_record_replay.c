@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+struct entry {
+    char what;
+    uint64_t arg;
+    uint64_t now;
+};
+
+struct run {
+    struct pollen_loop *loop;
+    struct pollen_callback *pipe, *efd, *timer, *idle;
+    int pipe_fds[2];
+    struct entry log[256];
+    int n_log;
+    int n_timer;
+};
+
+static void log_entry(struct run *run, char what, uint64_t arg) {
+    assert(run->n_log < 256);
+    run->log[run->n_log++] = (struct entry){ what, arg, pollen_loop_now(run->loop) };
+}
+
+int deferred_task(struct pollen_loop *loop, void *data) {
+    log_entry(data, 'd', 0);
+    return 0;
+}
+
+int pipe_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    struct run *run = data;
+    log_entry(run, 'p', events);
+
+    /* nothing to read during replay */
+    char buf[16];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+
+    /* ignored during replay, the recorded run of efd callback takes its place */
+    assert(pollen_efd_inc(run->efd, 2));
+    /* not a callback, runs again during replay */
+    assert(pollen_loop_defer(run->loop, deferred_task, run));
+    return 0;
+}
+
+int efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    log_entry(data, 'e', val);
+    return 0;
+}
+
+int timer_callback(struct pollen_callback *callback, void *data) {
+    struct run *run = data;
+    log_entry(run, 't', 0);
+
+    if (run->n_timer++ < 3) {
+        assert(write(run->pipe_fds[1], "x", 1) == 1);
+    } else if (run->n_timer == 5) {
+        pollen_loop_quit(run->loop, 42);
+    }
+    return 0;
+}
+
+int idle_callback(struct pollen_callback *callback, void *data) {
+    log_entry(data, 'i', 0);
+    return 0;
+}
+
+static void setup(struct run *run) {
+    memset(run, 0, sizeof(*run));
+    assert((run->loop = pollen_loop_create()));
+    assert(pipe2(run->pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0);
+    assert((run->pipe = pollen_loop_add_fd(run->loop, run->pipe_fds[0], EPOLLIN, true,
+                                           pipe_callback, run)));
+    assert((run->efd = pollen_loop_add_efd(run->loop, efd_callback, run)));
+    assert((run->timer = pollen_loop_add_timer(run->loop, CLOCK_MONOTONIC, timer_callback, run)));
+    assert((run->idle = pollen_loop_add_idle(run->loop, 0, idle_callback, run)));
+}
+
+static void teardown(struct run *run) {
+    pollen_loop_cleanup(run->loop);
+    close(run->pipe_fds[1]);
+}
+
+int main(void) {
+    static struct run recorded, replayed;
+    FILE *file;
+
+    assert((file = tmpfile()));
+
+    setup(&recorded);
+    assert(pollen_loop_record_start(recorded.loop, file));
+    assert(pollen_timer_arm_ns(recorded.timer, false, 2000000, 2000000));
+    assert(pollen_loop_run(recorded.loop) == 42);
+    pollen_loop_record_stop(recorded.loop);
+    assert(recorded.n_timer == 5);
+    const uint32_t recorded_pipe_id = pollen_callback_get_id(recorded.pipe);
+    teardown(&recorded);
+
+    /* same callbacks added in the same order get the same ids */
+    setup(&replayed);
+    assert(pollen_callback_get_id(replayed.pipe) == recorded_pipe_id);
+    assert(pollen_callback_get_id(replayed.timer) > pollen_callback_get_id(replayed.efd));
+
+    /* timer is not armed, everything comes from the recording */
+    rewind(file);
+    assert(pollen_loop_replay(replayed.loop, file) == 42);
+    assert(replayed.n_log == recorded.n_log);
+    for (int i = 0; i < recorded.n_log; i++) {
+        assert(replayed.log[i].what == recorded.log[i].what);
+        assert(replayed.log[i].arg == recorded.log[i].arg);
+        assert(replayed.log[i].now == recorded.log[i].now);
+    }
+
+    /* sanity check of what was recorded */
+    int n_pipe = 0, n_efd = 0, n_deferred = 0;
+    for (int i = 0; i < recorded.n_log; i++) {
+        if (recorded.log[i].what == 'p') {
+            assert(recorded.log[i].arg == EPOLLIN);
+            n_pipe += 1;
+        } else if (recorded.log[i].what == 'e') {
+            assert(recorded.log[i].arg == 2);
+            n_efd += 1;
+        } else if (recorded.log[i].what == 'd') {
+            assert(recorded.log[i - 1].what == 'p');
+            n_deferred += 1;
+        }
+    }
+    assert(n_pipe == 3 && n_efd == 3 && n_deferred == 3);
+    teardown(&replayed);
+
+    /* callbacks missing in the replaying program are skipped */
+    rewind(file);
+    setup(&replayed);
+    pollen_loop_remove_callback(replayed.idle);
+    assert(pollen_loop_replay(replayed.loop, file) == 42);
+    assert(replayed.n_timer == 5);
+    for (int i = 0; i < replayed.n_log; i++) {
+        assert(replayed.log[i].what != 'i');
+    }
+    teardown(&replayed);
+
+    /* not a recording */
+    rewind(file);
+    assert(fwrite("garbage!", 8, 1, file) == 1);
+    rewind(file);
+    setup(&replayed);
+    assert(pollen_loop_replay(replayed.loop, file) == -EINVAL);
+    teardown(&replayed);
+
+    fclose(file);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+int efd_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    usleep(2000);
+    return 0;
+}
+
+int timer_callback(struct pollen_callback *callback, void *data) {
+    return 0;
+}
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *efds[3], *timer;
+    struct pollen_metrics m;
+
+    assert((loop = pollen_loop_create()));
+    for (int i = 0; i < 3; i++) {
+        assert((efds[i] = pollen_loop_add_efd(loop, efd_callback, NULL)));
+    }
+    assert((timer = pollen_loop_add_timer(loop, CLOCK_MONOTONIC, timer_callback, NULL)));
+
+    int fd = pollen_loop_metrics_start(loop);
+    assert(fd >= 0);
+    assert(pollen_loop_metrics_start(loop) == fd);
+
+    /* map it the way another process would */
+    char path[64], target[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    assert(len > 0);
+    target[len] = '\0';
+    assert(strncmp(target, "/memfd:pollen-metrics", strlen("/memfd:pollen-metrics")) == 0);
+
+    int reader_fd = open(path, O_RDONLY);
+    assert(reader_fd >= 0);
+    const struct pollen_metrics *page =
+        mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, reader_fd, 0);
+    assert(page != MAP_FAILED);
+    close(reader_fd);
+
+    /* callbacks added before metrics were started are counted */
+    assert(pollen_metrics_read(page, &m));
+    assert(m.iterations == 0);
+    assert(m.callbacks[POLLEN_CALLBACK_TYPE_EFD] == 3);
+    assert(m.callbacks[POLLEN_CALLBACK_TYPE_TIMER] == 1);
+
+    /* two events in one iteration, then an empty one */
+    assert(pollen_efd_trigger(efds[0]));
+    assert(pollen_efd_trigger(efds[1]));
+    assert(pollen_loop_dispatch(loop, 0) == 2);
+    assert(pollen_loop_dispatch(loop, 5000000) == 0);
+
+    assert(pollen_metrics_read(page, &m));
+    assert(m.seq % 2 == 0 && m.seq > 0);
+    assert(m.iterations == 2);
+    assert(m.events == 2);
+    assert(m.last_events == 0);
+    assert(m.busy_ns >= 4000000);
+    assert(m.max_busy_ns >= 4000000 && m.max_busy_ns <= m.busy_ns);
+    assert(m.wait_ns >= 5000000);
+    assert(m.fds == 4);
+
+    pollen_loop_remove_callback(efds[2]);
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(pollen_metrics_read(page, &m));
+    assert(m.iterations == 3);
+    assert(m.callbacks[POLLEN_CALLBACK_TYPE_EFD] == 2);
+    assert(m.fds == 3);
+
+    /* fds added by a failed bulk add are rolled back from the counts too */
+    int a = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), b = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct pollen_fd_spec bad[] = {
+        { .fd = a, .events = EPOLLIN, .callback = fd_callback },
+        { .fd = b, .events = EPOLLIN, .callback = fd_callback },
+        { .fd = a, .events = EPOLLIN, .callback = fd_callback },
+    };
+    assert(!pollen_loop_add_fds(loop, bad, 3, NULL));
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(pollen_metrics_read(page, &m));
+    assert(m.iterations == 4);
+    assert(m.callbacks[POLLEN_CALLBACK_TYPE_FD] == 0);
+    assert(m.fds == 3);
+    close(a);
+    close(b);
+
+    /* stopping leaves the last published values in place for whoever still has it mapped */
+    pollen_loop_metrics_stop(loop);
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(pollen_metrics_read(page, &m));
+    assert(m.iterations == 4);
+
+    /* not a metrics page */
+    static const struct pollen_metrics garbage = {0};
+    assert(!pollen_metrics_read(&garbage, &m));
+    assert(errno == EINVAL);
+
+    munmap((void *)page, sizeof(*page));
+    pollen_loop_cleanup(loop);
+
+    return 0;
+}
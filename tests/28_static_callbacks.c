@@ -0,0 +1,123 @@
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+static int n_allocs = 0;
+
+static void *counting_calloc(size_t n, size_t size) {
+    n_allocs += 1;
+    return calloc(n, size);
+}
+
+#define POLLEN_CALLOC(n, size) counting_calloc(n, size)
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_CONNS 16
+
+struct conn {
+    int peer;
+    int n_reads;
+    struct pollen_callback_storage storage;
+    struct pollen_callback_storage timer_storage;
+};
+
+static int n_timer = 0;
+
+int conn_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    struct conn *conn = (struct conn *)((char *)callback - offsetof(struct conn, storage));
+    assert(conn == data);
+
+    char buf[16];
+    assert(read(fd, buf, sizeof(buf)) > 0);
+    conn->n_reads += 1;
+
+    /* storage stays valid until the end of the iteration, it is a part of conn */
+    if (conn->n_reads == 2) {
+        pollen_loop_remove_callback(callback);
+    }
+    return 0;
+}
+
+int timer_callback(struct pollen_callback *callback, void *data) {
+    n_timer += 1;
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    static struct conn conns[N_CONNS];
+    struct pollen_callback *callbacks[N_CONNS], *timer;
+
+    assert((loop = pollen_loop_create()));
+
+    int fds[N_CONNS];
+    int max_fd = -1;
+    for (int i = 0; i < N_CONNS; i++) {
+        int sv[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+        fds[i] = sv[0];
+        conns[i].peer = sv[1];
+        max_fd = (sv[0] > max_fd) ? sv[0] : max_fd;
+    }
+    /* way past whatever table the loop starts with */
+    assert(pollen_loop_reserve_fds(loop, max_fd + 1000));
+
+    /* nothing is allocated from here on */
+    const int allocs_before = n_allocs;
+
+    for (int i = 0; i < N_CONNS; i++) {
+        callbacks[i] = pollen_loop_add_fd_static(loop, &conns[i].storage, fds[i], EPOLLIN, true,
+                                                 conn_callback, &conns[i]);
+        assert(callbacks[i] == (struct pollen_callback *)&conns[i].storage);
+        assert(pollen_callback_get_loop(callbacks[i]) == loop);
+    }
+    assert((timer = pollen_loop_add_timer_static(loop, &conns[0].timer_storage, CLOCK_MONOTONIC,
+                                                 timer_callback, NULL)));
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < N_CONNS; i++) {
+            assert(write(conns[i].peer, "x", 1) == 1);
+        }
+        assert(pollen_loop_dispatch(loop, 0) == N_CONNS);
+    }
+    for (int i = 0; i < N_CONNS; i++) {
+        assert(conns[i].n_reads == 2);
+    }
+    /* autoclose closed the fds on removal */
+    assert(fcntl(fds[0], F_GETFD) < 0 && errno == EBADF);
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+
+    assert(pollen_timer_arm_ns(timer, false, 1000000, 0));
+    assert(pollen_loop_dispatch(loop, 100) == 1);
+    assert(n_timer == 1);
+
+    assert(n_allocs == allocs_before);
+
+    /* storage is reusable after removal, this time for a callback left to cleanup */
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+    assert((callbacks[0] = pollen_loop_add_fd_static(loop, &conns[0].storage, sv[0], EPOLLIN,
+                                                     true, conn_callback, &conns[0])));
+    assert(n_allocs == allocs_before);
+
+    /* errors leave storage unused */
+    assert(!pollen_loop_add_fd_static(loop, &conns[1].storage, sv[0], EPOLLIN, false,
+                                      conn_callback, &conns[1]));
+    assert(errno == EEXIST);
+
+    /* cleanup does not try to free caller-owned storage */
+    pollen_loop_cleanup(loop);
+
+    for (int i = 0; i < N_CONNS; i++) {
+        close(conns[i].peer);
+    }
+    close(sv[1]);
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <sys/socket.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_CONNS 8
+
+static struct pollen_callback *conns[N_CONNS];
+static int fds[N_CONNS], peers[N_CONNS];
+static int n_batches = 0;
+static size_t last_batch_size = 0;
+static char log_buf[256];
+static int n_log = 0;
+
+static void drain(int fd) {
+    char buf[16];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+int conn_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    log_buf[n_log++] = 'c';
+    drain(fd);
+
+    /* conn 0 runs on its own and kills conn 1 before the batch gets to it */
+    if (callback == conns[0] && conns[1] != NULL) {
+        pollen_loop_remove_callback(conns[1]);
+        conns[1] = NULL;
+    }
+    return 0;
+}
+
+int batch_fn(struct pollen_loop *loop, const struct pollen_fd_event *events, size_t n,
+             void *data) {
+    n_batches += 1;
+    last_batch_size = n;
+    log_buf[n_log++] = 'b';
+
+    for (size_t i = 0; i < n; i++) {
+        assert(events[i].events == EPOLLIN);
+        assert(pollen_callback_get_loop(events[i].callback) == loop);
+        assert(events[i].callback != conns[0]);
+        const int n_conn = (int *)events[i].data - peers;
+        assert(events[i].callback == conns[n_conn] && events[i].fd == fds[n_conn]);
+        drain(events[i].fd);
+    }
+    return (data != NULL) ? -7 : 0;
+}
+
+static void write_all(void) {
+    for (int i = 0; i < N_CONNS; i++) {
+        if (conns[i] != NULL) {
+            assert(write(peers[i], "x", 1) == 1);
+        }
+    }
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_fd_batch *batch;
+
+    assert((loop = pollen_loop_create()));
+    assert((batch = pollen_loop_add_fd_batch(loop, batch_fn, NULL)));
+
+    for (int i = 0; i < N_CONNS; i++) {
+        int sv[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+        fds[i] = sv[0];
+        peers[i] = sv[1];
+        assert((conns[i] = pollen_loop_add_fd(loop, sv[0], EPOLLIN, true, conn_callback,
+                                              &peers[i])));
+        if (i > 0) {
+            assert(pollen_fd_set_batch(conns[i], batch));
+        }
+    }
+
+    /* one handler call for the whole group, after the fd that is not in it */
+    write_all();
+    assert(pollen_loop_dispatch(loop, 0) == N_CONNS);
+    assert(n_batches == 1);
+    assert(last_batch_size == N_CONNS - 2);
+    assert(n_log == 2 && memcmp(log_buf, "cb", 2) == 0);
+
+    /* nothing ready, no handler call */
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(n_batches == 1);
+
+    /* detached fd runs its own callback again */
+    assert(pollen_fd_set_batch(conns[2], NULL));
+    n_log = 0;
+    write_all();
+    assert(pollen_loop_dispatch(loop, 0) == N_CONNS - 1);
+    assert(n_batches == 2);
+    assert(last_batch_size == N_CONNS - 3);
+    assert(n_log == 3 && memcmp(log_buf, "ccb", 3) == 0);
+
+    /* replay runs the handler once per recorded batch too */
+    FILE *file = tmpfile();
+    assert(file);
+    assert(pollen_loop_record_start(loop, file));
+    write_all();
+    assert(pollen_loop_dispatch(loop, 0) == N_CONNS - 1);
+    pollen_loop_record_stop(loop);
+    rewind(file);
+    n_log = 0;
+    assert(pollen_loop_replay(loop, file) == 0);
+    assert(n_batches == 4);
+    assert(last_batch_size == N_CONNS - 3);
+    assert(n_log == 3 && memcmp(log_buf, "ccb", 3) == 0);
+    fclose(file);
+
+    /* recording with more events for a batch than fit in it runs the batch as it fills up */
+    assert((file = tmpfile()));
+    struct pollen_record record = { .value = pollen_loop_now(loop), .id = 0, .events = 0 };
+    assert(fwrite(POLLEN_RECORD_MAGIC, 8, 1, file) == 1);
+    assert(fwrite(&record, sizeof(record), 1, file) == 1);
+    record.id = pollen_callback_get_id(conns[3]);
+    record.events = EPOLLIN;
+    for (int i = 0; i < POLLEN_EPOLL_MAX_EVENTS + 3; i++) {
+        assert(fwrite(&record, sizeof(record), 1, file) == 1);
+    }
+    rewind(file);
+    assert(pollen_loop_replay(loop, file) == 0);
+    assert(n_batches == 6);
+    assert(last_batch_size == 3);
+    fclose(file);
+
+    /* only fd callbacks of the same loop can be attached */
+    struct pollen_callback *idle = pollen_loop_add_idle(loop, 0, NULL, NULL);
+    assert(idle);
+    assert(!pollen_fd_set_batch(idle, batch));
+    assert(errno == EINVAL);
+    pollen_loop_remove_callback(idle);
+
+    /* handler failure stops the loop like any callback */
+    struct pollen_fd_batch *failing = pollen_loop_add_fd_batch(loop, batch_fn, (void *)1);
+    assert(failing);
+    assert(pollen_fd_set_batch(conns[3], failing));
+    write_all();
+    assert(pollen_loop_dispatch(loop, 0) == -7);
+    drain(fds[3]);
+
+    /* destroyed batch gives its fds back to their own callbacks */
+    pollen_fd_batch_destroy(failing);
+    n_log = 0;
+    write_all();
+    assert(pollen_loop_dispatch(loop, 0) >= 0);
+    pollen_fd_batch_destroy(batch);
+    n_log = 0;
+    write_all();
+    assert(pollen_loop_dispatch(loop, 0) == N_CONNS - 1);
+    assert(n_log == N_CONNS - 1);
+    assert(memchr(log_buf, 'b', n_log) == NULL);
+
+    /* batches left alive are freed with the loop */
+    assert(pollen_loop_add_fd_batch(loop, batch_fn, NULL));
+    pollen_loop_cleanup(loop);
+
+    for (int i = 0; i < N_CONNS; i++) {
+        close(peers[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+static int n_allocs = 0;
+
+static void *counting_calloc(size_t n, size_t size) {
+    n_allocs += 1;
+    return calloc(n, size);
+}
+
+#define POLLEN_CALLOC(n, size) counting_calloc(n, size)
+#define POLLEN_DEFER_CAPACITY 8
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+static char log_buf[256];
+static int n_log = 0;
+static int seq[64];
+static int n_seq = 0;
+
+int log_task(struct pollen_loop *loop, void *data) {
+    log_buf[n_log++] = *(const char *)data;
+    return 0;
+}
+
+int seq_task(struct pollen_loop *loop, void *data) {
+    seq[n_seq++] = (int)(intptr_t)data;
+    return 0;
+}
+
+int requeue_task(struct pollen_loop *loop, void *data) {
+    log_buf[n_log++] = 'r';
+    assert(pollen_loop_defer(loop, log_task, "R"));
+    return 0;
+}
+
+int failing_task(struct pollen_loop *loop, void *data) {
+    return -5;
+}
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    char buf[16];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+
+    log_buf[n_log++] = 'f';
+    assert(pollen_loop_defer(pollen_callback_get_loop(callback), log_task, "d"));
+    return 0;
+}
+
+int idle_callback(struct pollen_callback *callback, void *data) {
+    log_buf[n_log++] = 'i';
+    return 0;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    int sv1[2], sv2[2];
+
+    assert((loop = pollen_loop_create()));
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv1) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv2) == 0);
+    assert(pollen_loop_add_fd(loop, sv1[0], EPOLLIN, true, fd_callback, NULL));
+    assert(pollen_loop_add_fd(loop, sv2[0], EPOLLIN, true, fd_callback, NULL));
+    assert(pollen_loop_add_idle(loop, 0, idle_callback, NULL));
+
+    /* queued task doesn't let the loop block */
+    assert(pollen_loop_defer(loop, log_task, "a"));
+    const time_t start = time(NULL);
+    assert(pollen_loop_dispatch(loop, 10000000000) == 0);
+    assert(time(NULL) - start < 5);
+    assert(n_log == 2 && memcmp(log_buf, "ai", 2) == 0);
+
+    /* runs once */
+    n_log = 0;
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(n_log == 1 && log_buf[0] == 'i');
+
+    /* tasks deferred by fd callbacks run after all of them, before idle callbacks */
+    n_log = 0;
+    assert(write(sv1[1], "x", 1) == 1);
+    assert(write(sv2[1], "x", 1) == 1);
+    assert(pollen_loop_dispatch(loop, 100) == 2);
+    assert(n_log == 5 && memcmp(log_buf, "ffddi", 5) == 0);
+
+    /* task deferred by a task waits for the next iteration */
+    n_log = 0;
+    assert(pollen_loop_defer(loop, requeue_task, NULL));
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    /* leftover task made epoll fd readable through the wake-up efd, see pollen_loop_get_fd */
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(n_log == 4 && memcmp(log_buf, "riRi", 4) == 0);
+
+    /* steady state doesn't allocate, overflowing the ring does once, order is kept */
+    int allocs_before = n_allocs;
+    for (int round = 0; round < 100; round++) {
+        for (int i = 0; i < POLLEN_DEFER_CAPACITY; i++) {
+            assert(pollen_loop_defer(loop, seq_task, (void *)(intptr_t)i));
+        }
+        n_seq = 0;
+        assert(pollen_loop_dispatch(loop, 0) == 0);
+        assert(n_seq == POLLEN_DEFER_CAPACITY);
+    }
+    assert(n_allocs == allocs_before);
+
+    for (int i = 0; i < 3; i++) {
+        assert(pollen_loop_defer(loop, seq_task, NULL));
+    }
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    /* head is not at 0 now, so growing has to unwrap the ring */
+    for (int i = 0; i < POLLEN_DEFER_CAPACITY * 3; i++) {
+        assert(pollen_loop_defer(loop, seq_task, (void *)(intptr_t)i));
+    }
+    assert(n_allocs == allocs_before + 2);
+    n_seq = 0;
+    assert(pollen_loop_dispatch(loop, 0) == 0);
+    assert(n_seq == POLLEN_DEFER_CAPACITY * 3);
+    for (int i = 0; i < n_seq; i++) {
+        assert(seq[i] == i);
+    }
+
+    /* failing task stops the loop, the rest run next time */
+    n_log = 0;
+    assert(pollen_loop_defer(loop, failing_task, NULL));
+    assert(pollen_loop_defer(loop, log_task, "b"));
+    assert(pollen_loop_dispatch(loop, 0) == -5);
+    assert(n_log == 0);
+    assert(pollen_loop_dispatch(loop, 0) == 1);
+    assert(n_log == 2 && memcmp(log_buf, "bi", 2) == 0);
+
+    /* tasks left in the queue are dropped */
+    assert(pollen_loop_defer(loop, failing_task, NULL));
+    pollen_loop_cleanup(loop);
+
+    close(sv1[1]);
+    close(sv2[1]);
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_GROUP_DEQUE_CAPACITY 16
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define N_LOOPS 4
+#define N_TASKS 400
+
+static struct pollen_loop *loops[N_LOOPS];
+static struct pollen_callback *quits[N_LOOPS], *spawners[N_LOOPS];
+static atomic_int ran[N_TASKS];
+static atomic_int ran_by[N_LOOPS];
+static atomic_int remaining;
+static atomic_int n_noops;
+
+static int loop_index(struct pollen_loop *loop) {
+    for (int i = 0; i < N_LOOPS; i++) {
+        if (loops[i] == loop) {
+            return i;
+        }
+    }
+    assert(0);
+    return -1;
+}
+
+static void spin_us(long us) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < us);
+}
+
+int cpu_task(struct pollen_loop *loop, void *data) {
+    const int n = (int)(intptr_t)data;
+    assert(atomic_fetch_add(&ran[n], 1) == 0);
+    atomic_fetch_add(&ran_by[loop_index(loop)], 1);
+    spin_us(200);
+
+    if (atomic_fetch_sub(&remaining, 1) == 1) {
+        for (int i = 0; i < N_LOOPS; i++) {
+            assert(pollen_efd_trigger(quits[i]));
+        }
+    }
+    return 0;
+}
+
+int noop_task(struct pollen_loop *loop, void *data) {
+    atomic_fetch_add(&n_noops, 1);
+    return 0;
+}
+
+int quit_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    pollen_loop_quit(pollen_callback_get_loop(callback), 0);
+    return 0;
+}
+
+/* spawns the whole backlog on the loop thread, other loops are asleep by then */
+int spawn_callback(struct pollen_callback *callback, uint64_t val, void *data) {
+    struct pollen_loop *loop = pollen_callback_get_loop(callback);
+    for (int i = 0; i < N_TASKS; i++) {
+        assert(pollen_loop_spawn(loop, cpu_task, (void *)(intptr_t)i));
+    }
+    return 0;
+}
+
+void *loop_thread(void *data) {
+    assert(pollen_loop_run(data) == 0);
+    return NULL;
+}
+
+/* sleeps for a while, then leaves the group while the other loop keeps waking it */
+void *leaving_thread(void *data) {
+    assert(pollen_loop_run_for(data, 20000000) == 0);
+    pollen_loop_cleanup(data);
+    return NULL;
+}
+
+static void reset(void) {
+    atomic_store(&remaining, N_TASKS);
+    for (int i = 0; i < N_TASKS; i++) {
+        atomic_store(&ran[i], 0);
+    }
+    for (int i = 0; i < N_LOOPS; i++) {
+        atomic_store(&ran_by[i], 0);
+    }
+}
+
+static void check(void) {
+    int total = 0, busy_loops = 0;
+    for (int i = 0; i < N_TASKS; i++) {
+        assert(atomic_load(&ran[i]) == 1);
+    }
+    for (int i = 0; i < N_LOOPS; i++) {
+        total += atomic_load(&ran_by[i]);
+        busy_loops += (atomic_load(&ran_by[i]) > 0);
+    }
+    assert(total == N_TASKS);
+    /* backlog of one loop was spread over others */
+    assert(busy_loops > 1);
+}
+
+static void run_all(void) {
+    pthread_t threads[N_LOOPS];
+    for (int i = 0; i < N_LOOPS; i++) {
+        assert(pthread_create(&threads[i], NULL, loop_thread, loops[i]) == 0);
+    }
+    if (spawners[0] != NULL) {
+        /* let the loops go to sleep first, so only waking can get them to the work */
+        usleep(50000);
+        assert(pollen_efd_trigger(spawners[0]));
+    }
+    for (int i = 0; i < N_LOOPS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+}
+
+int main(void) {
+    struct pollen_group *group;
+
+    assert((group = pollen_group_create(N_LOOPS)));
+    for (int i = 0; i < N_LOOPS; i++) {
+        assert((loops[i] = pollen_loop_create()));
+        assert((quits[i] = pollen_loop_add_efd(loops[i], quit_callback, NULL)));
+        assert(pollen_group_add_loop(group, loops[i]));
+    }
+
+    /* only loops in a group can spawn, and only into one group */
+    struct pollen_loop *outsider = pollen_loop_create();
+    assert(outsider);
+    assert(!pollen_loop_spawn(outsider, cpu_task, NULL));
+    assert(errno == EINVAL);
+    assert(!pollen_group_add_loop(group, outsider));
+    assert(errno == ENOSPC);
+    assert(!pollen_group_add_loop(group, loops[0]));
+    assert(errno == EEXIST);
+    pollen_loop_cleanup(outsider);
+
+    /* backlog queued before the loops start, the others steal as soon as they run */
+    reset();
+    for (int i = 0; i < N_TASKS; i++) {
+        assert(pollen_loop_spawn(loops[0], cpu_task, (void *)(intptr_t)i));
+    }
+    run_all();
+    check();
+
+    /* backlog queued while the others sleep in epoll_wait */
+    reset();
+    assert((spawners[0] = pollen_loop_add_efd(loops[0], spawn_callback, NULL)));
+    run_all();
+    check();
+
+    /* group can go first, loops keep working without it */
+    pollen_group_destroy(group);
+    assert(!pollen_loop_spawn(loops[0], cpu_task, NULL));
+    for (int i = 0; i < N_LOOPS; i++) {
+        assert(pollen_efd_trigger(quits[i]));
+        assert(pollen_loop_run(loops[i]) == 0);
+        pollen_loop_cleanup(loops[i]);
+    }
+
+    /* or the other way around */
+    assert((group = pollen_group_create(1)));
+    assert((loops[0] = pollen_loop_create()));
+    assert(pollen_group_add_loop(group, loops[0]));
+    assert(pollen_loop_spawn(loops[0], cpu_task, (void *)(intptr_t)0));
+    pollen_loop_cleanup(loops[0]);
+    pollen_group_destroy(group);
+
+    /* loop can be cleaned up while others spawn, they stop waking it */
+    assert((group = pollen_group_create(2)));
+    for (int i = 0; i < 2; i++) {
+        assert((loops[i] = pollen_loop_create()));
+        assert(pollen_group_add_loop(group, loops[i]));
+    }
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, leaving_thread, loops[1]) == 0);
+    for (int i = 0; i < 2000; i++) {
+        assert(pollen_loop_spawn(loops[0], noop_task, NULL));
+        if (i % 100 == 0) {
+            usleep(2000);
+        }
+    }
+    assert(pthread_join(thread, NULL) == 0);
+    for (int i = 0; i < 100; i++) {
+        assert(pollen_loop_spawn(loops[0], noop_task, NULL));
+    }
+    while (atomic_load(&n_noops) < 2100) {
+        assert(pollen_loop_dispatch(loops[0], 0) >= 0);
+    }
+    pollen_loop_cleanup(loops[0]);
+    pollen_group_destroy(group);
+
+    return 0;
+}
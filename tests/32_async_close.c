@@ -0,0 +1,117 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#define POLLEN_LOG_DEBUG(fmt, ...) fprintf(stderr, "DEBUG: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_INFO(fmt, ...) fprintf(stderr, "INFO: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_WARN(fmt, ...) fprintf(stderr, "WARN: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_LOG_ERR(fmt, ...) fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int fd_callback(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
+    return 0;
+}
+
+/* Connected TCP socket whose close blocks for a second: peer doesn't read and it lingers. */
+static int slow_socket(int *listener_out, int *peer_out) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(listener >= 0);
+    assert(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(listener, 1) == 0);
+    assert(getsockname(listener, (struct sockaddr *)&addr, &len) == 0);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(fd >= 0);
+    const int small = 4096;
+    assert(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small)) == 0);
+    assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    int peer = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    assert(peer >= 0);
+    assert(setsockopt(peer, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small)) == 0);
+
+    /* fill everything up so some data is left unsent */
+    assert(fcntl(fd, F_SETFL, O_NONBLOCK) == 0);
+    char buf[4096] = {0};
+    while (write(fd, buf, sizeof(buf)) > 0) {}
+    assert(errno == EAGAIN);
+
+    const struct linger linger = { .l_onoff = 1, .l_linger = 1 };
+    assert(fcntl(fd, F_SETFL, 0) == 0);
+    assert(setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) == 0);
+
+    *listener_out = listener;
+    *peer_out = peer;
+    return fd;
+}
+
+int main(void) {
+    struct pollen_loop *loop;
+    struct pollen_callback *callback;
+    int listener, peer, sv[2];
+
+    assert((loop = pollen_loop_create()));
+    assert(pollen_loop_get_pending_closes(loop) == 0);
+    assert(pollen_loop_set_async_close(loop, true));
+    assert(pollen_loop_set_async_close(loop, true));
+
+    /* slow close doesn't hold up the loop */
+    const int fd = slow_socket(&listener, &peer);
+    assert((callback = pollen_loop_add_fd(loop, fd, EPOLLIN, true, fd_callback, NULL)));
+    uint64_t start = now_ms();
+    pollen_loop_remove_callback(callback);
+    assert(now_ms() - start < 200);
+    assert(pollen_loop_find_fd(loop, fd) == NULL);
+    assert(pollen_loop_get_pending_closes(loop) == 1);
+
+    /* queued behind the slow one, pending count goes back to 0 once both are closed */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert((callback = pollen_loop_add_fd(loop, sv[0], EPOLLIN, true, fd_callback, NULL)));
+    pollen_loop_remove_callback(callback);
+    while (pollen_loop_get_pending_closes(loop) != 0) {
+        usleep(10000);
+        assert(now_ms() - start < 5000);
+    }
+    assert(fcntl(fd, F_GETFD) < 0 && errno == EBADF);
+    char c;
+    assert(read(sv[1], &c, 1) == 0);
+    close(sv[1]);
+
+    /* disabling waits for queued closes */
+    close(peer);
+    const int fd2 = slow_socket(&listener, &peer);
+    assert((callback = pollen_loop_add_fd(loop, fd2, EPOLLIN, true, fd_callback, NULL)));
+    pollen_loop_remove_callback(callback);
+    assert(pollen_loop_set_async_close(loop, false));
+    assert(pollen_loop_get_pending_closes(loop) == 0);
+    assert(fcntl(fd2, F_GETFD) < 0 && errno == EBADF);
+    close(peer);
+
+    /* without the thread, closes are synchronous again */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert((callback = pollen_loop_add_fd(loop, sv[0], EPOLLIN, true, fd_callback, NULL)));
+    pollen_loop_remove_callback(callback);
+    assert(fcntl(sv[0], F_GETFD) < 0 && errno == EBADF);
+    close(sv[1]);
+
+    /* cleanup closes what is still queued */
+    assert(pollen_loop_set_async_close(loop, true));
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(pollen_loop_add_fd(loop, sv[0], EPOLLIN, true, fd_callback, NULL));
+    pollen_loop_cleanup(loop);
+    assert(fcntl(sv[0], F_GETFD) < 0 && errno == EBADF);
+    close(sv[1]);
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Prints metrics published by pollen loops with pollen_loop_metrics_start.
+ * Pages are found by pid via /proc/<pid>/fd, or opened by path, and mapped read-only,
+ * so reading them does not involve the monitored process at all.
+ * With an interval, keeps printing, with per-second rates since the previous print.
+ *
+ * Usage: metrics <pid|path> [interval_ms]
+ */
+#include <sys/mman.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define POLLEN_IMPLEMENTATION
+#include "pollen.h"
+
+#define MAX_PAGES 64
+
+static const char *const type_names[POLLEN_CALLBACK_TYPES] = {
+    [POLLEN_CALLBACK_TYPE_FD] = "fd",
+    [POLLEN_CALLBACK_TYPE_IDLE] = "idle",
+    [POLLEN_CALLBACK_TYPE_SIGNAL] = "signal",
+    [POLLEN_CALLBACK_TYPE_TIMER] = "timer",
+    [POLLEN_CALLBACK_TYPE_EFD] = "efd",
+    [POLLEN_CALLBACK_TYPE_CHANNEL] = "channel",
+    [POLLEN_CALLBACK_TYPE_DGRAM] = "dgram",
+    [POLLEN_CALLBACK_TYPE_LISTENER] = "listener",
+};
+
+struct page {
+    char path[320];
+    const struct pollen_metrics *map;
+    struct pollen_metrics prev;
+};
+
+static bool map_page(struct page *page, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+
+    void *map = mmap(NULL, sizeof(struct pollen_metrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    snprintf(page->path, sizeof(page->path), "%s", path);
+    page->map = map;
+    return true;
+}
+
+/* One process can have several loops, each with its own page. */
+static int find_pages(struct page *pages, const char *pid) {
+    char dir_path[64];
+    snprintf(dir_path, sizeof(dir_path), "/proc/%s/fd", pid);
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        perror(dir_path);
+        return 0;
+    }
+
+    int n = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && n < MAX_PAGES) {
+        char path[320], target[256];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+
+        const ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if (len < 0) {
+            continue;
+        }
+        target[len] = '\0';
+
+        if (strncmp(target, "/memfd:pollen-metrics", strlen("/memfd:pollen-metrics")) == 0 &&
+            map_page(&pages[n], path)) {
+            n += 1;
+        }
+    }
+
+    closedir(dir);
+    return n;
+}
+
+static void print_page(struct page *page, double interval_s) {
+    struct pollen_metrics m;
+    if (!pollen_metrics_read(page->map, &m)) {
+        fprintf(stderr, "%s: %s\n", page->path, strerror(errno));
+        return;
+    }
+
+    printf("%s\n", page->path);
+    printf("  iterations %lu, events %lu, last batch %lu\n",
+           m.iterations, m.events, m.last_events);
+    printf("  busy %.3f s, waiting %.3f s, longest iteration %.1f us\n",
+           m.busy_ns / 1e9, m.wait_ns / 1e9, m.max_busy_ns / 1e3);
+    if (interval_s > 0) {
+        const uint64_t busy = m.busy_ns - page->prev.busy_ns;
+        const uint64_t total = busy + (m.wait_ns - page->prev.wait_ns);
+        printf("  %.0f iterations/s, %.0f events/s, %.1f%% busy\n",
+               (m.iterations - page->prev.iterations) / interval_s,
+               (m.events - page->prev.events) / interval_s,
+               total ? 100.0 * busy / total : 0.0);
+    }
+    printf("  fds %lu, timeouts %lu, pending closes %lu, callbacks:",
+           m.fds, m.timeouts, m.pending_closes);
+    for (int i = 0; i < POLLEN_CALLBACK_TYPES; i++) {
+        if (m.callbacks[i] != 0) {
+            printf(" %s %lu", type_names[i], m.callbacks[i]);
+        }
+    }
+    printf("\n");
+
+    page->prev = m;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <pid|path> [interval_ms]\n", argv[0]);
+        return 1;
+    }
+    const long interval_ms = (argc > 2) ? atol(argv[2]) : 0;
+
+    static struct page pages[MAX_PAGES];
+    int n_pages;
+    if (strspn(argv[1], "0123456789") == strlen(argv[1])) {
+        n_pages = find_pages(pages, argv[1]);
+    } else {
+        n_pages = map_page(&pages[0], argv[1]) ? 1 : 0;
+    }
+    if (n_pages == 0) {
+        fprintf(stderr, "no metrics pages found\n");
+        return 1;
+    }
+
+    for (int i = 0; i < n_pages; i++) {
+        print_page(&pages[i], 0);
+    }
+
+    while (interval_ms > 0) {
+        const struct timespec ts = {
+            .tv_sec = interval_ms / 1000,
+            .tv_nsec = (interval_ms % 1000) * 1000000,
+        };
+        nanosleep(&ts, NULL);
+
+        printf("\n");
+        for (int i = 0; i < n_pages; i++) {
+            print_page(&pages[i], interval_ms / 1e3);
+        }
+        fflush(stdout);
+    }
+
+    return 0;
+}